@@ -0,0 +1,20 @@
+-- Functions reading arrays must handle run-encoded input, where a few bytes
+-- expand to many elements. Every query returns 1.
+
+
+-- 1000 evenly spaced timestamps compress to a single 5 byte stride run.
+WITH RECURSIVE s(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM s WHERE i < 999)
+SELECT
+	length(array_compress(array_agg(i * 5))) = 5
+	AND array_length(array_resample(array_compress(array_agg(i * 5)), array_compress(array_agg(i)), 0, 5, 100)) = 100
+	AND array_at(array_resample(array_compress(array_agg(i * 5)), array_compress(array_agg(i)), 0, 5, 100), 50) = 50
+FROM s;
+
+
+-- Compression never makes an array larger, small integers stay plain.
+WITH RECURSIVE s(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM s WHERE i < 999)
+SELECT
+	length(array_compress(array_agg(i % 2))) = length(array_agg(i % 2))
+	AND length(array_compress(array(0, 1, 0, 1, 0, 1, 1, 0, 0, 1))) = 10
+	AND array_decompress(array_compress(array_agg(i % 2))) = array_agg(i % 2)
+FROM s;
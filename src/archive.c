@@ -0,0 +1,628 @@
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_VTAB_TS 0
+#define ARCHIVE_VTAB_VALUE 1
+
+#define ARCHIVE_IDX_TS_EQ 0x01
+#define ARCHIVE_IDX_TS_LOWER 0x02
+#define ARCHIVE_IDX_TS_UPPER 0x04
+#define ARCHIVE_IDX_VALUE_EQ 0x08
+#define ARCHIVE_IDX_VALUE_LOWER 0x10
+#define ARCHIVE_IDX_VALUE_UPPER 0x20
+#define ARCHIVE_IDX_ARGS 6
+
+static void archive_writer_reset_block(archive_writer *w) {
+  w->ts.len = 0;
+  w->values.len = 0;
+  w->count = 0;
+  w->min_value = INFINITY;
+  w->max_value = -INFINITY;
+}
+
+static int archive_writer_write(archive_writer *w, const void *z, size_t n) {
+  if (n && fwrite(z, 1, n, w->f) != n) {
+    return SQLITE_IOERR;
+  }
+  w->offset += n;
+  return SQLITE_OK;
+}
+
+// Write the ts and value columns of the current block and add it to the
+// index.
+static int archive_writer_flush(archive_writer *w) {
+  if (!w->count) {
+    return SQLITE_OK;
+  }
+  sqlite3_int64 ts_offset = w->offset;
+  int rc = archive_writer_write(w, w->ts.buf, w->ts.len);
+  sqlite3_int64 values_offset = w->offset;
+  if (rc == SQLITE_OK) {
+    rc = archive_writer_write(w, w->values.buf, w->values.len);
+  }
+  if (rc == SQLITE_OK) {
+    rc = array_buffer_grow(&w->index, ARCHIVE_ENTRY_SIZE);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  array_buffer_append_uint64(&w->index, w->min_ts);
+  array_buffer_append_uint64(&w->index, w->max_ts);
+  array_buffer_append_uint64(&w->index, w->count);
+  array_buffer_append_uint64(&w->index, ts_offset);
+  array_buffer_append_uint64(&w->index, values_offset);
+  array_buffer_append_uint64(&w->index, w->values.len);
+  array_buffer_append_double(&w->index, w->min_value);
+  array_buffer_append_double(&w->index, w->max_value);
+  w->n_blocks++;
+  archive_writer_reset_block(w);
+  return SQLITE_OK;
+}
+
+// Error message for a failed row, or NULL if it was added.
+static const char *archive_writer_add(archive_writer *w, sqlite3_value *ts,
+                                      sqlite3_value *value) {
+  if (sqlite3_value_type(ts) != SQLITE_INTEGER) {
+    return "ts must be an integer";
+  }
+  sqlite3_int64 t = sqlite3_value_int64(ts);
+  if (w->n_rows && t < w->max_ts) {
+    return "rows must be ordered by ts";
+  }
+
+  if (array_buffer_append_uint64(&w->ts, t) ||
+      array_buffer_append_value(&w->values, value)) {
+    return "out of memory";
+  }
+  switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      double v = sqlite3_value_double(value);
+      w->min_value = fmin(w->min_value, v);
+      w->max_value = fmax(w->max_value, v);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      w->max_value = INFINITY;
+      break;
+  }
+  if (!w->count) {
+    w->min_ts = t;
+  }
+  w->max_ts = t;
+  w->count++;
+  w->n_rows++;
+
+  if (w->count == ARCHIVE_BLOCK_ROWS && archive_writer_flush(w)) {
+    return "could not write archive";
+  }
+  return NULL;
+}
+
+// Write the block index and fill in the header.
+static int archive_writer_finish(archive_writer *w) {
+  int rc = archive_writer_flush(w);
+  sqlite3_int64 index_offset = w->offset;
+  if (rc == SQLITE_OK) {
+    rc = archive_writer_write(w, w->index.buf, w->index.len);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  unsigned char header[ARCHIVE_HEADER_SIZE];
+  memcpy(header, ARCHIVE_MAGIC, 8);
+  put_u64(&header[8], w->n_rows);
+  put_u64(&header[16], w->n_blocks);
+  put_u64(&header[24], index_offset);
+  if (fseek(w->f, 0, SEEK_SET) ||
+      fwrite(header, 1, sizeof(header), w->f) != sizeof(header) ||
+      fflush(w->f) || fsync(fileno(w->f))) {
+    return SQLITE_IOERR;
+  }
+  return SQLITE_OK;
+}
+
+void archive_write_func(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  UNUSED(argc);
+
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  const char *query = (const char *)sqlite3_value_text(argv[0]);
+  const char *path = (const char *)sqlite3_value_text(argv[1]);
+  if (!query) {
+    sqlite3_result_error(context, "invalid query", -1);
+    return;
+  }
+  if (!path || !*path) {
+    sqlite3_result_error(context, "invalid path", -1);
+    return;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    return;
+  }
+  if (sqlite3_column_count(stmt) < 2) {
+    sqlite3_result_error(context, "query must return ts and value columns",
+                         -1);
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  // Archives are immutable: never overwrite one, it may be mapped by a
+  // reader.
+  archive_writer w;
+  memset(&w, 0, sizeof(w));
+  archive_writer_reset_block(&w);
+  w.f = fopen(path, "wbx");
+  if (!w.f) {
+    char *err =
+        sqlite3_mprintf("cannot create archive %s: %s", path, strerror(errno));
+    sqlite3_result_error(context, err ? err : "cannot create archive", -1);
+    sqlite3_free(err);
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  const char *err = NULL;
+  unsigned char header[ARCHIVE_HEADER_SIZE] = {0};
+  if (archive_writer_write(&w, header, sizeof(header))) {
+    err = "could not write archive";
+  }
+  while (!err && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    err = archive_writer_add(&w, sqlite3_column_value(stmt, 0),
+                             sqlite3_column_value(stmt, 1));
+  }
+  if (!err && rc != SQLITE_DONE) {
+    err = sqlite3_errmsg(db);
+  }
+  if (!err && archive_writer_finish(&w)) {
+    err = "could not write archive";
+  }
+  if (fclose(w.f) && !err) {
+    err = "could not write archive";
+  }
+
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    unlink(path);
+  } else {
+    sqlite3_result_int64(context, w.n_rows);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(w.ts.buf);
+  sqlite3_free(w.values.buf);
+  sqlite3_free(w.index.buf);
+}
+
+// Check the header and the block index against the file size and decode the
+// index. The blocks point into the mapping.
+static int archive_vtab_load(archive_vtab *vtab) {
+  const unsigned char *map = vtab->map;
+  sqlite3_uint64 size = vtab->size;
+  if (size < ARCHIVE_HEADER_SIZE || memcmp(map, ARCHIVE_MAGIC, 8)) {
+    return SQLITE_CORRUPT;
+  }
+  sqlite3_uint64 n_rows = get_u64(&map[8]);
+  sqlite3_uint64 n_blocks = get_u64(&map[16]);
+  sqlite3_uint64 index_offset = get_u64(&map[24]);
+  if (index_offset < ARCHIVE_HEADER_SIZE || index_offset > size ||
+      n_blocks > (size - index_offset) / ARCHIVE_ENTRY_SIZE) {
+    return SQLITE_CORRUPT;
+  }
+  if (!n_blocks) {
+    return n_rows ? SQLITE_CORRUPT : SQLITE_OK;
+  }
+
+  vtab->blocks = sqlite3_malloc64(n_blocks * sizeof(archive_block));
+  if (!vtab->blocks) {
+    return SQLITE_NOMEM;
+  }
+  vtab->n_blocks = n_blocks;
+
+  sqlite3_uint64 first_row = 0;
+  for (sqlite3_uint64 i = 0; i < n_blocks; i++) {
+    const unsigned char *e = &map[index_offset + i * ARCHIVE_ENTRY_SIZE];
+    archive_block *b = &vtab->blocks[i];
+    sqlite3_uint64 count = get_u64(&e[16]);
+    sqlite3_uint64 ts_offset = get_u64(&e[24]);
+    sqlite3_uint64 values_offset = get_u64(&e[32]);
+    sqlite3_uint64 values_len = get_u64(&e[40]);
+    if (!count || ts_offset > size || count > (size - ts_offset) / 8 ||
+        values_offset > size || values_len > size - values_offset ||
+        values_len > 0x7fffffff) {
+      return SQLITE_CORRUPT;
+    }
+    double_rep min_value, max_value;
+    min_value.d = get_u64(&e[48]);
+    max_value.d = get_u64(&e[56]);
+
+    b->min_ts = (sqlite3_int64)get_u64(&e[0]);
+    b->max_ts = (sqlite3_int64)get_u64(&e[8]);
+    b->first_row = first_row;
+    b->count = count;
+    b->ts = &map[ts_offset];
+    b->values = &map[values_offset];
+    b->values_len = (int)values_len;
+    b->min_value = min_value.f;
+    b->max_value = max_value.f;
+    if (i > 0 && b->min_ts < vtab->blocks[i - 1].max_ts) {
+      return SQLITE_CORRUPT;
+    }
+    first_row += count;
+  }
+  return first_row == n_rows ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+static int archive_vtab_disconnect(sqlite3_vtab *pVtab) {
+  archive_vtab *vtab = (archive_vtab *)pVtab;
+  if (vtab->map) {
+    munmap(vtab->map, vtab->size);
+  }
+  sqlite3_free(vtab->blocks);
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+// CREATE VIRTUAL TABLE name USING tslite_archive(path). The file is mapped
+// read-only for the lifetime of the table, dropping the table leaves it be.
+static int archive_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv,
+                                sqlite3_vtab **ppVtab, char **pzErr) {
+  UNUSED(pAux);
+
+  if (argc != 4) {
+    *pzErr = sqlite3_mprintf("usage: tslite_archive(path)");
+    return SQLITE_ERROR;
+  }
+
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(ts, value)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *path = vtab_dequote(argv[3]);
+  archive_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!path || !vtab) {
+    sqlite3_free(path);
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    *pzErr = sqlite3_mprintf("cannot open archive %s: %s", path,
+                             strerror(errno));
+    rc = SQLITE_CANTOPEN;
+  } else if (st.st_size < ARCHIVE_HEADER_SIZE) {
+    *pzErr = sqlite3_mprintf("malformed archive %s", path);
+    rc = SQLITE_CORRUPT;
+  } else {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      *pzErr = sqlite3_mprintf("cannot map archive %s: %s", path,
+                               strerror(errno));
+      rc = SQLITE_IOERR;
+    } else {
+      vtab->map = map;
+      vtab->size = st.st_size;
+      rc = archive_vtab_load(vtab);
+      if (rc == SQLITE_CORRUPT) {
+        *pzErr = sqlite3_mprintf("malformed archive %s", path);
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  sqlite3_free(path);
+
+  if (rc != SQLITE_OK) {
+    archive_vtab_disconnect(&vtab->base);
+    *ppVtab = NULL;
+  }
+  return rc;
+}
+
+static int archive_vtab_open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  archive_vtab_cursor *cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->eof = 1;
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static int archive_vtab_close(sqlite3_vtab_cursor *cur) {
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+static sqlite3_int64 archive_block_ts(const archive_block *b,
+                                      sqlite3_int64 row) {
+  return (sqlite3_int64)get_u64(&b->ts[8 * row]);
+}
+
+static int archive_vtab_malformed(archive_vtab_cursor *cursor) {
+  cursor->base.pVtab->zErrMsg = sqlite3_mprintf("malformed archive");
+  return SQLITE_CORRUPT;
+}
+
+// Read the row the cursor is on, or the first row of the next block that can
+// match the value bounds. Past the upper ts bound the cursor is at its end.
+static int archive_vtab_seek(archive_vtab_cursor *cursor) {
+  archive_vtab *vtab = (archive_vtab *)cursor->base.pVtab;
+  for (; cursor->block < vtab->n_blocks; cursor->block++, cursor->row = 0) {
+    const archive_block *b = &vtab->blocks[cursor->block];
+    if (b->min_ts > cursor->ts_upper) {
+      break;
+    }
+    if (cursor->row >= b->count || b->max_value < cursor->value_lower ||
+        b->min_value > cursor->value_upper) {
+      continue;
+    }
+
+    array_iter_init(&cursor->it, b->values, b->values_len);
+    if (array_iter_skip(&cursor->it, cursor->row) != cursor->row ||
+        array_iter_next(&cursor->it, &cursor->value) != 1) {
+      return archive_vtab_malformed(cursor);
+    }
+    cursor->ts = archive_block_ts(b, cursor->row);
+    cursor->eof = cursor->ts > cursor->ts_upper;
+    return SQLITE_OK;
+  }
+  cursor->eof = 1;
+  return SQLITE_OK;
+}
+
+static int archive_vtab_next(sqlite3_vtab_cursor *cur) {
+  archive_vtab_cursor *cursor = (archive_vtab_cursor *)cur;
+  archive_vtab *vtab = (archive_vtab *)cursor->base.pVtab;
+  const archive_block *b = &vtab->blocks[cursor->block];
+
+  cursor->row++;
+  if (cursor->row >= b->count) {
+    cursor->block++;
+    cursor->row = 0;
+    return archive_vtab_seek(cursor);
+  }
+  if (array_iter_next(&cursor->it, &cursor->value) != 1) {
+    return archive_vtab_malformed(cursor);
+  }
+  cursor->ts = archive_block_ts(b, cursor->row);
+  cursor->eof = cursor->ts > cursor->ts_upper;
+  return SQLITE_OK;
+}
+
+static int archive_vtab_eof(sqlite3_vtab_cursor *cur) {
+  archive_vtab_cursor *cursor = (archive_vtab_cursor *)cur;
+  return cursor->eof;
+}
+
+static int archive_vtab_column(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  archive_vtab_cursor *cursor = (archive_vtab_cursor *)cur;
+  switch (i) {
+    case ARCHIVE_VTAB_TS:
+      sqlite3_result_int64(context, cursor->ts);
+      break;
+    case ARCHIVE_VTAB_VALUE:
+      array_value_result(context, &cursor->value);
+      break;
+    default:
+      return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+static int archive_vtab_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  archive_vtab_cursor *cursor = (archive_vtab_cursor *)cur;
+  archive_vtab *vtab = (archive_vtab *)cursor->base.pVtab;
+  *pRowid = vtab->blocks[cursor->block].first_row + cursor->row;
+  return SQLITE_OK;
+}
+
+static int archive_value_bound(sqlite3_value *v, double *bound) {
+  int type = sqlite3_value_type(v);
+  if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+    return 0;
+  }
+  *bound = sqlite3_value_double(v);
+  return !isnan(*bound);
+}
+
+// Bounds are inclusive, so the cursor may return rows at an exclusive bound
+// and out of the value bounds: the constraints aren't omitted and SQLite
+// filters those rows.
+static int archive_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  UNUSED(idxStr);
+  UNUSED(argc);
+
+  archive_vtab_cursor *cursor = (archive_vtab_cursor *)cur;
+  archive_vtab *vtab = (archive_vtab *)cursor->base.pVtab;
+
+  sqlite3_int64 ts_lower = -0x7fffffffffffffffLL - 1;
+  sqlite3_int64 ts_upper = 0x7fffffffffffffffLL;
+  double value_lower = -INFINITY;
+  double value_upper = INFINITY;
+  sqlite3_int64 bound;
+  double value;
+  int i = 0;
+  if (idxNum & ARCHIVE_IDX_TS_EQ) {
+    if (vtab_ts_bound(argv[i], 0, &bound)) {
+      ts_lower = bound;
+    }
+    if (vtab_ts_bound(argv[i++], 1, &bound)) {
+      ts_upper = bound;
+    }
+  }
+  if (idxNum & ARCHIVE_IDX_TS_LOWER) {
+    if (vtab_ts_bound(argv[i++], 0, &bound) && bound > ts_lower) {
+      ts_lower = bound;
+    }
+  }
+  if (idxNum & ARCHIVE_IDX_TS_UPPER) {
+    if (vtab_ts_bound(argv[i++], 1, &bound) && bound < ts_upper) {
+      ts_upper = bound;
+    }
+  }
+  if (idxNum & ARCHIVE_IDX_VALUE_EQ) {
+    if (archive_value_bound(argv[i++], &value)) {
+      value_lower = value_upper = value;
+    }
+  }
+  if (idxNum & ARCHIVE_IDX_VALUE_LOWER) {
+    if (archive_value_bound(argv[i++], &value) && value > value_lower) {
+      value_lower = value;
+    }
+  }
+  if (idxNum & ARCHIVE_IDX_VALUE_UPPER) {
+    if (archive_value_bound(argv[i++], &value) && value < value_upper) {
+      value_upper = value;
+    }
+  }
+  cursor->ts_upper = ts_upper;
+  cursor->value_lower = value_lower;
+  cursor->value_upper = value_upper;
+  cursor->eof = 1;
+  if (ts_lower > ts_upper) {
+    return SQLITE_OK;
+  }
+
+  // First block that ends at or after the lower bound, then its first row at
+  // or after it.
+  sqlite3_int64 lo = 0, hi = vtab->n_blocks;
+  while (lo < hi) {
+    sqlite3_int64 mid = lo + (hi - lo) / 2;
+    if (vtab->blocks[mid].max_ts < ts_lower) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cursor->block = lo;
+  cursor->row = 0;
+  if (lo < vtab->n_blocks) {
+    const archive_block *b = &vtab->blocks[lo];
+    hi = b->count;
+    lo = 0;
+    while (lo < hi) {
+      sqlite3_int64 mid = lo + (hi - lo) / 2;
+      if (archive_block_ts(b, mid) < ts_lower) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    cursor->row = lo;
+  }
+  return archive_vtab_seek(cursor);
+}
+
+static int archive_vtab_best_index(sqlite3_vtab *vtab,
+                                   sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  // Constraint index per argument slot, in xFilter argument order.
+  int slots[ARCHIVE_IDX_ARGS] = {-1, -1, -1, -1, -1, -1};
+  int idxNum = 0;
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    if (!constraint->usable) {
+      continue;
+    }
+    int base;
+    if (constraint->iColumn == ARCHIVE_VTAB_TS) {
+      base = 0;
+    } else if (constraint->iColumn == ARCHIVE_VTAB_VALUE) {
+      base = 3;
+    } else {
+      continue;
+    }
+    int slot = -1;
+    switch (constraint->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        slot = base;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        slot = base + 1;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        slot = base + 2;
+        break;
+    }
+    if (slot >= 0 && slots[slot] < 0) {
+      slots[slot] = i;
+      idxNum |= 1 << slot;
+    }
+  }
+
+  int argvIndex = 1;
+  for (int slot = 0; slot < ARCHIVE_IDX_ARGS; slot++) {
+    if (slots[slot] >= 0) {
+      pIdxInfo->aConstraintUsage[slots[slot]].argvIndex = argvIndex++;
+    }
+  }
+  pIdxInfo->idxNum = idxNum;
+
+  pIdxInfo->estimatedCost = 1000000.0;
+  if (idxNum & ARCHIVE_IDX_TS_EQ) {
+    pIdxInfo->estimatedCost = 10.0;
+  } else if (idxNum & (ARCHIVE_IDX_TS_LOWER | ARCHIVE_IDX_TS_UPPER)) {
+    pIdxInfo->estimatedCost = 1000.0;
+  }
+  if (pIdxInfo->nOrderBy == 1 &&
+      pIdxInfo->aOrderBy[0].iColumn == ARCHIVE_VTAB_TS &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+sqlite3_module archive_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ archive_vtab_connect,
+    /* xConnect    */ archive_vtab_connect,
+    /* xBestIndex  */ archive_vtab_best_index,
+    /* xDisconnect */ archive_vtab_disconnect,
+    /* xDestroy    */ archive_vtab_disconnect,
+    /* xOpen       */ archive_vtab_open,
+    /* xClose      */ archive_vtab_close,
+    /* xFilter     */ archive_vtab_filter,
+    /* xNext       */ archive_vtab_next,
+    /* xEof        */ archive_vtab_eof,
+    /* xColumn     */ archive_vtab_column,
+    /* xRowid      */ archive_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
@@ -0,0 +1,78 @@
+#ifndef TSLITE_ARCHIVE_H
+#define TSLITE_ARCHIVE_H
+
+#include <stdio.h>
+
+#include "array.h"
+#include "array_buffer.h"
+#include "vtab.h"
+
+// Archive file layout, all integers big-endian:
+// - header: magic, row count, block count, offset of the block index.
+// - blocks: the ts column as 8-byte integers, followed by the value column
+//   as an array blob.
+// - block index: an ARCHIVE_ENTRY_SIZE entry per block with min_ts, max_ts,
+//   row count, ts offset, values offset, values length, min_value and
+//   max_value (doubles).
+#define ARCHIVE_MAGIC "TSLARCH1"
+#define ARCHIVE_HEADER_SIZE 32
+#define ARCHIVE_ENTRY_SIZE 64
+#define ARCHIVE_BLOCK_ROWS 4096
+
+typedef struct {
+  sqlite3_int64 min_ts;
+  sqlite3_int64 max_ts;
+  // Row number of the first row of the block.
+  sqlite3_int64 first_row;
+  sqlite3_int64 count;
+  const unsigned char *ts;
+  const unsigned char *values;
+  int values_len;
+  // Range of the numeric values. Blocks with TEXT or BLOB values have an
+  // infinite max_value, as those compare greater than any number.
+  double min_value;
+  double max_value;
+} archive_block;
+
+// State of tslite_archive_write: the block being filled and the index of the
+// blocks written so far.
+typedef struct {
+  FILE *f;
+  sqlite3_int64 offset;
+  sqlite3_int64 n_rows;
+  sqlite3_int64 n_blocks;
+  array_buffer ts;
+  array_buffer values;
+  array_buffer index;
+  sqlite3_int64 count;
+  sqlite3_int64 min_ts;
+  sqlite3_int64 max_ts;
+  double min_value;
+  double max_value;
+} archive_writer;
+
+typedef struct {
+  sqlite3_vtab base;
+  unsigned char *map;
+  size_t size;
+  sqlite3_int64 n_blocks;
+  archive_block *blocks;
+} archive_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 block;
+  sqlite3_int64 row;
+  sqlite3_int64 ts;
+  sqlite3_int64 ts_upper;
+  double value_lower;
+  double value_upper;
+  array_iter it;
+  array_value value;
+  int eof;
+} archive_vtab_cursor;
+
+void archive_write_func(sqlite3_context *context, int argc,
+                        sqlite3_value **argv);
+
+#endif  // TSLITE_ARCHIVE_H
@@ -1,9 +1,11 @@
 #include "array.h"
 
+#include <stdint.h>
+
 #include "array_buffer.h"
 #include "array_each.c"
 
-static int array_buffer_append_value(array_buffer *buf, sqlite3_value *item) {
+int array_buffer_append_value(array_buffer *buf, sqlite3_value *item) {
   int res;
 
   int type = sqlite3_value_type(item);
@@ -76,146 +78,49 @@ static int array_buffer_append_value(array_buffer *buf, sqlite3_value *item) {
   return res;
 }
 
-static int array_value_advance(unsigned char *z, int n) {
-  if (!z || n < 1) {
-    return -1;
-  }
-
-  int x;
-  switch (*z) {
-    case ARRAY_TYPE_NULL:
-    case ARRAY_TYPE_ONE:
-    case ARRAY_TYPE_ZERO:
-      return 1;
-
-    case ARRAY_TYPE_INTEGER:
-    case ARRAY_TYPE_INTEGER_NEG:
-      for (x = 1; x < n; x++) {
-        if (!(z[x] & 0x80)) {
-          if (x > 1 + 9) {  // 1 byte type identifier + max varint (9 bytes).
-            return -1;
-          }
-          return x + 1;
-        }
-      }
-      return -1;
-
-    case ARRAY_TYPE_FLOAT:
-      if (n < 9) {
-        return -1;
-      }
-      return 9;
-
-    case ARRAY_TYPE_BLOB:
-    case ARRAY_TYPE_TEXT:
-      if (n < 2) {
-        return -1;
-      }
-      sqlite3_uint64 v;
-      x = get_varint(&z[1], &v);
-      x = 1 + x + v;
-      if (n < x) {
-        return -1;
-      }
-      return x;
-  }
-
-  return -1;
-}
-
-static const char *array_value_type(unsigned char v) {
-  switch (v) {
-    case ARRAY_TYPE_NULL:
+static const char *array_value_type(int type) {
+  switch (type) {
+    case SQLITE_NULL:
       return "null";
 
-    case ARRAY_TYPE_ZERO:
-    case ARRAY_TYPE_ONE:
-    case ARRAY_TYPE_INTEGER:
-    case ARRAY_TYPE_INTEGER_NEG:
+    case SQLITE_INTEGER:
       return "integer";
 
-    case ARRAY_TYPE_FLOAT:
+    case SQLITE_FLOAT:
       return "real";
 
-    case ARRAY_TYPE_TEXT:
+    case SQLITE_TEXT:
       return "text";
 
-    case ARRAY_TYPE_BLOB:
+    case SQLITE_BLOB:
       return "blob";
   }
 
   return NULL;
 }
 
-static int array_value_decode(sqlite3_context *context, unsigned char *z,
-                              int n) {
-  if (!z || n < 1) {
-    return -1;
-  }
-
-  int x;
-  double_rep value;
-  switch (*z) {
-    case ARRAY_TYPE_NULL:
-      sqlite3_result_null(context);
-      return 1;
-
-    case ARRAY_TYPE_ONE:
-      sqlite3_result_int(context, 1);
-      return 1;
+void array_value_result(sqlite3_context *context, const array_value *v) {
+  switch (v->type) {
+    case SQLITE_INTEGER:
+      sqlite3_result_int64(context, v->i);
+      break;
 
-    case ARRAY_TYPE_ZERO:
-      sqlite3_result_int(context, 0);
-      return 1;
+    case SQLITE_FLOAT:
+      sqlite3_result_double(context, v->f);
+      break;
 
-    case ARRAY_TYPE_INTEGER:
-    case ARRAY_TYPE_INTEGER_NEG:
-      if (n < 2) {
-        return -1;
-      }
-      sqlite3_int64 valueInt;
-      x = 1 + get_varint(&z[1], &value.d);
-      if (n < x) {
-        return -1;
-      }
-      if (*z == ARRAY_TYPE_INTEGER_NEG) {
-        valueInt = -value.d;
-      } else {
-        valueInt = value.d;
-      }
-      sqlite3_result_int64(context, valueInt);
-      return x;
+    case SQLITE_TEXT:
+      sqlite3_result_text(context, (const char *)v->z, v->n, SQLITE_TRANSIENT);
+      break;
 
-    case ARRAY_TYPE_FLOAT:
-      if (n < 9) {
-        return -1;
-      }
-      value.d = get_u64(&z[1]);
-      sqlite3_result_double(context, value.f);
-      return 9;
+    case SQLITE_BLOB:
+      sqlite3_result_blob(context, v->z, v->n, SQLITE_TRANSIENT);
+      break;
 
-    case ARRAY_TYPE_BLOB:
-    case ARRAY_TYPE_TEXT:
-      if (n < 2) {
-        return -1;
-      }
-      x = get_varint(&z[1], &value.d);
-      unsigned char *p = &z[1 + x];
-      x = 1 + x + value.d;
-      if (n < x) {
-        return -1;
-      }
-      if (*z == ARRAY_TYPE_TEXT) {
-        sqlite3_result_text(context, (const char *)p, value.d,
-                            SQLITE_TRANSIENT);
-      } else {
-        sqlite3_result_blob(context, (const char *)p, value.d,
-                            SQLITE_TRANSIENT);
-      }
-      return x;
+    default:
+      sqlite3_result_null(context);
+      break;
   }
-
-  return -1;
 }
 
 void array_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -249,19 +154,13 @@ void array_length_func(sqlite3_context *context, int argc,
     return;
   }
 
-  int n = 0;
-  while (s > 0) {
-    int delta = array_value_advance((unsigned char *)z, s);
-    if (delta == -1) {
-      sqlite3_result_error(context, "malformed array", -1);
-      return;
-    }
-    n++;
-    z += delta;
-    s -= delta;
+  sqlite3_int64 n = array_count(z, s);
+  if (n == -1) {
+    sqlite3_result_error(context, "malformed array", -1);
+    return;
   }
 
-  sqlite3_result_int(context, n);
+  sqlite3_result_int64(context, n);
   return;
 }
 
@@ -313,37 +212,494 @@ void array_at_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
     sqlite3_result_error_nomem(context);
     return;
   }
-  int i = sqlite3_value_int(argv[1]);
+  sqlite3_int64 i = sqlite3_value_int64(argv[1]);
   if (i < 0) {
     goto err_oob;
   }
 
-  int delta;
-  for (int j = 0; j < i; j++) {
-    if (s <= 0) {
-      goto err_oob;
+  array_iter it;
+  array_value v;
+  array_iter_init(&it, z, s);
+  sqlite3_int64 skipped = array_iter_skip(&it, i);
+  if (skipped == -1) {
+    goto err_malformed;
+  }
+  if (skipped < i) {
+    goto err_oob;
+  }
+  int rc = array_iter_next(&it, &v);
+  if (rc == -1) {
+    goto err_malformed;
+  }
+  if (rc == 0) {
+    goto err_oob;
+  }
+  array_value_result(context, &v);
+  return;
+
+err_oob:
+  sqlite3_result_error(context, "index out of bounds", -1);
+  return;
+
+err_malformed:
+  sqlite3_result_error(context, "malformed array", -1);
+  return;
+}
+
+// Append elements [lo, hi) of the run unit at z, which is delta bytes long.
+// Stride and repeat runs stay runs, delta runs are short enough to expand.
+static int array_slice_run(array_buffer *buf, unsigned char *z, int delta,
+                           sqlite3_int64 lo, sqlite3_int64 hi) {
+  sqlite3_uint64 u, first, stride;
+  unsigned char *p = &z[1 + get_varint(&z[1], &u)];
+  sqlite3_int64 count = hi - lo;
+  int res;
+
+  if (*z == ARRAY_TYPE_DELTA || count == 1) {
+    array_iter it;
+    array_value v;
+    array_iter_init(&it, z, delta);
+    array_iter_skip(&it, lo);
+    for (sqlite3_int64 k = 0; k < count; k++) {
+      array_iter_next(&it, &v);
+      res = array_buffer_append_element(buf, &v);
+      if (res) {
+        return res;
+      }
     }
-    delta = array_value_advance((unsigned char *)z, s);
+    return SQLITE_OK;
+  }
+
+  res = array_buffer_append_byte(buf, *z);
+  if (!res) {
+    res = array_buffer_append_varint64(buf, (sqlite3_uint64)count);
+  }
+  if (res) {
+    return res;
+  }
+  if (*z == ARRAY_TYPE_REPEAT) {
+    return array_buffer_append(buf, p, delta - (int)(p - z));
+  }
+  p += get_varint(p, &first);
+  get_varint(p, &stride);
+  first = (sqlite3_uint64)zigzag_decode(first) +
+          (sqlite3_uint64)lo * (sqlite3_uint64)zigzag_decode(stride);
+  res = array_buffer_append_varint64(
+      buf, zigzag_encode((sqlite3_int64)first));
+  if (res) {
+    return res;
+  }
+  return array_buffer_append_varint64(buf, stride);
+}
+
+void array_slice_func(sqlite3_context *context, int argc,
+                      sqlite3_value **argv) {
+  int s = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  // Negative indices count from the end, like in Python. Only then the
+  // length is needed up front.
+  sqlite3_int64 from = sqlite3_value_int64(argv[1]);
+  sqlite3_int64 to = INT64_MAX;
+  if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+    to = sqlite3_value_int64(argv[2]);
+  }
+  if (from < 0 || to < 0) {
+    sqlite3_int64 n = array_count(z, s);
+    if (n == -1) {
+      goto err_malformed;
+    }
+    if (from < 0) {
+      from = from + n < 0 ? 0 : from + n;
+    }
+    if (to < 0) {
+      to = to + n < 0 ? 0 : to + n;
+    }
+  }
+
+  if (from >= to) {
+    sqlite3_result_zeroblob(context, 0);
+    return;
+  }
+
+  // Walk the units once. Units inside the slice are copied as is; a run
+  // that straddles a boundary is cut down. As long as no run was cut, the
+  // slice is a single byte range of the input and needs no buffer.
+  const unsigned char *start = NULL;
+  const unsigned char *end = NULL;
+  array_buffer buf = {NULL, 0, 0};
+  sqlite3_int64 i = 0;
+  int res = SQLITE_OK;
+  while (s > 0 && i < to) {
+    int delta = array_value_advance((unsigned char *)z, s);
     if (delta == -1) {
+      sqlite3_free(buf.buf);
       goto err_malformed;
     }
+    sqlite3_int64 count = array_unit_count((unsigned char *)z);
+    if (i + count > from) {
+      if (i >= from && i + count <= to) {
+        if (buf.cap) {
+          res = array_buffer_append(&buf, (unsigned char *)z, delta);
+        } else if (!start) {
+          start = z;
+        }
+        end = z + delta;
+      } else {
+        if (!buf.cap && start) {
+          res = array_buffer_append(&buf, (unsigned char *)start,
+                                    (int)(end - start));
+        }
+        if (!res) {
+          sqlite3_int64 lo = from > i ? from - i : 0;
+          sqlite3_int64 hi = to < i + count ? to - i : count;
+          res = array_slice_run(&buf, (unsigned char *)z, delta, lo, hi);
+        }
+      }
+      if (res) {
+        sqlite3_free(buf.buf);
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+    }
     z += delta;
     s -= delta;
+    i += count;
   }
 
-  delta = array_value_decode(context, (unsigned char *)z, s);
-  if (delta == -1) {
-    goto err_malformed;
+  if (buf.cap) {
+    sqlite3_result_blob(context, buf.buf, buf.len, sqlite3_free);
+    return;
   }
-  return;
-
-err_oob:
-  sqlite3_result_error(context, "index out of bounds", -1);
+  if (!start) {
+    sqlite3_result_zeroblob(context, 0);
+    return;
+  }
+  sqlite3_result_blob(context, start, (int)(end - start), SQLITE_TRANSIENT);
   return;
 
 err_malformed:
   sqlite3_result_error(context, "malformed array", -1);
-  return;
+}
+
+// Arrays are self-delimiting element streams, so concatenating the encoded
+// bytes concatenates the arrays.
+void array_concat_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  sqlite3_int64 total = 0;
+  for (int i = 0; i < argc; i++) {
+    int type = sqlite3_value_type(argv[i]);
+    if (type != SQLITE_BLOB && type != SQLITE_NULL) {
+      sqlite3_result_error(context, "expected an array", -1);
+      return;
+    }
+    total += sqlite3_value_bytes(argv[i]);
+  }
+  if (total == 0) {
+    sqlite3_result_zeroblob(context, 0);
+    return;
+  }
+
+  unsigned char *z = sqlite3_malloc64(total);
+  if (!z) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_int64 len = 0;
+  for (int i = 0; i < argc; i++) {
+    int s = sqlite3_value_bytes(argv[i]);
+    if (s > 0) {
+      memcpy(&z[len], sqlite3_value_blob(argv[i]), s);
+      len += s;
+    }
+  }
+  sqlite3_result_blob64(context, z, len, sqlite3_free);
+}
+
+// The parts are appended to a buffer that doubles when full, so each part is
+// copied once plus O(1) amortized for the growth.
+void array_concat_step_func(sqlite3_context *context, int argc,
+                            sqlite3_value **argv) {
+  UNUSED(argc);
+
+  array_buffer *buf = sqlite3_aggregate_context(context, sizeof(array_buffer));
+  if (!buf) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  int type = sqlite3_value_type(argv[0]);
+  if (type != SQLITE_BLOB && type != SQLITE_NULL) {
+    sqlite3_result_error(context, "expected an array", -1);
+    return;
+  }
+  int s = sqlite3_value_bytes(argv[0]);
+  if (s <= 0) {
+    return;
+  }
+  // Keeps the doubled capacity within an int.
+  if (s > 0x3fffffff - buf->len) {
+    sqlite3_result_error_toobig(context);
+    return;
+  }
+  if (array_buffer_append(buf, (unsigned char *)sqlite3_value_blob(argv[0]),
+                          s)) {
+    sqlite3_result_error_nomem(context);
+  }
+}
+
+void array_concat_final_func(sqlite3_context *context) {
+  array_buffer *buf = sqlite3_aggregate_context(context, 0);
+  if (!buf || !buf->len) {
+    sqlite3_result_zeroblob(context, 0);
+    if (buf) {
+      sqlite3_free(buf->buf);
+    }
+    return;
+  }
+  sqlite3_result_blob(context, buf->buf, buf->len, sqlite3_free);
+}
+
+static int varint_size(sqlite3_uint64 v) {
+  int n = 1;
+  while (n < 9 && v > 0x7f) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+// Length of the run of integers with a constant difference starting at k,
+// looking at most limit elements ahead.
+static int compress_stride_length(const array_value *vs, int k, int n,
+                                  int limit) {
+  if (vs[k].type != SQLITE_INTEGER) {
+    return 0;
+  }
+  int j = k + 1;
+  if (j < n && vs[j].type == SQLITE_INTEGER) {
+    sqlite3_uint64 stride = (sqlite3_uint64)vs[j].i - (sqlite3_uint64)vs[k].i;
+    for (j++; j < n && j - k < limit && vs[j].type == SQLITE_INTEGER &&
+              (sqlite3_uint64)vs[j].i - (sqlite3_uint64)vs[j - 1].i == stride;
+         j++) {
+    }
+  }
+  return j - k;
+}
+
+static int compress_equal(const array_value *a, const array_value *b) {
+  if (a->type != b->type) {
+    return 0;
+  }
+  switch (a->type) {
+    case SQLITE_FLOAT:
+      // Bitwise, so NaNs and signed zeroes round-trip.
+      return memcmp(&a->f, &b->f, sizeof(double)) == 0;
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      return a->n == b->n && (a->n == 0 || memcmp(a->z, b->z, a->n) == 0);
+  }
+  return 1;
+}
+
+// Encoded size of a plain element, as written by array_buffer_append_element.
+static int compress_element_size(const array_value *v) {
+  switch (v->type) {
+    case SQLITE_INTEGER:
+      if (v->i == 0 || v->i == 1) {
+        return 1;
+      }
+      return 1 + varint_size(v->i < 0 ? -(sqlite3_uint64)v->i
+                                      : (sqlite3_uint64)v->i);
+
+    case SQLITE_FLOAT:
+      return 9;
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      return 1 + varint_size((sqlite3_uint64)v->n) + v->n;
+  }
+  return 1;
+}
+
+// Greedy encoding: arithmetic progressions of at least four integers become
+// stride runs, other integer sequences delta runs and repeated elements
+// repeat runs, whenever that is smaller than the plain elements.
+static int compress_values(array_buffer *buf, const array_value *vs, int n) {
+  int res;
+  int k = 0;
+  while (k < n) {
+    const array_value *v = &vs[k];
+    int run;
+
+    // Room for any run header, so those appends can't fail.
+    res = array_buffer_grow(buf, 1 + 3 * 9);
+    if (res) {
+      return res;
+    }
+
+    if (v->type == SQLITE_INTEGER) {
+      run = compress_stride_length(vs, k, n, ARRAY_MAX_RUN);
+      if (run >= 4) {
+        sqlite3_uint64 stride =
+            (sqlite3_uint64)vs[k + 1].i - (sqlite3_uint64)v->i;
+        array_buffer_append_byte(buf, ARRAY_TYPE_STRIDE);
+        array_buffer_append_varint64(buf, run);
+        array_buffer_append_varint64(buf, zigzag_encode(v->i));
+        array_buffer_append_varint64(buf,
+                                     zigzag_encode((sqlite3_int64)stride));
+        k += run;
+        continue;
+      }
+
+      // Delta run up to where a stride run would start.
+      run = 1;
+      while (k + run < n && run < ARRAY_DELTA_MAX_RUN &&
+             vs[k + run].type == SQLITE_INTEGER &&
+             compress_stride_length(vs, k + run, n, 4) < 4) {
+        run++;
+      }
+      // Small integers are a single byte as plain elements, where the run
+      // header doesn't pay off.
+      sqlite3_int64 plain = compress_element_size(v);
+      sqlite3_int64 packed = 1 + varint_size(run) +
+                             varint_size(zigzag_encode(v->i));
+      for (int j = k + 1; j < k + run; j++) {
+        sqlite3_uint64 delta =
+            (sqlite3_uint64)vs[j].i - (sqlite3_uint64)vs[j - 1].i;
+        plain += compress_element_size(&vs[j]);
+        packed += varint_size(zigzag_encode((sqlite3_int64)delta));
+      }
+      if (packed >= plain) {
+        for (int j = k; j < k + run; j++) {
+          res = array_buffer_append_element(buf, &vs[j]);
+          if (res) {
+            return res;
+          }
+        }
+        k += run;
+        continue;
+      }
+      res = array_buffer_grow(buf, 2 + (run + 1) * 9);
+      if (res) {
+        return res;
+      }
+      array_buffer_append_byte(buf, ARRAY_TYPE_DELTA);
+      array_buffer_append_varint64(buf, run);
+      array_buffer_append_varint64(buf, zigzag_encode(v->i));
+      for (int j = k + 1; j < k + run; j++) {
+        sqlite3_uint64 delta =
+            (sqlite3_uint64)vs[j].i - (sqlite3_uint64)vs[j - 1].i;
+        array_buffer_append_varint64(buf, zigzag_encode((sqlite3_int64)delta));
+      }
+      k += run;
+      continue;
+    }
+
+    run = 1;
+    while (k + run < n && compress_equal(v, &vs[k + run])) {
+      run++;
+    }
+    int size = compress_element_size(v);
+    int copies = run;
+    if (run > 1 && 1 + varint_size(run) + size < (sqlite3_int64)run * size) {
+      array_buffer_append_byte(buf, ARRAY_TYPE_REPEAT);
+      array_buffer_append_varint64(buf, run);
+      copies = 1;
+    }
+    for (int j = 0; j < copies; j++) {
+      res = array_buffer_append_element(buf, v);
+      if (res) {
+        return res;
+      }
+    }
+    k += run;
+  }
+  return SQLITE_OK;
+}
+
+void array_compress_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+  int s = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+
+  sqlite3_int64 n = array_count(z, s);
+  if (n == -1) {
+    sqlite3_result_error(context, "malformed array", -1);
+    return;
+  }
+  if (n == 0) {
+    sqlite3_result_zeroblob(context, 0);
+    return;
+  }
+  if (n > ARRAY_MAX_RUN / (int)sizeof(array_value)) {
+    sqlite3_result_error(context, "array too large", -1);
+    return;
+  }
+
+  array_value *vs = sqlite3_malloc64(n * sizeof(array_value));
+  if (!vs) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  array_iter it;
+  array_iter_init(&it, z, s);
+  for (sqlite3_int64 k = 0; k < n; k++) {
+    array_iter_next(&it, &vs[k]);
+  }
+
+  array_buffer buf = {NULL, 0, 0};
+  int res = compress_values(&buf, vs, (int)n);
+  sqlite3_free(vs);
+  if (res) {
+    sqlite3_free(buf.buf);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_blob(context, buf.buf, buf.len, sqlite3_free);
+}
+
+void array_decompress_func(sqlite3_context *context, int argc,
+                           sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+  int s = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+
+  array_buffer buf = {NULL, 0, 0};
+  array_iter it;
+  array_value v;
+  int rc;
+  array_iter_init(&it, z, s);
+  while ((rc = array_iter_next(&it, &v)) == 1) {
+    if (array_buffer_append_element(&buf, &v)) {
+      sqlite3_free(buf.buf);
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+  if (rc == -1) {
+    sqlite3_free(buf.buf);
+    sqlite3_result_error(context, "malformed array", -1);
+    return;
+  }
+  if (!buf.cap) {
+    sqlite3_result_zeroblob(context, 0);
+    return;
+  }
+  sqlite3_result_blob(context, buf.buf, buf.len, sqlite3_free);
 }
 
 void array_agg_step_func(sqlite3_context *context, int argc,
@@ -12,29 +12,136 @@
 #define ARRAY_TYPE_BLOB 6
 #define ARRAY_TYPE_TEXT 7
 
+// Run types, written by array_compress. A run is a single unit in the array
+// that expands to count elements:
+// - DELTA: varint count, then count zigzag varints: the first integer and the
+//   differences between consecutive integers. At most ARRAY_DELTA_MAX_RUN.
+// - REPEAT: varint count, then one (non-run) element that is repeated.
+// - STRIDE: varint count, zigzag varint first integer, zigzag varint stride.
+#define ARRAY_TYPE_DELTA 8
+#define ARRAY_TYPE_REPEAT 9
+#define ARRAY_TYPE_STRIDE 10
+
+#define ARRAY_DELTA_MAX_RUN 128
+#define ARRAY_MAX_RUN 0x7fffffff
+
+// A decoded array element. The type is one of the SQLITE_* fundamental
+// datatypes. Integers set both i and f, TEXT and BLOB payloads point into the
+// array itself.
+typedef struct {
+  int type;
+  sqlite3_int64 i;
+  double f;
+  const unsigned char *z;
+  int n;
+} array_value;
+
+// Sequential decoder over the elements of an array, expanding runs.
+typedef struct {
+  unsigned char *p;
+  int n;
+  unsigned char *end;
+  unsigned char run;
+  sqlite3_int64 run_left;
+  sqlite3_int64 run_value;
+  sqlite3_int64 run_stride;
+  array_value run_elem;
+} array_iter;
+
+// The codec in array_iter.c is also linked into libtslite.a. Hidden, its
+// symbols are made local there and not exported from tslite.so, so they can't
+// collide with the embedding application's.
+#define ARRAY_HIDDEN __attribute__((visibility("hidden")))
+
+ARRAY_HIDDEN int array_value_advance(unsigned char *z, int n);
+ARRAY_HIDDEN sqlite3_int64 array_unit_count(unsigned char *z);
+ARRAY_HIDDEN sqlite3_int64 array_count(const unsigned char *z, int s);
+
+ARRAY_HIDDEN void array_iter_init(array_iter *it, const unsigned char *z,
+                                  int n);
+ARRAY_HIDDEN int array_iter_next(array_iter *it, array_value *v);
+ARRAY_HIDDEN sqlite3_int64 array_iter_skip(array_iter *it, sqlite3_int64 k);
+void array_value_result(sqlite3_context *context, const array_value *v);
+
 void array_func(sqlite3_context *context, int argc, sqlite3_value **argv);
 void array_length_func(sqlite3_context *context, int argc,
                        sqlite3_value **argv);
 void array_append_func(sqlite3_context *context, int argc,
                        sqlite3_value **argv);
 void array_at_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_slice_func(sqlite3_context *context, int argc,
+                      sqlite3_value **argv);
+void array_concat_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv);
+void array_compress_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv);
+void array_decompress_func(sqlite3_context *context, int argc,
+                           sqlite3_value **argv);
 
 void array_agg_step_func(sqlite3_context *context, int argc,
                          sqlite3_value **argv);
 void array_agg_final_func(sqlite3_context *context);
 void array_agg_value_func(sqlite3_context *context);
 
+void array_concat_step_func(sqlite3_context *context, int argc,
+                            sqlite3_value **argv);
+void array_concat_final_func(sqlite3_context *context);
+
 typedef struct {
   sqlite3_vtab base;
-  unsigned char *z;
-  int n;
 } array_each_vtab;
 
 typedef struct {
   sqlite3_vtab_cursor base;
   sqlite3_int64 row_id;
-  unsigned char *p;
-  int n;
+  // Copy of the array argument, which only lives until xFilter returns. The
+  // iterator points into it.
+  sqlite3_value *array;
+  array_iter it;
+  array_value value;
+  int eof;
 } array_each_vtab_cursor;
 
+// array_each_stream reads the blob in windows of ARRAY_STREAM_WINDOW bytes.
+// The window only grows to hold a single unit larger than that.
+#define ARRAY_STREAM_WINDOW 65536
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+} array_each_stream_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 row_id;
+  sqlite3_blob *blob;
+  // Size of the blob and offset of the first byte not read into buf yet.
+  int size;
+  int offset;
+  unsigned char *buf;
+  int cap;
+  array_iter it;
+  array_value value;
+  int eof;
+} array_each_stream_vtab_cursor;
+
+// arrays_zip takes up to ARRAYS_ZIP_MAX arrays, one hidden column each.
+#define ARRAYS_ZIP_MAX 16
+
+typedef struct {
+  sqlite3_vtab base;
+} arrays_zip_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 row_id;
+  // Copies of the arguments, NULL for the arrays that weren't passed.
+  sqlite3_value *array[ARRAYS_ZIP_MAX];
+  array_iter it[ARRAYS_ZIP_MAX];
+  array_value value[ARRAYS_ZIP_MAX];
+  // Bitmask of the slots with a current element.
+  unsigned int live;
+  int eof;
+} arrays_zip_vtab_cursor;
+
 #endif  // TSLITE_ARRAY_H
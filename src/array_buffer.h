@@ -3,10 +3,11 @@
 
 #include <string.h>
 
+#include "array.h"
 #include "tslite.h"
 
 // Write a 64-bit unsigned integer as 8 big-endian bytes.
-static void put_u64(unsigned char *z, sqlite3_uint64 y) {
+static inline void put_u64(unsigned char *z, sqlite3_uint64 y) {
   z[0] = (unsigned char)(y >> 56);
   z[1] = (unsigned char)(y >> 48);
   z[2] = (unsigned char)(y >> 40);
@@ -17,7 +18,7 @@ static void put_u64(unsigned char *z, sqlite3_uint64 y) {
   z[7] = (unsigned char)(y);
 }
 
-static sqlite3_uint64 get_u64(unsigned char *z) {
+static inline sqlite3_uint64 get_u64(const unsigned char *z) {
   return (((sqlite3_uint64)z[7]) | ((sqlite3_uint64)z[6]) << 8 |
           ((sqlite3_uint64)z[5]) << 16 | ((sqlite3_uint64)z[4]) << 24 |
           ((sqlite3_uint64)z[3]) << 32 | ((sqlite3_uint64)z[2]) << 40 |
@@ -34,7 +35,7 @@ static sqlite3_uint64 get_u64(unsigned char *z) {
 // 8 bits and is the last byte.
 //
 // Source from putVarint64 in sqlite3/src/util.c.
-static int put_varint64(unsigned char *p, sqlite3_uint64 v) {
+static inline int put_varint64(unsigned char *p, sqlite3_uint64 v) {
   if (v <= 0x7f) {
     p[0] = v & 0x7f;
     return 1;
@@ -72,7 +73,8 @@ static int put_varint64(unsigned char *p, sqlite3_uint64 v) {
 // Return the number of bytes read.  The value is stored in *v.
 //
 // Source from sqlite3GetVarint in sqlite3/src/util.c.
-static unsigned char get_varint(unsigned char *p, sqlite3_uint64 *v) {
+static inline unsigned char get_varint(unsigned char *p,
+                                       sqlite3_uint64 *v) {
 #define SLOT_2_0 0x001fc07f
 #define SLOT_4_2_0 0xf01fc07f
 
@@ -186,6 +188,16 @@ static unsigned char get_varint(unsigned char *p, sqlite3_uint64 *v) {
   return 9;
 }
 
+// Map signed integers to unsigned ones so small magnitudes of either sign
+// become small varints: 0, -1, 1, -2, ... map to 0, 1, 2, 3, ...
+static inline sqlite3_uint64 zigzag_encode(sqlite3_int64 v) {
+  return ((sqlite3_uint64)v << 1) ^ (sqlite3_uint64)(v >> 63);
+}
+
+static inline sqlite3_int64 zigzag_decode(sqlite3_uint64 v) {
+  return (sqlite3_int64)(v >> 1) ^ -(sqlite3_int64)(v & 1);
+}
+
 // Double representation.
 typedef union {
   double f;
@@ -197,7 +209,7 @@ typedef struct {
   int len, cap;
 } array_buffer;
 
-static int array_buffer_grow(array_buffer *buf, int n) {
+static inline int array_buffer_grow(array_buffer *buf, int n) {
   if (!buf->cap) {
     unsigned char *z = (unsigned char *)sqlite3_malloc(n);
     if (!z) {
@@ -225,7 +237,8 @@ static int array_buffer_grow(array_buffer *buf, int n) {
 
 #define array_buffer_end(buf) &(buf->buf[buf->len])
 
-static int array_buffer_append(array_buffer *buf, unsigned char *z, int n) {
+static inline int array_buffer_append(array_buffer *buf, unsigned char *z,
+                                      int n) {
   int res = array_buffer_grow(buf, n);
   if (res) {
     return res;
@@ -235,7 +248,8 @@ static int array_buffer_append(array_buffer *buf, unsigned char *z, int n) {
   return SQLITE_OK;
 }
 
-static int array_buffer_append_byte(array_buffer *buf, unsigned char v) {
+static inline int array_buffer_append_byte(array_buffer *buf,
+                                           unsigned char v) {
   int res = array_buffer_grow(buf, 1);
   if (res) {
     return res;
@@ -245,7 +259,8 @@ static int array_buffer_append_byte(array_buffer *buf, unsigned char v) {
   return SQLITE_OK;
 }
 
-static int array_buffer_append_uint64(array_buffer *buf, sqlite3_uint64 v) {
+static inline int array_buffer_append_uint64(array_buffer *buf,
+                                             sqlite3_uint64 v) {
   int res = array_buffer_grow(buf, 8);
   if (res) {
     return res;
@@ -255,13 +270,15 @@ static int array_buffer_append_uint64(array_buffer *buf, sqlite3_uint64 v) {
   return SQLITE_OK;
 }
 
-static int array_buffer_append_double(array_buffer *buf, double v) {
+static inline int array_buffer_append_double(array_buffer *buf,
+                                             double v) {
   double_rep f64_value;
   f64_value.f = v;
   return array_buffer_append_uint64(buf, f64_value.d);
 }
 
-static int array_buffer_append_varint64(array_buffer *buf, sqlite3_uint64 v) {
+static inline int array_buffer_append_varint64(array_buffer *buf,
+                                               sqlite3_uint64 v) {
   int res = array_buffer_grow(buf, 9);
   if (res) {
     return res;
@@ -271,4 +288,45 @@ static int array_buffer_append_varint64(array_buffer *buf, sqlite3_uint64 v) {
   return SQLITE_OK;
 }
 
+// Append a decoded element, using the same encoding as the array function.
+static inline int array_buffer_append_element(array_buffer *buf,
+                                              const array_value *v) {
+  int res = array_buffer_grow(buf, 10);
+  if (res) {
+    return res;
+  }
+
+  switch (v->type) {
+    case SQLITE_INTEGER:
+      if (v->i == 0) {
+        return array_buffer_append_byte(buf, ARRAY_TYPE_ZERO);
+      }
+      if (v->i == 1) {
+        return array_buffer_append_byte(buf, ARRAY_TYPE_ONE);
+      }
+      if (v->i < 0) {
+        array_buffer_append_byte(buf, ARRAY_TYPE_INTEGER_NEG);
+        return array_buffer_append_varint64(buf, -(sqlite3_uint64)v->i);
+      }
+      array_buffer_append_byte(buf, ARRAY_TYPE_INTEGER);
+      return array_buffer_append_varint64(buf, (sqlite3_uint64)v->i);
+
+    case SQLITE_FLOAT:
+      array_buffer_append_byte(buf, ARRAY_TYPE_FLOAT);
+      return array_buffer_append_double(buf, v->f);
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      array_buffer_append_byte(
+          buf, v->type == SQLITE_TEXT ? ARRAY_TYPE_TEXT : ARRAY_TYPE_BLOB);
+      array_buffer_append_varint64(buf, (sqlite3_uint64)v->n);
+      return array_buffer_append(buf, (unsigned char *)v->z, v->n);
+  }
+
+  return array_buffer_append_byte(buf, ARRAY_TYPE_NULL);
+}
+
+// Append a SQL value, as the array function does.
+int array_buffer_append_value(array_buffer *buf, sqlite3_value *item);
+
 #endif  // TSLITE_ARRAY_BUFFER_H
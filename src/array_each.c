@@ -3,10 +3,7 @@
 #include "array.h"
 #include "array_buffer.h"
 
-static int array_value_advance(unsigned char *z, int n);
-static const char *array_value_type(unsigned char v);
-static int array_value_decode(sqlite3_context *context, unsigned char *z,
-                              int n);
+static const char *array_value_type(int type);
 
 static int array_each_vtab_connect(sqlite3 *db, void *pAux, int argc,
                                    const char *const *argv,
@@ -61,26 +58,31 @@ static int array_each_vtab_open(sqlite3_vtab *p,
 
 static int array_each_vtab_close(sqlite3_vtab_cursor *cur) {
   array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
+  sqlite3_value_free(cursor->array);
   sqlite3_free(cursor);
   return SQLITE_OK;
 }
 
-static int array_each_vtab_next(sqlite3_vtab_cursor *cur) {
-  array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
-  int delta = array_value_advance(cursor->p, cursor->n);
-  if (delta == -1) {
+// Decode the next element into the cursor.
+static int array_each_vtab_advance(array_each_vtab_cursor *cursor) {
+  int rc = array_iter_next(&cursor->it, &cursor->value);
+  if (rc == -1) {
+    cursor->base.pVtab->zErrMsg = sqlite3_mprintf("malformed array");
     return SQLITE_ERROR;
   }
-  cursor->p += delta;
-  cursor->n -= delta;
-  cursor->row_id++;
+  cursor->eof = !rc;
   return SQLITE_OK;
 }
 
+static int array_each_vtab_next(sqlite3_vtab_cursor *cur) {
+  array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
+  cursor->row_id++;
+  return array_each_vtab_advance(cursor);
+}
+
 static int array_each_vtab_column(sqlite3_vtab_cursor *cur,
                                   sqlite3_context *context, int i) {
   array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
-  array_each_vtab *vtab = (array_each_vtab *)cursor->base.pVtab;
 
   switch (i) {
     case ARRAY_EACH_VTAB_INDEX:
@@ -88,14 +90,11 @@ static int array_each_vtab_column(sqlite3_vtab_cursor *cur,
       break;
 
     case ARRAY_EACH_VTAB_VALUE:
-      int result = array_value_decode(context, cursor->p, cursor->n);
-      if (result == -1) {
-        sqlite3_result_error(context, "value decode error", -1);
-      }
+      array_value_result(context, &cursor->value);
       break;
 
     case ARRAY_EACH_VTAB_TYPE:
-      const char *type = array_value_type(*cursor->p);
+      const char *type = array_value_type(cursor->value.type);
       if (!type) {
         sqlite3_result_error(context, "unknown type or malformed array", -1);
       } else {
@@ -104,7 +103,10 @@ static int array_each_vtab_column(sqlite3_vtab_cursor *cur,
       break;
 
     case ARRAY_EACH_VTAB_ARRAY:
-      sqlite3_result_blob(context, vtab->z, vtab->n, SQLITE_TRANSIENT);
+      // Only read when selected, the constraint on it is omitted.
+      if (cursor->array) {
+        sqlite3_result_value(context, cursor->array);
+      }
       break;
 
     default:
@@ -123,7 +125,7 @@ static int array_each_vtab_rowid(sqlite3_vtab_cursor *cur,
 
 static int array_each_vtab_eof(sqlite3_vtab_cursor *cur) {
   array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
-  return cursor->n <= 0;
+  return cursor->eof;
 }
 
 static int array_each_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
@@ -133,23 +135,30 @@ static int array_each_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
   UNUSED(idxStr);
 
   array_each_vtab_cursor *cursor = (array_each_vtab_cursor *)cur;
-  array_each_vtab *vtab = (array_each_vtab *)cursor->base.pVtab;
 
+  cursor->row_id = 0;
+  cursor->eof = 1;
+  sqlite3_value_free(cursor->array);
+  cursor->array = NULL;
   if (argc < 1) {
     return SQLITE_OK;
   }
 
-  int n = sqlite3_value_bytes(argv[0]);
-  const void *z = sqlite3_value_blob(argv[0]);
-  if (!z) {
+  // The state lives on the cursor, nested or correlated array_each calls in
+  // one statement share the vtab. The arguments only live until xFilter
+  // returns.
+  cursor->array = sqlite3_value_dup(argv[0]);
+  if (!cursor->array) {
+    return SQLITE_NOMEM;
+  }
+  int n = sqlite3_value_bytes(cursor->array);
+  const unsigned char *z = sqlite3_value_blob(cursor->array);
+  if (!z && n > 0) {
     return SQLITE_NOMEM;
   }
 
-  vtab->z = (unsigned char *)z;
-  vtab->n = n;
-  cursor->p = (unsigned char *)z;
-  cursor->n = n;
-  return SQLITE_OK;
+  array_iter_init(&cursor->it, z, n);
+  return array_each_vtab_advance(cursor);
 }
 
 static int array_each_vtab_best_index(sqlite3_vtab *vtab,
@@ -204,3 +213,324 @@ sqlite3_module array_each_module = {
     /* xRollbackTo */ 0,
     /* xShadowName */ 0,
 };
+
+// array_each_stream(table, column, rowid) is array_each over the array stored
+// in a row, read with incremental blob I/O so a large array is decoded in
+// fixed-size windows instead of being loaded whole.
+#define ARRAY_EACH_STREAM_VTAB_TABLE 3
+#define ARRAY_EACH_STREAM_VTAB_COLUMN 4
+#define ARRAY_EACH_STREAM_VTAB_ROWID 5
+#define ARRAY_EACH_STREAM_VTAB_ARGS 3
+
+static int array_each_stream_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                          const char *const *argv,
+                                          sqlite3_vtab **ppVtab,
+                                          char **pzErr) {
+  UNUSED(pAux);
+  UNUSED(argc);
+  UNUSED(argv);
+  UNUSED(pzErr);
+
+  int rc = sqlite3_declare_vtab(
+      db,
+      "CREATE TABLE x(\"index\", value, type, \"table\" HIDDEN, "
+      "\"column\" HIDDEN, \"rowid\" HIDDEN)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  array_each_stream_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+
+  return SQLITE_OK;
+}
+
+static int array_each_stream_vtab_disconnect(sqlite3_vtab *pVtab) {
+  array_each_stream_vtab *p = (array_each_stream_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int array_each_stream_vtab_open(sqlite3_vtab *p,
+                                       sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  array_each_stream_vtab_cursor *cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->eof = 1;
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static int array_each_stream_vtab_close(sqlite3_vtab_cursor *cur) {
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+  sqlite3_blob_close(cursor->blob);
+  sqlite3_free(cursor->buf);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+// Move the undecoded tail of the window to its start and read the blob up to
+// the end of the window, growing it if the tail already fills it (a single
+// unit larger than the window). Only called between units, so no element or
+// run still points into the window.
+static int array_each_stream_refill(array_each_stream_vtab_cursor *cursor) {
+  int keep = cursor->it.n > 0 ? cursor->it.n : 0;
+  if (keep == cursor->cap) {
+    int cap = cursor->cap ? cursor->cap * 2 : ARRAY_STREAM_WINDOW;
+    int left = cursor->size - cursor->offset;
+    if (cap > keep + left) {
+      cap = keep + left;
+    }
+    unsigned char *buf = sqlite3_malloc(cap);
+    if (!buf) {
+      return SQLITE_NOMEM;
+    }
+    if (keep) {
+      memcpy(buf, cursor->it.p, keep);
+    }
+    sqlite3_free(cursor->buf);
+    cursor->buf = buf;
+    cursor->cap = cap;
+  } else if (keep) {
+    memmove(cursor->buf, cursor->it.p, keep);
+  }
+
+  int n = cursor->cap - keep;
+  if (n > cursor->size - cursor->offset) {
+    n = cursor->size - cursor->offset;
+  }
+  int rc = sqlite3_blob_read(cursor->blob, cursor->buf + keep, n,
+                             cursor->offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  cursor->offset += n;
+  array_iter_init(&cursor->it, cursor->buf, keep + n);
+  return SQLITE_OK;
+}
+
+// Decode the next element into the cursor, refilling the window when the next
+// unit isn't entirely in it. array_iter_next leaves the iterator untouched if
+// it can't decode the unit, so it's retried on the refilled window; the array
+// is only malformed once the whole blob has been read.
+static int array_each_stream_vtab_advance(
+    array_each_stream_vtab_cursor *cursor) {
+  for (;;) {
+    int rc = array_iter_next(&cursor->it, &cursor->value);
+    if (rc == 1) {
+      return SQLITE_OK;
+    }
+    if (cursor->offset >= cursor->size) {
+      if (rc == -1) {
+        cursor->base.pVtab->zErrMsg = sqlite3_mprintf("malformed array");
+        return SQLITE_ERROR;
+      }
+      cursor->eof = 1;
+      return SQLITE_OK;
+    }
+    rc = array_each_stream_refill(cursor);
+    if (rc != SQLITE_OK) {
+      array_each_stream_vtab *vtab =
+          (array_each_stream_vtab *)cursor->base.pVtab;
+      cursor->base.pVtab->zErrMsg =
+          sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+      return rc;
+    }
+  }
+}
+
+static int array_each_stream_vtab_next(sqlite3_vtab_cursor *cur) {
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+  cursor->row_id++;
+  return array_each_stream_vtab_advance(cursor);
+}
+
+static int array_each_stream_vtab_column(sqlite3_vtab_cursor *cur,
+                                         sqlite3_context *context, int i) {
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+
+  switch (i) {
+    case ARRAY_EACH_VTAB_INDEX:
+      sqlite3_result_int64(context, cursor->row_id);
+      break;
+
+    case ARRAY_EACH_VTAB_VALUE:
+      array_value_result(context, &cursor->value);
+      break;
+
+    case ARRAY_EACH_VTAB_TYPE:
+      const char *type = array_value_type(cursor->value.type);
+      if (!type) {
+        sqlite3_result_error(context, "unknown type or malformed array", -1);
+      } else {
+        sqlite3_result_text(context, type, -1, SQLITE_STATIC);
+      }
+      break;
+
+    case ARRAY_EACH_STREAM_VTAB_TABLE:
+    case ARRAY_EACH_STREAM_VTAB_COLUMN:
+    case ARRAY_EACH_STREAM_VTAB_ROWID:
+      // The arguments are omitted constraints, SQLite never asks for them.
+      sqlite3_result_null(context);
+      break;
+
+    default:
+      return SQLITE_ERROR;
+  }
+
+  return SQLITE_OK;
+}
+
+static int array_each_stream_vtab_rowid(sqlite3_vtab_cursor *cur,
+                                        sqlite_int64 *pRowid) {
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+  *pRowid = cursor->row_id;
+  return SQLITE_OK;
+}
+
+static int array_each_stream_vtab_eof(sqlite3_vtab_cursor *cur) {
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+  return cursor->eof;
+}
+
+// Whether column of the row is NULL.
+static int array_each_stream_is_null(sqlite3 *db, const char *table,
+                                     const char *column, sqlite3_int64 rowid) {
+  char *sql = sqlite3_mprintf(
+      "SELECT \"%w\" IS NULL FROM \"main\".\"%w\" WHERE rowid = ?1", column,
+      table);
+  if (!sql) {
+    return 0;
+  }
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return 0;
+  }
+  sqlite3_bind_int64(stmt, 1, rowid);
+  int is_null =
+      sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return is_null;
+}
+
+static int array_each_stream_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                                         const char *idxStr, int argc,
+                                         sqlite3_value **argv) {
+  UNUSED(idxNum);
+  UNUSED(idxStr);
+
+  array_each_stream_vtab_cursor *cursor = (array_each_stream_vtab_cursor *)cur;
+  array_each_stream_vtab *vtab = (array_each_stream_vtab *)cursor->base.pVtab;
+
+  sqlite3_blob_close(cursor->blob);
+  cursor->blob = NULL;
+  cursor->row_id = 0;
+  cursor->eof = 1;
+  cursor->size = cursor->offset = 0;
+  array_iter_init(&cursor->it, NULL, 0);
+  if (argc < ARRAY_EACH_STREAM_VTAB_ARGS ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL) {
+    return SQLITE_OK;
+  }
+
+  const char *table = (const char *)sqlite3_value_text(argv[0]);
+  const char *column = (const char *)sqlite3_value_text(argv[1]);
+  if (!table || !column) {
+    cursor->base.pVtab->zErrMsg =
+        sqlite3_mprintf("array_each_stream: table and column are required");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 rowid = sqlite3_value_int64(argv[2]);
+  int rc = sqlite3_blob_open(vtab->db, "main", table, column, rowid, 0,
+                             &cursor->blob);
+  if (rc != SQLITE_OK) {
+    cursor->base.pVtab->zErrMsg =
+        sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    sqlite3_blob_close(cursor->blob);
+    cursor->blob = NULL;
+    // Empty arrays are stored as NULL, which can't be opened as a blob.
+    if (rc == SQLITE_ERROR &&
+        array_each_stream_is_null(vtab->db, table, column, rowid)) {
+      sqlite3_free(cursor->base.pVtab->zErrMsg);
+      cursor->base.pVtab->zErrMsg = NULL;
+      cursor->eof = 1;
+      return SQLITE_OK;
+    }
+    return rc;
+  }
+  cursor->size = sqlite3_blob_bytes(cursor->blob);
+  cursor->eof = 0;
+  return array_each_stream_vtab_advance(cursor);
+}
+
+static int array_each_stream_vtab_best_index(sqlite3_vtab *vtab,
+                                             sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  int argIdx[ARRAY_EACH_STREAM_VTAB_ARGS] = {-1, -1, -1};
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    int k = constraint->iColumn - ARRAY_EACH_STREAM_VTAB_TABLE;
+    if (k < 0 || k >= ARRAY_EACH_STREAM_VTAB_ARGS) {
+      continue;
+    }
+    if (!constraint->usable) {
+      // Unusable constraint on an argument, reject the entire plan.
+      return SQLITE_CONSTRAINT;
+    }
+    if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      argIdx[k] = i;
+    }
+  }
+
+  for (int k = 0; k < ARRAY_EACH_STREAM_VTAB_ARGS; k++) {
+    if (argIdx[k] < 0) {
+      // Without all three arguments there is no row to read.
+      return SQLITE_OK;
+    }
+  }
+  for (int k = 0; k < ARRAY_EACH_STREAM_VTAB_ARGS; k++) {
+    pIdxInfo->aConstraintUsage[argIdx[k]].argvIndex = k + 1;
+    pIdxInfo->aConstraintUsage[argIdx[k]].omit = 1;
+  }
+  pIdxInfo->estimatedCost = 1.0;
+  return SQLITE_OK;
+}
+
+sqlite3_module array_each_stream_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ array_each_stream_vtab_connect,
+    /* xBestIndex  */ array_each_stream_vtab_best_index,
+    /* xDisconnect */ array_each_stream_vtab_disconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ array_each_stream_vtab_open,
+    /* xClose      */ array_each_stream_vtab_close,
+    /* xFilter     */ array_each_stream_vtab_filter,
+    /* xNext       */ array_each_stream_vtab_next,
+    /* xEof        */ array_each_stream_vtab_eof,
+    /* xColumn     */ array_each_stream_vtab_column,
+    /* xRowid      */ array_each_stream_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
@@ -0,0 +1,313 @@
+#include "array.h"
+
+#include <string.h>
+
+#include "array_buffer.h"
+
+// Length of the varint at z, or -1 if it doesn't end within n bytes.
+static int varint_length(const unsigned char *z, int n) {
+  for (int x = 0; x < n; x++) {
+    // The 9th byte of a varint uses all 8 bits, so it always ends it.
+    if (!(z[x] & 0x80) || x == 8) {
+      return x + 1;
+    }
+  }
+  return -1;
+}
+
+static int array_type_is_run(unsigned char type) {
+  return type == ARRAY_TYPE_DELTA || type == ARRAY_TYPE_REPEAT ||
+         type == ARRAY_TYPE_STRIDE;
+}
+
+// Returns the length in bytes of the unit at z: a single element, or a run
+// of elements for the run types. Returns -1 if the unit is malformed or
+// doesn't fit in n bytes.
+int array_value_advance(unsigned char *z, int n) {
+  if (!z || n < 1) {
+    return -1;
+  }
+
+  int x, y;
+  sqlite3_uint64 v;
+  switch (*z) {
+    case ARRAY_TYPE_NULL:
+    case ARRAY_TYPE_ONE:
+    case ARRAY_TYPE_ZERO:
+      return 1;
+
+    case ARRAY_TYPE_INTEGER:
+    case ARRAY_TYPE_INTEGER_NEG:
+      x = varint_length(&z[1], n - 1);
+      return x == -1 ? -1 : 1 + x;
+
+    case ARRAY_TYPE_FLOAT:
+      if (n < 9) {
+        return -1;
+      }
+      return 9;
+
+    case ARRAY_TYPE_BLOB:
+    case ARRAY_TYPE_TEXT:
+      x = varint_length(&z[1], n - 1);
+      if (x == -1) {
+        return -1;
+      }
+      get_varint(&z[1], &v);
+      if (v > (sqlite3_uint64)(n - 1 - x)) {
+        return -1;
+      }
+      return 1 + x + (int)v;
+
+    case ARRAY_TYPE_DELTA:
+    case ARRAY_TYPE_REPEAT:
+    case ARRAY_TYPE_STRIDE:
+      x = varint_length(&z[1], n - 1);
+      if (x == -1) {
+        return -1;
+      }
+      get_varint(&z[1], &v);
+      if (v < 1 || v > ARRAY_MAX_RUN ||
+          (*z == ARRAY_TYPE_DELTA && v > ARRAY_DELTA_MAX_RUN)) {
+        return -1;
+      }
+      x++;
+      if (*z == ARRAY_TYPE_REPEAT) {
+        // Count followed by the repeated element, which is never a run.
+        if (x >= n || array_type_is_run(z[x])) {
+          return -1;
+        }
+        y = array_value_advance(&z[x], n - x);
+        return y == -1 ? -1 : x + y;
+      }
+      // Delta runs store count varints (the first value, then the deltas),
+      // stride runs the first value and the stride.
+      if (*z == ARRAY_TYPE_STRIDE) {
+        v = 2;
+      }
+      for (sqlite3_uint64 i = 0; i < v; i++) {
+        y = varint_length(&z[x], n - x);
+        if (y == -1) {
+          return -1;
+        }
+        x += y;
+      }
+      return x;
+  }
+
+  return -1;
+}
+
+// Number of elements in the (well-formed) unit at z.
+sqlite3_int64 array_unit_count(unsigned char *z) {
+  if (!array_type_is_run(*z)) {
+    return 1;
+  }
+  sqlite3_uint64 v;
+  get_varint(&z[1], &v);
+  return (sqlite3_int64)v;
+}
+
+// Count the elements of an array, or -1 if it is malformed. Runs are
+// counted without expanding them.
+sqlite3_int64 array_count(const unsigned char *z, int s) {
+  sqlite3_int64 n = 0;
+  while (s > 0) {
+    int delta = array_value_advance((unsigned char *)z, s);
+    if (delta == -1) {
+      return -1;
+    }
+    n += array_unit_count((unsigned char *)z);
+    z += delta;
+    s -= delta;
+  }
+  return n;
+}
+
+// Decode the single (non-run) element at z. Returns its length in bytes or
+// -1 if it is malformed.
+static int array_element_decode(unsigned char *z, int n, array_value *v) {
+  int x = array_value_advance(z, n);
+  if (x == -1) {
+    return -1;
+  }
+
+  sqlite3_uint64 u;
+  double_rep value;
+  switch (*z) {
+    case ARRAY_TYPE_NULL:
+      v->type = SQLITE_NULL;
+      break;
+
+    case ARRAY_TYPE_ZERO:
+    case ARRAY_TYPE_ONE:
+      v->type = SQLITE_INTEGER;
+      v->i = *z == ARRAY_TYPE_ONE;
+      v->f = (double)v->i;
+      break;
+
+    case ARRAY_TYPE_INTEGER:
+    case ARRAY_TYPE_INTEGER_NEG:
+      get_varint(&z[1], &u);
+      v->type = SQLITE_INTEGER;
+      v->i = *z == ARRAY_TYPE_INTEGER_NEG ? -(sqlite3_int64)u
+                                          : (sqlite3_int64)u;
+      v->f = (double)v->i;
+      break;
+
+    case ARRAY_TYPE_FLOAT:
+      value.d = get_u64(&z[1]);
+      v->type = SQLITE_FLOAT;
+      v->f = value.f;
+      break;
+
+    case ARRAY_TYPE_BLOB:
+    case ARRAY_TYPE_TEXT:
+      v->type = *z == ARRAY_TYPE_TEXT ? SQLITE_TEXT : SQLITE_BLOB;
+      v->z = &z[1 + get_varint(&z[1], &u)];
+      v->n = (int)u;
+      break;
+
+    default:
+      return -1;
+  }
+
+  return x;
+}
+
+static void array_run_value(array_iter *it, array_value *v) {
+  v->type = SQLITE_INTEGER;
+  v->i = it->run_value;
+  v->f = (double)v->i;
+}
+
+void array_iter_init(array_iter *it, const unsigned char *z, int n) {
+  memset(it, 0, sizeof(*it));
+  it->p = (unsigned char *)z;
+  it->n = z ? n : 0;
+}
+
+// Decode the next element into v. Returns 1 if an element was decoded, 0 at
+// the end of the array and -1 if the array is malformed.
+int array_iter_next(array_iter *it, array_value *v) {
+  sqlite3_uint64 u;
+
+  if (it->run_left > 0) {
+    it->run_left--;
+    switch (it->run) {
+      case ARRAY_TYPE_DELTA:
+        // The unit was validated when the run was entered.
+        it->p += get_varint(it->p, &u);
+        it->n = it->end - it->p;
+        it->run_value = (sqlite3_int64)((sqlite3_uint64)it->run_value +
+                                        (sqlite3_uint64)zigzag_decode(u));
+        array_run_value(it, v);
+        break;
+
+      case ARRAY_TYPE_STRIDE:
+        it->run_value = (sqlite3_int64)((sqlite3_uint64)it->run_value +
+                                        (sqlite3_uint64)it->run_stride);
+        array_run_value(it, v);
+        break;
+
+      default:
+        *v = it->run_elem;
+        break;
+    }
+    return 1;
+  }
+
+  if (it->n <= 0) {
+    return 0;
+  }
+
+  unsigned char *z = it->p;
+  int x = array_value_advance(z, it->n);
+  if (x == -1) {
+    return -1;
+  }
+  if (!array_type_is_run(*z)) {
+    if (array_element_decode(z, x, v) == -1) {
+      return -1;
+    }
+    it->p += x;
+    it->n -= x;
+    return 1;
+  }
+
+  // Enter the run and produce its first element.
+  it->end = z + it->n;
+  it->run = *z;
+  unsigned char *p = &z[1 + get_varint(&z[1], &u)];
+  it->run_left = (sqlite3_int64)u - 1;
+  switch (it->run) {
+    case ARRAY_TYPE_DELTA:
+      p += get_varint(p, &u);
+      it->run_value = zigzag_decode(u);
+      it->p = p;
+      it->n = it->end - p;
+      array_run_value(it, v);
+      return 1;
+
+    case ARRAY_TYPE_STRIDE:
+      p += get_varint(p, &u);
+      it->run_value = zigzag_decode(u);
+      get_varint(p, &u);
+      it->run_stride = zigzag_decode(u);
+      array_run_value(it, v);
+      break;
+
+    default:
+      if (array_element_decode(p, x - (int)(p - z), &it->run_elem) == -1) {
+        return -1;
+      }
+      *v = it->run_elem;
+      break;
+  }
+  it->p += x;
+  it->n -= x;
+  return 1;
+}
+
+// Skip k elements, without decoding whole runs that are skipped. Returns the
+// number of elements skipped, which is less than k only at the end of the
+// array, or -1 if the array is malformed.
+sqlite3_int64 array_iter_skip(array_iter *it, sqlite3_int64 k) {
+  sqlite3_int64 skipped = 0;
+  array_value v;
+
+  while (skipped < k) {
+    if (it->run_left > 0 && it->run != ARRAY_TYPE_DELTA) {
+      sqlite3_int64 m = k - skipped;
+      if (m > it->run_left) {
+        m = it->run_left;
+      }
+      it->run_value = (sqlite3_int64)((sqlite3_uint64)it->run_value +
+                                      (sqlite3_uint64)m *
+                                          (sqlite3_uint64)it->run_stride);
+      it->run_left -= m;
+      skipped += m;
+      continue;
+    }
+    if (it->run_left <= 0 && it->n > 0) {
+      int x = array_value_advance(it->p, it->n);
+      if (x == -1) {
+        return -1;
+      }
+      sqlite3_int64 count = array_unit_count(it->p);
+      if (count <= k - skipped) {
+        it->p += x;
+        it->n -= x;
+        skipped += count;
+        continue;
+      }
+    }
+
+    int rc = array_iter_next(it, &v);
+    if (rc != 1) {
+      return rc == 0 ? skipped : -1;
+    }
+    skipped++;
+  }
+  return skipped;
+}
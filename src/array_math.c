@@ -0,0 +1,1243 @@
+#include "array_math.h"
+
+#include <string.h>
+
+#include "array.h"
+#include "array_buffer.h"
+
+// Limit on decoded arrays, keeping all buffer sizes within an int.
+#define NUM_ARRAY_MAX_LENGTH 100000000
+
+#define RESAMPLE_LINEAR 0
+#define RESAMPLE_PREVIOUS 1
+#define RESAMPLE_NEXT 2
+#define RESAMPLE_NEAREST 3
+#define RESAMPLE_CUBIC 4
+
+static int resample_method(const unsigned char *z) {
+  static const char *const names[] = {"linear", "previous", "next", "nearest",
+                                      "cubic"};
+  if (!z) {
+    return RESAMPLE_LINEAR;
+  }
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    if (!sqlite3_stricmp((const char *)z, names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Tangent at point k for cubic Hermite interpolation, using finite
+// differences so irregular spacing is taken into account.
+static double resample_tangent(const sqlite3_int64 *ts, const array_value *vs,
+                               int m, int k) {
+  int a = k > 0 ? k - 1 : k;
+  int b = k < m - 1 ? k + 1 : k;
+  if (a == b) {
+    return 0.0;
+  }
+  return (vs[b].f - vs[a].f) / (double)(ts[b] - ts[a]);
+}
+
+void array_resample_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  int ts_n = sqlite3_value_bytes(argv[0]);
+  const unsigned char *ts_z = sqlite3_value_blob(argv[0]);
+  int values_n = sqlite3_value_bytes(argv[1]);
+  const unsigned char *values_z = sqlite3_value_blob(argv[1]);
+  sqlite3_int64 start = sqlite3_value_int64(argv[2]);
+  sqlite3_int64 step = sqlite3_value_int64(argv[3]);
+  sqlite3_int64 count = sqlite3_value_int64(argv[4]);
+  int method = resample_method(argc > 5 ? sqlite3_value_text(argv[5]) : NULL);
+
+  if (step < 1) {
+    sqlite3_result_error(context, "invalid resample step", -1);
+    return;
+  }
+  if (count < 0 || count > 0x7fffffff / 10) {
+    sqlite3_result_error(context, "invalid resample count", -1);
+    return;
+  }
+  if (method < 0) {
+    sqlite3_result_error(context, "unknown resample method", -1);
+    return;
+  }
+
+  // Upper bound on the number of input points. Runs expand far beyond the
+  // size of the blob, so the elements are counted (without expanding runs).
+  sqlite3_int64 ts_count = array_count(ts_z, ts_n);
+  sqlite3_int64 values_count = array_count(values_z, values_n);
+  if (ts_count < 0 || values_count < 0) {
+    sqlite3_result_error(context, "malformed array", -1);
+    return;
+  }
+  if (ts_count != values_count) {
+    sqlite3_result_error(context, "array lengths differ", -1);
+    return;
+  }
+  if (ts_count > NUM_ARRAY_MAX_LENGTH) {
+    sqlite3_result_error(context, "array too large", -1);
+    return;
+  }
+  sqlite3_int64 cap = ts_count;
+  sqlite3_int64 *ts = sqlite3_malloc64((cap + 1) * sizeof(sqlite3_int64));
+  array_value *vs = sqlite3_malloc64((cap + 1) * sizeof(array_value));
+  array_buffer buf = {NULL, 0, 0};
+  if (!ts || !vs) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  // Decode the (ts, value) pairs, skipping points where either is NULL.
+  array_iter ts_it, values_it;
+  array_iter_init(&ts_it, ts_z, ts_n);
+  array_iter_init(&values_it, values_z, values_n);
+  array_value t, v;
+  int m = 0;
+  for (;;) {
+    int a = array_iter_next(&ts_it, &t);
+    int b = array_iter_next(&values_it, &v);
+    if (a == -1 || b == -1) {
+      sqlite3_result_error(context, "malformed array", -1);
+      goto done;
+    }
+    if (a != b) {
+      sqlite3_result_error(context, "array lengths differ", -1);
+      goto done;
+    }
+    if (!a) {
+      break;
+    }
+    if (t.type == SQLITE_NULL || v.type == SQLITE_NULL) {
+      continue;
+    }
+    if (t.type != SQLITE_INTEGER ||
+        (v.type != SQLITE_INTEGER && v.type != SQLITE_FLOAT)) {
+      sqlite3_result_error(context, "array element is not numeric", -1);
+      goto done;
+    }
+    if (m > 0 && t.i <= ts[m - 1]) {
+      sqlite3_result_error(context, "timestamps are not strictly increasing",
+                           -1);
+      goto done;
+    }
+    ts[m] = t.i;
+    vs[m] = v;
+    m++;
+  }
+
+  if (array_buffer_grow(&buf, (int)count * 9 + 1)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  // Single merge pass: j is the last input point at or before the grid point.
+  array_value null_value = {SQLITE_NULL, 0, 0.0, NULL, 0};
+  int j = -1;
+  for (sqlite3_int64 k = 0; k < count; k++) {
+    sqlite3_int64 g = start + k * step;
+    while (j + 1 < m && ts[j + 1] <= g) {
+      j++;
+    }
+
+    const array_value *out = &null_value;
+    array_value computed = {SQLITE_FLOAT, 0, 0.0, NULL, 0};
+    int has_prev = j >= 0;
+    int has_next = j + 1 < m;
+    if (has_prev && ts[j] == g) {
+      out = &vs[j];
+    } else {
+      switch (method) {
+        case RESAMPLE_PREVIOUS:
+          if (has_prev) {
+            out = &vs[j];
+          }
+          break;
+
+        case RESAMPLE_NEXT:
+          if (has_next) {
+            out = &vs[j + 1];
+          }
+          break;
+
+        case RESAMPLE_NEAREST:
+          if (has_prev && has_next) {
+            out = ts[j + 1] - g < g - ts[j] ? &vs[j + 1] : &vs[j];
+          } else if (has_prev) {
+            out = &vs[j];
+          } else if (has_next) {
+            out = &vs[j + 1];
+          }
+          break;
+
+        case RESAMPLE_LINEAR:
+          if (has_prev && has_next) {
+            // Same formula as lerp.
+            double f = (double)(g - ts[j]) / (double)(ts[j + 1] - ts[j]);
+            computed.f = vs[j].f + f * (vs[j + 1].f - vs[j].f);
+            out = &computed;
+          }
+          break;
+
+        case RESAMPLE_CUBIC:
+          if (has_prev && has_next) {
+            double h = (double)(ts[j + 1] - ts[j]);
+            double s = (double)(g - ts[j]) / h;
+            double s2 = s * s;
+            double s3 = s2 * s;
+            computed.f =
+                (2 * s3 - 3 * s2 + 1) * vs[j].f +
+                (s3 - 2 * s2 + s) * h * resample_tangent(ts, vs, m, j) +
+                (-2 * s3 + 3 * s2) * vs[j + 1].f +
+                (s3 - s2) * h * resample_tangent(ts, vs, m, j + 1);
+            out = &computed;
+          }
+          break;
+      }
+    }
+
+    if (array_buffer_append_element(&buf, out)) {
+      sqlite3_result_error_nomem(context);
+      goto done;
+    }
+  }
+
+  sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+
+done:
+  sqlite3_free(buf.buf);
+  sqlite3_free(vs);
+  sqlite3_free(ts);
+}
+
+// A numeric array decoded into flat buffers, so the kernels below are plain
+// loops over contiguous memory that the compiler can vectorize. Every element
+// has both its integer and its floating point representation, t holds the
+// element type (SQLITE_NULL, SQLITE_INTEGER or SQLITE_FLOAT).
+typedef struct {
+  int n;
+  sqlite3_int64 *i;
+  double *f;
+  unsigned char *t;
+} num_array;
+
+static void num_array_free(num_array *a) {
+  sqlite3_free(a->i);
+  memset(a, 0, sizeof(*a));
+}
+
+static int num_array_alloc(num_array *a, int n) {
+  // One allocation for all three buffers.
+  size_t sz = (size_t)n * (sizeof(sqlite3_int64) + sizeof(double) + 1) + 1;
+  unsigned char *z = sqlite3_malloc64(sz);
+  if (!z) {
+    return SQLITE_NOMEM;
+  }
+  a->n = n;
+  a->i = (sqlite3_int64 *)z;
+  a->f = (double *)&z[n * sizeof(sqlite3_int64)];
+  a->t = &z[n * (sizeof(sqlite3_int64) + sizeof(double))];
+  return SQLITE_OK;
+}
+
+static void num_array_set(num_array *a, int k, const array_value *v) {
+  a->t[k] = (unsigned char)v->type;
+  a->i[k] = v->type == SQLITE_INTEGER ? v->i : 0;
+  a->f[k] = v->type == SQLITE_NULL ? 0.0 : v->f;
+}
+
+// Decode argument arg into a. A scalar is broadcast to n elements, pass n < 0
+// when the length isn't known (yet). Returns NULL on success or an error
+// message.
+static const char *num_array_decode(num_array *a, sqlite3_value *arg, int n) {
+  array_value v = {SQLITE_NULL, 0, 0.0, NULL, 0};
+  int type = sqlite3_value_type(arg);
+
+  if (type != SQLITE_BLOB) {
+    if (n < 0) {
+      return "expected an array";
+    }
+    switch (type) {
+      case SQLITE_INTEGER:
+        v.type = SQLITE_INTEGER;
+        v.i = sqlite3_value_int64(arg);
+        v.f = (double)v.i;
+        break;
+      case SQLITE_FLOAT:
+        v.type = SQLITE_FLOAT;
+        v.f = sqlite3_value_double(arg);
+        break;
+      case SQLITE_TEXT:
+        return "array element is not numeric";
+    }
+    if (num_array_alloc(a, n)) {
+      return "out of memory";
+    }
+    for (int k = 0; k < n; k++) {
+      num_array_set(a, k, &v);
+    }
+    return NULL;
+  }
+
+  int s = sqlite3_value_bytes(arg);
+  const unsigned char *z = sqlite3_value_blob(arg);
+
+  // First pass counts, so the buffers are allocated exactly once.
+  array_iter it;
+  int count = 0;
+  int rc;
+  array_iter_init(&it, z, s);
+  while ((rc = array_iter_next(&it, &v)) == 1) {
+    if (v.type == SQLITE_TEXT || v.type == SQLITE_BLOB) {
+      return "array element is not numeric";
+    }
+    // Runs can expand far beyond the size of the blob.
+    if (++count > NUM_ARRAY_MAX_LENGTH) {
+      return "array too large";
+    }
+  }
+  if (rc == -1) {
+    return "malformed array";
+  }
+  if (n >= 0 && count != n) {
+    return "array lengths differ";
+  }
+  if (num_array_alloc(a, count)) {
+    return "out of memory";
+  }
+
+  array_iter_init(&it, z, s);
+  for (int k = 0; array_iter_next(&it, &v) == 1; k++) {
+    num_array_set(a, k, &v);
+  }
+  return NULL;
+}
+
+// Length of the first array argument, or -1 if neither is an array. A NULL
+// array makes the whole result NULL, which is signalled by -1 without an
+// error message.
+static int num_array_length(sqlite3_value *a, sqlite3_value *b,
+                            const char **err) {
+  sqlite3_value *arg = sqlite3_value_type(a) == SQLITE_BLOB ? a : b;
+  *err = NULL;
+  if (sqlite3_value_type(arg) != SQLITE_BLOB) {
+    if (sqlite3_value_type(a) != SQLITE_NULL &&
+        sqlite3_value_type(b) != SQLITE_NULL) {
+      *err = "expected an array";
+    }
+    return -1;
+  }
+  // Counted without decoding, the elements are checked when decoded.
+  sqlite3_int64 n =
+      array_count(sqlite3_value_blob(arg), sqlite3_value_bytes(arg));
+  if (n < 0) {
+    *err = "malformed array";
+  } else if (n > NUM_ARRAY_MAX_LENGTH) {
+    *err = "array too large";
+  }
+  return *err ? -1 : (int)n;
+}
+
+// Encode the result of a kernel. Element k is NULL if t[k] is SQLITE_NULL, an
+// integer taken from i if t[k] is SQLITE_INTEGER and a float from f
+// otherwise. The buffer is sized for the worst case up front.
+static void num_array_result(sqlite3_context *context, const num_array *r) {
+  array_buffer buf = {NULL, 0, 0};
+  if (array_buffer_grow(&buf, r->n * 10 + 1)) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  array_value v = {SQLITE_NULL, 0, 0.0, NULL, 0};
+  for (int k = 0; k < r->n; k++) {
+    v.type = r->t[k];
+    v.i = r->i[k];
+    v.f = r->f[k];
+    array_buffer_append_element(&buf, &v);
+  }
+
+  sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  sqlite3_free(buf.buf);
+}
+
+#define MATH_ADD 0
+#define MATH_SUB 1
+#define MATH_MUL 2
+#define MATH_DIV 3
+
+static void math_float_kernel(int op, int n, const double *restrict a,
+                              const double *restrict b, double *restrict r) {
+  switch (op) {
+    case MATH_ADD:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] + b[k];
+      }
+      break;
+    case MATH_SUB:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] - b[k];
+      }
+      break;
+    case MATH_MUL:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] * b[k];
+      }
+      break;
+    case MATH_DIV:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] / b[k];
+      }
+      break;
+  }
+}
+
+// Integer results wrap, ovf[k] is set where the result overflowed so that
+// element falls back to floating point like it would in SQL.
+static void math_int_kernel(int op, int n, const sqlite3_int64 *restrict a,
+                            const sqlite3_int64 *restrict b,
+                            sqlite3_int64 *restrict r,
+                            unsigned char *restrict ovf) {
+  switch (op) {
+    case MATH_ADD:
+      for (int k = 0; k < n; k++) {
+        r[k] = (sqlite3_int64)((sqlite3_uint64)a[k] + (sqlite3_uint64)b[k]);
+        ovf[k] = ((a[k] ^ r[k]) & (b[k] ^ r[k])) < 0;
+      }
+      break;
+    case MATH_SUB:
+      for (int k = 0; k < n; k++) {
+        r[k] = (sqlite3_int64)((sqlite3_uint64)a[k] - (sqlite3_uint64)b[k]);
+        ovf[k] = ((a[k] ^ b[k]) & (a[k] ^ r[k])) < 0;
+      }
+      break;
+    case MATH_MUL:
+      for (int k = 0; k < n; k++) {
+        ovf[k] = __builtin_mul_overflow(a[k], b[k], &r[k]);
+      }
+      break;
+    case MATH_DIV:
+      for (int k = 0; k < n; k++) {
+        ovf[k] = a[k] == (sqlite3_int64)(-0x7fffffffffffffffLL - 1) &&
+                 b[k] == -1;
+        r[k] = b[k] && !ovf[k] ? a[k] / b[k] : 0;
+      }
+      break;
+  }
+}
+
+static void math_binary(sqlite3_context *context, sqlite3_value **argv,
+                        int op) {
+  const char *err;
+  int n = num_array_length(argv[0], argv[1], &err);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+  if (n < 0) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  num_array b = {0, NULL, NULL, NULL};
+  num_array r = {0, NULL, NULL, NULL};
+  if ((err = num_array_decode(&a, argv[0], n)) ||
+      (err = num_array_decode(&b, argv[1], n))) {
+    sqlite3_result_error(context, err, -1);
+    goto done;
+  }
+  if (num_array_alloc(&r, n)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  math_float_kernel(op, n, a.f, b.f, r.f);
+  math_int_kernel(op, n, a.i, b.i, r.i, r.t);
+
+  // Pick the result type per element, like SQL arithmetic does: NULL if
+  // either side is NULL (or on division by zero), integer if both sides are
+  // integers and the result fits, float otherwise.
+  for (int k = 0; k < n; k++) {
+    unsigned char t;
+    if (a.t[k] == SQLITE_NULL || b.t[k] == SQLITE_NULL ||
+        (op == MATH_DIV && b.f[k] == 0.0)) {
+      t = SQLITE_NULL;
+    } else if (a.t[k] == SQLITE_INTEGER && b.t[k] == SQLITE_INTEGER &&
+               !r.t[k]) {
+      t = SQLITE_INTEGER;
+    } else {
+      t = SQLITE_FLOAT;
+    }
+    r.t[k] = t;
+  }
+
+  num_array_result(context, &r);
+
+done:
+  num_array_free(&r);
+  num_array_free(&b);
+  num_array_free(&a);
+}
+
+void array_add_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_binary(context, argv, MATH_ADD);
+}
+
+void array_sub_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_binary(context, argv, MATH_SUB);
+}
+
+void array_mul_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_binary(context, argv, MATH_MUL);
+}
+
+void array_div_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_binary(context, argv, MATH_DIV);
+}
+
+void array_abs_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  const char *err = num_array_decode(&a, argv[0], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+
+  int n = a.n;
+  double *restrict f = a.f;
+  sqlite3_int64 *restrict i = a.i;
+  for (int k = 0; k < n; k++) {
+    f[k] = f[k] < 0 ? -f[k] : f[k];
+  }
+  for (int k = 0; k < n; k++) {
+    i[k] = i[k] < 0 ? (sqlite3_int64)(0 - (sqlite3_uint64)i[k]) : i[k];
+  }
+  // abs() of the smallest integer doesn't fit, fall back to float there.
+  for (int k = 0; k < n; k++) {
+    if (a.t[k] == SQLITE_INTEGER && i[k] < 0) {
+      a.t[k] = SQLITE_FLOAT;
+    }
+  }
+
+  num_array_result(context, &a);
+  num_array_free(&a);
+}
+
+void array_clamp_func(sqlite3_context *context, int argc,
+                      sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  const char *err = num_array_decode(&a, argv[0], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+
+  // A NULL bound means unbounded on that side.
+  for (int side = 0; side < 2; side++) {
+    sqlite3_value *bound = argv[1 + side];
+    int type = sqlite3_value_type(bound);
+    if (type == SQLITE_NULL) {
+      continue;
+    }
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+      sqlite3_result_error(context, "clamp bound is not numeric", -1);
+      num_array_free(&a);
+      return;
+    }
+
+    int n = a.n;
+    double bf = sqlite3_value_double(bound);
+    sqlite3_int64 bi = sqlite3_value_int64(bound);
+    double *restrict f = a.f;
+    sqlite3_int64 *restrict i = a.i;
+    unsigned char *restrict t = a.t;
+    // Integers clamped to a float bound become floats.
+    if (type == SQLITE_FLOAT) {
+      for (int k = 0; k < n; k++) {
+        if (t[k] == SQLITE_INTEGER && (side ? f[k] > bf : f[k] < bf)) {
+          t[k] = SQLITE_FLOAT;
+        }
+      }
+    }
+    if (!side) {
+      for (int k = 0; k < n; k++) {
+        f[k] = f[k] < bf ? bf : f[k];
+      }
+      for (int k = 0; k < n; k++) {
+        i[k] = i[k] < bi ? bi : i[k];
+      }
+    } else {
+      for (int k = 0; k < n; k++) {
+        f[k] = f[k] > bf ? bf : f[k];
+      }
+      for (int k = 0; k < n; k++) {
+        i[k] = i[k] > bi ? bi : i[k];
+      }
+    }
+  }
+
+  num_array_result(context, &a);
+  num_array_free(&a);
+}
+
+#define MATH_EQ 0
+#define MATH_NE 1
+#define MATH_LT 2
+#define MATH_LE 3
+#define MATH_GT 4
+#define MATH_GE 5
+
+static void math_compare_kernel(int op, int n, const double *restrict a,
+                                const double *restrict b,
+                                double *restrict r) {
+  switch (op) {
+    case MATH_EQ:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] == b[k] ? 1.0 : 0.0;
+      }
+      break;
+    case MATH_NE:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] != b[k] ? 1.0 : 0.0;
+      }
+      break;
+    case MATH_LT:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] < b[k] ? 1.0 : 0.0;
+      }
+      break;
+    case MATH_LE:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] <= b[k] ? 1.0 : 0.0;
+      }
+      break;
+    case MATH_GT:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] > b[k] ? 1.0 : 0.0;
+      }
+      break;
+    case MATH_GE:
+      for (int k = 0; k < n; k++) {
+        r[k] = a[k] >= b[k] ? 1.0 : 0.0;
+      }
+      break;
+  }
+}
+
+static int math_compare_int(int op, sqlite3_int64 a, sqlite3_int64 b) {
+  switch (op) {
+    case MATH_EQ:
+      return a == b;
+    case MATH_NE:
+      return a != b;
+    case MATH_LT:
+      return a < b;
+    case MATH_LE:
+      return a <= b;
+    case MATH_GT:
+      return a > b;
+  }
+  return a >= b;
+}
+
+// Comparison masks, 1 where the comparison holds and 0 where it doesn't.
+static void math_compare(sqlite3_context *context, sqlite3_value **argv,
+                         int op) {
+  const char *err;
+  int n = num_array_length(argv[0], argv[1], &err);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+  if (n < 0) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  num_array b = {0, NULL, NULL, NULL};
+  num_array r = {0, NULL, NULL, NULL};
+  if ((err = num_array_decode(&a, argv[0], n)) ||
+      (err = num_array_decode(&b, argv[1], n))) {
+    sqlite3_result_error(context, err, -1);
+    goto done;
+  }
+  if (num_array_alloc(&r, n)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  math_compare_kernel(op, n, a.f, b.f, r.f);
+  for (int k = 0; k < n; k++) {
+    if (a.t[k] == SQLITE_NULL || b.t[k] == SQLITE_NULL) {
+      r.t[k] = SQLITE_NULL;
+      continue;
+    }
+    // Doubles can't represent every 64-bit integer, compare those exactly.
+    if (a.t[k] == SQLITE_INTEGER && b.t[k] == SQLITE_INTEGER) {
+      r.i[k] = math_compare_int(op, a.i[k], b.i[k]);
+    } else {
+      r.i[k] = r.f[k] != 0.0;
+    }
+    r.t[k] = SQLITE_INTEGER;
+  }
+
+  num_array_result(context, &r);
+
+done:
+  num_array_free(&r);
+  num_array_free(&b);
+  num_array_free(&a);
+}
+
+void array_filter_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+
+  int s = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+
+  num_array mask = {0, NULL, NULL, NULL};
+  const char *err = num_array_decode(&mask, argv[1], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+
+  // Runs in the input are expanded, so selected elements are re-encoded
+  // one by one.
+  array_buffer buf = {NULL, 0, 0};
+  if (array_buffer_grow(&buf, s + 1)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  array_iter it;
+  array_value v;
+  int k = 0;
+  int rc;
+  array_iter_init(&it, z, s);
+  for (;;) {
+    rc = array_iter_next(&it, &v);
+    if (rc != 1) {
+      break;
+    }
+    if (k >= mask.n) {
+      rc = -2;
+      break;
+    }
+    if (mask.t[k] != SQLITE_NULL && mask.f[k] != 0.0 &&
+        array_buffer_append_element(&buf, &v)) {
+      rc = -3;
+      break;
+    }
+    k++;
+  }
+  if (rc == -3) {
+    sqlite3_result_error_nomem(context);
+  } else if (rc == -1) {
+    sqlite3_result_error(context, "malformed array", -1);
+  } else if (rc == -2 || k != mask.n) {
+    sqlite3_result_error(context, "array lengths differ", -1);
+  } else {
+    sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  }
+
+done:
+  sqlite3_free(buf.buf);
+  num_array_free(&mask);
+}
+
+void array_eq_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_EQ);
+}
+
+void array_ne_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_NE);
+}
+
+void array_lt_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_LT);
+}
+
+void array_le_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_LE);
+}
+
+void array_gt_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_GT);
+}
+
+void array_ge_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  math_compare(context, argv, MATH_GE);
+}
+
+// Sort keys: unsigned integers that order like the elements. Integers flip
+// their sign bit, floats also invert all bits when negative.
+static sqlite3_uint64 sort_int_key(sqlite3_int64 i) {
+  return (sqlite3_uint64)i ^ 0x8000000000000000ULL;
+}
+
+static sqlite3_uint64 sort_float_key(double f) {
+  double_rep v;
+  v.f = f == 0.0 ? 0.0 : f;  // -0.0 equals 0.0.
+  return (v.d >> 63) ? ~v.d : v.d ^ 0x8000000000000000ULL;
+}
+
+// Stable LSD radix sort of the words in a by bytes from and up, a byte per
+// pass, carrying the values in idx (if any) along. The histograms of all
+// bytes are built in a single pass and bytes that are the same in every word
+// are skipped. The result ends up in a and idx, tmp and idx_tmp are scratch.
+static void radix_sort_words(sqlite3_uint64 *a, sqlite3_uint64 *tmp, int *idx,
+                             int *idx_tmp, int n, int from) {
+  int counts[sizeof(sqlite3_uint64)][256];
+  memset(counts, 0, sizeof(counts));
+  for (int k = 0; k < n; k++) {
+    sqlite3_uint64 w = a[k];
+    for (int p = from; p < 8; p++) {
+      counts[p][(w >> (8 * p)) & 0xff]++;
+    }
+  }
+
+  sqlite3_uint64 *src = a, *dst = tmp;
+  int *src_idx = idx, *dst_idx = idx_tmp;
+  for (int p = from; p < 8; p++) {
+    int *count = counts[p];
+    if (count[(a[0] >> (8 * p)) & 0xff] == n) {
+      continue;
+    }
+    int offset = 0;
+    for (int b = 0; b < 256; b++) {
+      int c = count[b];
+      count[b] = offset;
+      offset += c;
+    }
+    for (int k = 0; k < n; k++) {
+      int pos = count[(src[k] >> (8 * p)) & 0xff]++;
+      dst[pos] = src[k];
+      if (idx) {
+        dst_idx[pos] = src_idx[k];
+      }
+    }
+    sqlite3_uint64 *t = src;
+    src = dst;
+    dst = t;
+    int *u = src_idx;
+    src_idx = dst_idx;
+    dst_idx = u;
+  }
+  if (src != a) {
+    memcpy(a, src, (size_t)n * sizeof(sqlite3_uint64));
+    if (idx) {
+      memcpy(idx, src_idx, (size_t)n * sizeof(int));
+    }
+  }
+}
+
+// Stable radix sort of n keys, permuting idx along. The keys themselves are
+// clobbered. Keys are taken relative
+// to the smallest one. When that fits in 32 bits, which it does for the
+// timestamps of a chunk, the key and the position share a word: sorting the
+// words is stable by construction and moves half the data per pass.
+static int radix_sort(sqlite3_uint64 *keys, int *idx, int n) {
+  if (n < 2) {
+    return SQLITE_OK;
+  }
+  sqlite3_uint64 lo = keys[0], hi = keys[0];
+  for (int k = 1; k < n; k++) {
+    lo = keys[k] < lo ? keys[k] : lo;
+    hi = keys[k] > hi ? keys[k] : hi;
+  }
+  int packed = hi - lo <= 0xffffffffULL;
+
+  size_t sz = (size_t)n * sizeof(sqlite3_uint64) * (packed ? 2 : 1) +
+              (packed ? 0 : (size_t)n * sizeof(int));
+  unsigned char *z = sqlite3_malloc64(sz);
+  if (!z) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_uint64 *tmp = (sqlite3_uint64 *)z;
+
+  if (!packed) {
+    int *idx_tmp = (int *)&z[(size_t)n * sizeof(sqlite3_uint64)];
+    radix_sort_words(keys, tmp, idx, idx_tmp, n, 0);
+    sqlite3_free(z);
+    return SQLITE_OK;
+  }
+
+  sqlite3_uint64 *words = &tmp[n];
+  for (int k = 0; k < n; k++) {
+    words[k] = (keys[k] - lo) << 32 | (sqlite3_uint64)k;
+  }
+  radix_sort_words(words, tmp, NULL, NULL, n, 4);
+  // keys is free now, use it to permute idx.
+  int *from = (int *)keys;
+  memcpy(from, idx, (size_t)n * sizeof(int));
+  for (int k = 0; k < n; k++) {
+    idx[k] = from[words[k] & 0xffffffff];
+  }
+  sqlite3_free(z);
+  return SQLITE_OK;
+}
+
+// Order of the elements of a: NULLs first, then by value. Integer arrays
+// sort on the integers, arrays with floats on the floating point values.
+// Returns the permutation in idx (n ints), or NULL on an out of memory.
+static int *num_array_argsort(const num_array *a) {
+  int n = a->n;
+  int *idx = sqlite3_malloc64((size_t)n * sizeof(int) + 1);
+  sqlite3_uint64 *keys =
+      sqlite3_malloc64((size_t)n * sizeof(sqlite3_uint64) + 1);
+  if (!idx || !keys) {
+    sqlite3_free(idx);
+    sqlite3_free(keys);
+    return NULL;
+  }
+
+  int floats = 0;
+  for (int k = 0; k < n; k++) {
+    floats |= a->t[k] == SQLITE_FLOAT;
+  }
+
+  // NULLs go in front in their original order, only the rest is sorted.
+  int nulls = 0;
+  for (int k = 0; k < n; k++) {
+    if (a->t[k] == SQLITE_NULL) {
+      idx[nulls++] = k;
+    }
+  }
+  int m = nulls;
+  for (int k = 0; k < n; k++) {
+    if (a->t[k] != SQLITE_NULL) {
+      keys[m] = floats ? sort_float_key(a->f[k]) : sort_int_key(a->i[k]);
+      idx[m++] = k;
+    }
+  }
+
+  int rc = radix_sort(&keys[nulls], &idx[nulls], n - nulls);
+  sqlite3_free(keys);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+void array_sort_func(sqlite3_context *context, int argc,
+                     sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  num_array r = {0, NULL, NULL, NULL};
+  int *idx = NULL;
+  const char *err = num_array_decode(&a, argv[0], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+
+  idx = num_array_argsort(&a);
+  if (!idx || num_array_alloc(&r, a.n)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+  for (int k = 0; k < a.n; k++) {
+    r.t[k] = a.t[idx[k]];
+    r.i[k] = a.i[idx[k]];
+    r.f[k] = a.f[idx[k]];
+  }
+  num_array_result(context, &r);
+
+done:
+  sqlite3_free(idx);
+  num_array_free(&a);
+  num_array_free(&r);
+}
+
+void array_argsort_func(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  num_array a = {0, NULL, NULL, NULL};
+  const char *err = num_array_decode(&a, argv[0], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+
+  int *idx = num_array_argsort(&a);
+  if (!idx) {
+    sqlite3_result_error_nomem(context);
+    num_array_free(&a);
+    return;
+  }
+  // The indices replace the elements in place.
+  for (int k = 0; k < a.n; k++) {
+    a.t[k] = SQLITE_INTEGER;
+    a.i[k] = idx[k];
+  }
+  num_array_result(context, &a);
+  sqlite3_free(idx);
+  num_array_free(&a);
+}
+
+// Decode all elements of an array of any type. TEXT and BLOB elements point
+// into the blob. Returns NULL on success or an error message.
+static const char *array_values_decode(sqlite3_value *arg, array_value **out,
+                                       int *n) {
+  int s = sqlite3_value_bytes(arg);
+  const unsigned char *z = sqlite3_value_blob(arg);
+
+  array_iter it;
+  array_value v;
+  int count = 0;
+  int rc;
+  array_iter_init(&it, z, s);
+  while ((rc = array_iter_skip(&it, NUM_ARRAY_MAX_LENGTH + 1)) > 0) {
+    count += rc;
+    if (count > NUM_ARRAY_MAX_LENGTH) {
+      return "array too large";
+    }
+  }
+  if (rc == -1) {
+    return "malformed array";
+  }
+
+  array_value *values = sqlite3_malloc64((size_t)count * sizeof(*values) + 1);
+  if (!values) {
+    return "out of memory";
+  }
+  array_iter_init(&it, z, s);
+  for (int k = 0; k < count; k++) {
+    array_iter_next(&it, &v);
+    values[k] = v;
+  }
+  *out = values;
+  *n = count;
+  return NULL;
+}
+
+void array_take_func(sqlite3_context *context, int argc,
+                     sqlite3_value **argv) {
+  UNUSED(argc);
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+
+  array_value *values = NULL;
+  int n = 0;
+  num_array idx = {0, NULL, NULL, NULL};
+  array_buffer buf = {NULL, 0, 0};
+  const char *err = array_values_decode(argv[0], &values, &n);
+  if (!err) {
+    err = num_array_decode(&idx, argv[1], -1);
+  }
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    goto done;
+  }
+
+  static const array_value null_value = {SQLITE_NULL, 0, 0.0, NULL, 0};
+  if (array_buffer_grow(&buf, sqlite3_value_bytes(argv[0]) + 1)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+  for (int k = 0; k < idx.n; k++) {
+    const array_value *v = &null_value;
+    if (idx.t[k] == SQLITE_FLOAT) {
+      sqlite3_result_error(context, "index is not an integer", -1);
+      goto done;
+    }
+    if (idx.t[k] == SQLITE_INTEGER) {
+      if (idx.i[k] < 0 || idx.i[k] >= n) {
+        sqlite3_result_error(context, "index out of bounds", -1);
+        goto done;
+      }
+      v = &values[idx.i[k]];
+    }
+    if (array_buffer_append_element(&buf, v)) {
+      sqlite3_result_error_nomem(context);
+      goto done;
+    }
+  }
+  sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+
+done:
+  sqlite3_free(buf.buf);
+  sqlite3_free(values);
+  num_array_free(&idx);
+}
+
+#define DEDUPE_FIRST 0
+#define DEDUPE_LAST 1
+#define DEDUPE_AVG 2
+
+static int dedupe_policy(const unsigned char *z) {
+  if (!z || !sqlite3_stricmp((const char *)z, "last")) {
+    return DEDUPE_LAST;
+  }
+  if (!sqlite3_stricmp((const char *)z, "first")) {
+    return DEDUPE_FIRST;
+  }
+  if (!sqlite3_stricmp((const char *)z, "avg")) {
+    return DEDUPE_AVG;
+  }
+  return -1;
+}
+
+// array_dedupe_sorted(ts) returns the distinct timestamps of a sorted
+// timestamp array, array_dedupe_sorted(ts, values [, policy]) the value for
+// each of them: the first or last (default) of the duplicates, or their
+// average ignoring NULLs.
+void array_dedupe_sorted_func(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  for (int i = 0; i < argc && i < 2; i++) {
+    if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+      return;
+    }
+  }
+  int policy = dedupe_policy(argc > 2 ? sqlite3_value_text(argv[2]) : NULL);
+  if (policy < 0) {
+    sqlite3_result_error(context, "unknown dedupe policy", -1);
+    return;
+  }
+
+  num_array ts = {0, NULL, NULL, NULL};
+  array_buffer buf = {NULL, 0, 0};
+  const char *err = num_array_decode(&ts, argv[0], -1);
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    return;
+  }
+  for (int k = 0; k < ts.n; k++) {
+    if (ts.t[k] != SQLITE_INTEGER) {
+      err = "timestamp is not an integer";
+      break;
+    }
+    if (k > 0 && ts.i[k] < ts.i[k - 1]) {
+      err = "timestamps are not sorted";
+      break;
+    }
+  }
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+    goto done;
+  }
+
+  if (argc == 1) {
+    int m = 0;
+    for (int k = 0; k < ts.n; k++) {
+      if (k == 0 || ts.i[k] != ts.i[m - 1]) {
+        ts.i[m++] = ts.i[k];
+      }
+    }
+    ts.n = m;
+    num_array_result(context, &ts);
+    goto done;
+  }
+
+  int s = sqlite3_value_bytes(argv[1]);
+  const unsigned char *z = sqlite3_value_blob(argv[1]);
+  if (array_buffer_grow(&buf, s + 1)) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+
+  // Values are consumed in lockstep with the runs of equal timestamps.
+  array_iter it;
+  array_value v;
+  array_value kept = {SQLITE_NULL, 0, 0.0, NULL, 0};
+  array_iter_init(&it, z, s);
+  int k = 0;
+  while (k < ts.n) {
+    int sum_int = 1;
+    sqlite3_int64 count = 0, isum = 0;
+    double fsum = 0.0;
+    int j = k;
+    for (; j < ts.n && ts.i[j] == ts.i[k]; j++) {
+      int rc = array_iter_next(&it, &v);
+      if (rc != 1) {
+        err = rc ? "malformed array" : "array lengths differ";
+        break;
+      }
+      if (policy == DEDUPE_AVG) {
+        if (v.type == SQLITE_TEXT || v.type == SQLITE_BLOB) {
+          err = "array element is not numeric";
+          break;
+        }
+        if (v.type == SQLITE_NULL) {
+          continue;
+        }
+        count++;
+        fsum += v.f;
+        if (sum_int && v.type == SQLITE_INTEGER &&
+            !__builtin_add_overflow(isum, v.i, &isum)) {
+          continue;
+        }
+        sum_int = 0;
+      } else if (j == k || policy == DEDUPE_LAST) {
+        kept = v;
+      }
+    }
+    if (err) {
+      break;
+    }
+    if (policy == DEDUPE_AVG) {
+      kept.type = count ? SQLITE_FLOAT : SQLITE_NULL;
+      kept.f = count ? (sum_int ? (double)isum : fsum) / count : 0.0;
+    }
+    if (array_buffer_append_element(&buf, &kept)) {
+      err = "out of memory";
+      break;
+    }
+    k = j;
+  }
+  if (!err && array_iter_next(&it, &v) != 0) {
+    err = "array lengths differ";
+  }
+  if (err) {
+    sqlite3_result_error(context, err, -1);
+  } else {
+    sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  }
+
+done:
+  sqlite3_free(buf.buf);
+  num_array_free(&ts);
+}
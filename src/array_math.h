@@ -0,0 +1,34 @@
+#ifndef TSLITE_ARRAY_MATH_H
+#define TSLITE_ARRAY_MATH_H
+
+#include "tslite.h"
+
+void array_resample_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv);
+
+void array_add_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_sub_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_mul_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_div_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_abs_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_clamp_func(sqlite3_context *context, int argc,
+                      sqlite3_value **argv);
+void array_eq_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_ne_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_lt_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_le_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_gt_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_ge_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void array_filter_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv);
+
+void array_sort_func(sqlite3_context *context, int argc,
+                     sqlite3_value **argv);
+void array_argsort_func(sqlite3_context *context, int argc,
+                        sqlite3_value **argv);
+void array_take_func(sqlite3_context *context, int argc,
+                     sqlite3_value **argv);
+void array_dedupe_sorted_func(sqlite3_context *context, int argc,
+                              sqlite3_value **argv);
+
+#endif  // TSLITE_ARRAY_MATH_H
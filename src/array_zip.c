@@ -0,0 +1,242 @@
+#include "array.h"
+
+#include <string.h>
+
+// Columns are "index", value1..valueN, then the hidden array1..arrayN.
+#define ARRAYS_ZIP_VTAB_INDEX 0
+#define ARRAYS_ZIP_VTAB_VALUE 1
+#define ARRAYS_ZIP_VTAB_ARRAY (ARRAYS_ZIP_VTAB_VALUE + ARRAYS_ZIP_MAX)
+
+static int arrays_zip_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                   const char *const *argv,
+                                   sqlite3_vtab **ppVtab, char **pzErr) {
+  UNUSED(pAux);
+  UNUSED(argc);
+  UNUSED(argv);
+  UNUSED(pzErr);
+
+  sqlite3_str *schema = sqlite3_str_new(db);
+  sqlite3_str_appendall(schema, "CREATE TABLE x(\"index\"");
+  for (int i = 1; i <= ARRAYS_ZIP_MAX; i++) {
+    sqlite3_str_appendf(schema, ", value%d", i);
+  }
+  for (int i = 1; i <= ARRAYS_ZIP_MAX; i++) {
+    sqlite3_str_appendf(schema, ", array%d HIDDEN", i);
+  }
+  sqlite3_str_appendall(schema, ")");
+  char *sql = sqlite3_str_finish(schema);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  arrays_zip_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+
+  return SQLITE_OK;
+}
+
+static int arrays_zip_vtab_disconnect(sqlite3_vtab *pVtab) {
+  arrays_zip_vtab *p = (arrays_zip_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int arrays_zip_vtab_open(sqlite3_vtab *p,
+                                sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  arrays_zip_vtab_cursor *cursor;
+  cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static void arrays_zip_vtab_reset(arrays_zip_vtab_cursor *cursor) {
+  for (int i = 0; i < ARRAYS_ZIP_MAX; i++) {
+    sqlite3_value_free(cursor->array[i]);
+    cursor->array[i] = NULL;
+  }
+  cursor->live = 0;
+}
+
+static int arrays_zip_vtab_close(sqlite3_vtab_cursor *cur) {
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+  arrays_zip_vtab_reset(cursor);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+// Decode the next element of every array that hasn't ended yet. The row is
+// past the end once all arrays have ended.
+static int arrays_zip_vtab_advance(arrays_zip_vtab_cursor *cursor) {
+  for (int i = 0; i < ARRAYS_ZIP_MAX; i++) {
+    if (!(cursor->live & (1u << i))) {
+      continue;
+    }
+    int rc = array_iter_next(&cursor->it[i], &cursor->value[i]);
+    if (rc == -1) {
+      cursor->base.pVtab->zErrMsg = sqlite3_mprintf("malformed array");
+      return SQLITE_ERROR;
+    }
+    if (!rc) {
+      cursor->live &= ~(1u << i);
+    }
+  }
+  cursor->eof = !cursor->live;
+  return SQLITE_OK;
+}
+
+static int arrays_zip_vtab_next(sqlite3_vtab_cursor *cur) {
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+  cursor->row_id++;
+  return arrays_zip_vtab_advance(cursor);
+}
+
+static int arrays_zip_vtab_column(sqlite3_vtab_cursor *cur,
+                                  sqlite3_context *context, int i) {
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+
+  if (i == ARRAYS_ZIP_VTAB_INDEX) {
+    sqlite3_result_int64(context, cursor->row_id);
+  } else if (i < ARRAYS_ZIP_VTAB_ARRAY) {
+    // Shorter arrays are padded with NULLs.
+    int k = i - ARRAYS_ZIP_VTAB_VALUE;
+    if (cursor->live & (1u << k)) {
+      array_value_result(context, &cursor->value[k]);
+    }
+  } else if (i < ARRAYS_ZIP_VTAB_ARRAY + ARRAYS_ZIP_MAX) {
+    sqlite3_value *array = cursor->array[i - ARRAYS_ZIP_VTAB_ARRAY];
+    if (array) {
+      sqlite3_result_value(context, array);
+    }
+  } else {
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+static int arrays_zip_vtab_rowid(sqlite3_vtab_cursor *cur,
+                                 sqlite_int64 *pRowid) {
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+  *pRowid = cursor->row_id;
+  return SQLITE_OK;
+}
+
+static int arrays_zip_vtab_eof(sqlite3_vtab_cursor *cur) {
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+  return cursor->eof;
+}
+
+// idxNum is the bitmask of the arrays passed, argv holds them in slot order.
+static int arrays_zip_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                                  const char *idxStr, int argc,
+                                  sqlite3_value **argv) {
+  UNUSED(idxStr);
+
+  arrays_zip_vtab_cursor *cursor = (arrays_zip_vtab_cursor *)cur;
+  arrays_zip_vtab_reset(cursor);
+  cursor->row_id = 0;
+  cursor->eof = 1;
+
+  int arg = 0;
+  for (int i = 0; i < ARRAYS_ZIP_MAX && arg < argc; i++) {
+    if (!(idxNum & (1 << i))) {
+      continue;
+    }
+    // The arguments only live until xFilter returns.
+    sqlite3_value *array = sqlite3_value_dup(argv[arg++]);
+    if (!array) {
+      return SQLITE_NOMEM;
+    }
+    cursor->array[i] = array;
+
+    int n = sqlite3_value_bytes(array);
+    const void *z = sqlite3_value_blob(array);
+    if (!z && n > 0) {
+      return SQLITE_NOMEM;
+    }
+    array_iter_init(&cursor->it[i], z, n);
+    cursor->live |= 1u << i;
+  }
+  return arrays_zip_vtab_advance(cursor);
+}
+
+static int arrays_zip_vtab_best_index(sqlite3_vtab *vtab,
+                                      sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  int arrayIdx[ARRAYS_ZIP_MAX];
+  for (int i = 0; i < ARRAYS_ZIP_MAX; i++) {
+    arrayIdx[i] = -1;
+  }
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    int k = constraint->iColumn - ARRAYS_ZIP_VTAB_ARRAY;
+    if (k < 0 || k >= ARRAYS_ZIP_MAX) {
+      continue;
+    }
+    if (!constraint->usable) {
+      // Unusable constraint on an array, reject the entire plan.
+      return SQLITE_CONSTRAINT;
+    }
+    if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      arrayIdx[k] = i;
+    }
+  }
+
+  int mask = 0;
+  int argvIndex = 0;
+  for (int k = 0; k < ARRAYS_ZIP_MAX; k++) {
+    if (arrayIdx[k] >= 0) {
+      mask |= 1 << k;
+      pIdxInfo->aConstraintUsage[arrayIdx[k]].argvIndex = ++argvIndex;
+      pIdxInfo->aConstraintUsage[arrayIdx[k]].omit = 1;
+    }
+  }
+  pIdxInfo->idxNum = mask;
+  if (mask) {
+    pIdxInfo->estimatedCost = 1.0;
+  }
+  return SQLITE_OK;
+}
+
+sqlite3_module arrays_zip_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ arrays_zip_vtab_connect,
+    /* xBestIndex  */ arrays_zip_vtab_best_index,
+    /* xDisconnect */ arrays_zip_vtab_disconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ arrays_zip_vtab_open,
+    /* xClose      */ arrays_zip_vtab_close,
+    /* xFilter     */ arrays_zip_vtab_filter,
+    /* xNext       */ arrays_zip_vtab_next,
+    /* xEof        */ arrays_zip_vtab_eof,
+    /* xColumn     */ arrays_zip_vtab_column,
+    /* xRowid      */ arrays_zip_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
@@ -0,0 +1,554 @@
+#include "asof.h"
+
+#include <string.h>
+
+#define ASOF_JOIN_VTAB_TS 0
+#define ASOF_JOIN_VTAB_VALUE 1
+#define ASOF_JOIN_VTAB_RIGHT_TS 2
+#define ASOF_JOIN_VTAB_RIGHT_VALUE 3
+#define ASOF_JOIN_VTAB_LEFT_TABLE 4
+#define ASOF_JOIN_VTAB_RIGHT_TABLE 5
+#define ASOF_JOIN_VTAB_TOLERANCE 6
+#define ASOF_JOIN_VTAB_DIRECTION 7
+
+// Bits of idxNum, the arguments are passed to xFilter in this order.
+#define ASOF_IDX_LEFT 0x01
+#define ASOF_IDX_RIGHT 0x02
+#define ASOF_IDX_TOLERANCE 0x04
+#define ASOF_IDX_DIRECTION 0x08
+#define ASOF_IDX_TS_LOWER 0x10
+#define ASOF_IDX_TS_UPPER 0x20
+#define ASOF_IDX_TS_LOWER_EXCL 0x40
+#define ASOF_IDX_TS_UPPER_EXCL 0x80
+#define ASOF_IDX_ARGS 6
+
+static void asof_row_clear(asof_row *row) {
+  if (row->v) {
+    sqlite3_value_free(row->v);
+  }
+  memset(row, 0, sizeof(*row));
+}
+
+static int asof_row_copy(asof_row *dst, const asof_row *src) {
+  asof_row_clear(dst);
+  *dst = *src;
+  if (src->v) {
+    dst->v = sqlite3_value_dup(src->v);
+    if (!dst->v) {
+      return SQLITE_NOMEM;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int asof_row_load(asof_row *row, sqlite3_stmt *stmt) {
+  asof_row_clear(row);
+  row->present = 1;
+  row->ts = sqlite3_column_int64(stmt, 0);
+  row->type = sqlite3_column_type(stmt, 1);
+  switch (row->type) {
+    case SQLITE_INTEGER:
+      row->i = sqlite3_column_int64(stmt, 1);
+      break;
+    case SQLITE_FLOAT:
+      row->f = sqlite3_column_double(stmt, 1);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      row->v = sqlite3_value_dup(sqlite3_column_value(stmt, 1));
+      if (!row->v) {
+        return SQLITE_NOMEM;
+      }
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static void asof_row_result(sqlite3_context *context, const asof_row *row) {
+  switch (row->type) {
+    case SQLITE_INTEGER:
+      sqlite3_result_int64(context, row->i);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_result_double(context, row->f);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      sqlite3_result_value(context, row->v);
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+}
+
+static int asof_join_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                  const char *const *argv,
+                                  sqlite3_vtab **ppVtab, char **pzErr) {
+  UNUSED(pAux);
+  UNUSED(argc);
+  UNUSED(argv);
+  UNUSED(pzErr);
+
+  asof_join_vtab *vtab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(
+      db,
+      "CREATE TABLE x(ts, value, right_ts, right_value, \"left\" HIDDEN, "
+      "\"right\" HIDDEN, tolerance HIDDEN, direction HIDDEN)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+
+  return SQLITE_OK;
+}
+
+static int asof_join_vtab_disconnect(sqlite3_vtab *pVtab) {
+  asof_join_vtab *p = (asof_join_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int asof_join_vtab_open(sqlite3_vtab *p,
+                               sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  asof_join_vtab_cursor *cursor;
+  cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static void asof_join_vtab_reset(asof_join_vtab_cursor *cursor) {
+  sqlite3_finalize(cursor->left);
+  sqlite3_finalize(cursor->right);
+  cursor->left = NULL;
+  cursor->right = NULL;
+  asof_row_clear(&cursor->prev);
+  asof_row_clear(&cursor->match);
+}
+
+static int asof_join_vtab_close(sqlite3_vtab_cursor *cur) {
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+  asof_join_vtab_reset(cursor);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int asof_join_step(sqlite3_stmt *stmt, int *eof) {
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *eof = 0;
+    return SQLITE_OK;
+  }
+  *eof = 1;
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Pair the current left row with its right row. Both inputs are sorted by ts,
+// so the right side only ever moves forward: after the loop prev is the last
+// right row at or before ts and the right statement sits on the first row
+// after it.
+static int asof_join_match(asof_join_vtab_cursor *cursor) {
+  sqlite3_int64 ts = sqlite3_column_int64(cursor->left, 0);
+  int rc;
+
+  while (!cursor->right_eof && sqlite3_column_int64(cursor->right, 0) <= ts) {
+    rc = asof_row_load(&cursor->prev, cursor->right);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    rc = asof_join_step(cursor->right, &cursor->right_eof);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  asof_row next = {0};
+  int use_next = 0;
+  if (!cursor->right_eof) {
+    next.present = 1;
+    next.ts = sqlite3_column_int64(cursor->right, 0);
+  }
+
+  switch (cursor->direction) {
+    case ASOF_FORWARD:
+      use_next = !(cursor->prev.present && cursor->prev.ts == ts);
+      break;
+    case ASOF_NEAREST:
+      if (!cursor->prev.present) {
+        use_next = 1;
+      } else if (next.present) {
+        use_next = next.ts - ts < ts - cursor->prev.ts;
+      }
+      break;
+  }
+
+  if (use_next) {
+    if (next.present) {
+      rc = asof_row_load(&cursor->match, cursor->right);
+    } else {
+      asof_row_clear(&cursor->match);
+      rc = SQLITE_OK;
+    }
+  } else {
+    rc = asof_row_copy(&cursor->match, &cursor->prev);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (cursor->match.present && cursor->has_tolerance) {
+    sqlite3_int64 gap = cursor->match.ts - ts;
+    if (gap < 0) {
+      gap = -gap;
+    }
+    if (gap > cursor->tolerance) {
+      asof_row_clear(&cursor->match);
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int asof_join_vtab_next(sqlite3_vtab_cursor *cur) {
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+  int rc = asof_join_step(cursor->left, &cursor->left_eof);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  cursor->row_id++;
+  if (cursor->left_eof) {
+    return SQLITE_OK;
+  }
+  return asof_join_match(cursor);
+}
+
+static int asof_join_vtab_column(sqlite3_vtab_cursor *cur,
+                                 sqlite3_context *context, int i) {
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+
+  switch (i) {
+    case ASOF_JOIN_VTAB_TS:
+      sqlite3_result_value(context, sqlite3_column_value(cursor->left, 0));
+      break;
+
+    case ASOF_JOIN_VTAB_VALUE:
+      sqlite3_result_value(context, sqlite3_column_value(cursor->left, 1));
+      break;
+
+    case ASOF_JOIN_VTAB_RIGHT_TS:
+      if (cursor->match.present) {
+        sqlite3_result_int64(context, cursor->match.ts);
+      }
+      break;
+
+    case ASOF_JOIN_VTAB_RIGHT_VALUE:
+      if (cursor->match.present) {
+        asof_row_result(context, &cursor->match);
+      }
+      break;
+
+    case ASOF_JOIN_VTAB_LEFT_TABLE:
+    case ASOF_JOIN_VTAB_RIGHT_TABLE:
+    case ASOF_JOIN_VTAB_TOLERANCE:
+    case ASOF_JOIN_VTAB_DIRECTION:
+      break;
+
+    default:
+      return SQLITE_ERROR;
+  }
+
+  return SQLITE_OK;
+}
+
+static int asof_join_vtab_rowid(sqlite3_vtab_cursor *cur,
+                                sqlite_int64 *pRowid) {
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+  *pRowid = cursor->row_id;
+  return SQLITE_OK;
+}
+
+static int asof_join_vtab_eof(sqlite3_vtab_cursor *cur) {
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+  return cursor->left_eof;
+}
+
+static int asof_join_parse_direction(const unsigned char *z) {
+  if (!z || !sqlite3_stricmp((const char *)z, "backward")) {
+    return ASOF_BACKWARD;
+  }
+  if (!sqlite3_stricmp((const char *)z, "forward")) {
+    return ASOF_FORWARD;
+  }
+  if (!sqlite3_stricmp((const char *)z, "nearest")) {
+    return ASOF_NEAREST;
+  }
+  return -1;
+}
+
+static int asof_join_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                                 const char *idxStr, int argc,
+                                 sqlite3_value **argv) {
+  UNUSED(idxStr);
+  UNUSED(argc);
+
+  asof_join_vtab_cursor *cursor = (asof_join_vtab_cursor *)cur;
+  asof_join_vtab *vtab = (asof_join_vtab *)cursor->base.pVtab;
+
+  asof_join_vtab_reset(cursor);
+  cursor->row_id = 0;
+  cursor->left_eof = 1;
+  cursor->right_eof = 1;
+  cursor->direction = ASOF_BACKWARD;
+  cursor->has_tolerance = 0;
+
+  const char *left = NULL;
+  const char *right = NULL;
+  sqlite3_value *lower = NULL;
+  sqlite3_value *upper = NULL;
+  int i = 0;
+  if (idxNum & ASOF_IDX_LEFT) {
+    left = (const char *)sqlite3_value_text(argv[i++]);
+  }
+  if (idxNum & ASOF_IDX_RIGHT) {
+    right = (const char *)sqlite3_value_text(argv[i++]);
+  }
+  if (idxNum & ASOF_IDX_TOLERANCE) {
+    if (sqlite3_value_type(argv[i]) != SQLITE_NULL) {
+      cursor->has_tolerance = 1;
+      cursor->tolerance = sqlite3_value_int64(argv[i]);
+    }
+    i++;
+  }
+  if (idxNum & ASOF_IDX_DIRECTION) {
+    cursor->direction =
+        asof_join_parse_direction(sqlite3_value_text(argv[i++]));
+    if (cursor->direction < 0) {
+      vtab->base.zErrMsg = sqlite3_mprintf(
+          "asof_join direction must be backward, forward or nearest");
+      return SQLITE_ERROR;
+    }
+  }
+  if (idxNum & ASOF_IDX_TS_LOWER) {
+    lower = argv[i++];
+  }
+  if (idxNum & ASOF_IDX_TS_UPPER) {
+    upper = argv[i++];
+  }
+  if (!left || !right) {
+    vtab->base.zErrMsg =
+        sqlite3_mprintf("asof_join requires a left and a right table");
+    return SQLITE_ERROR;
+  }
+  if (cursor->has_tolerance && cursor->tolerance < 0) {
+    vtab->base.zErrMsg = sqlite3_mprintf("invalid asof_join tolerance");
+    return SQLITE_ERROR;
+  }
+
+  // The left side gets the ts range as is. The right side is widened by one
+  // row (or by the tolerance) on the side(s) the direction looks at, so the
+  // first and last left rows still find their match.
+  int look_back = cursor->direction != ASOF_FORWARD;
+  int look_ahead = cursor->direction != ASOF_BACKWARD;
+  char *left_sql = sqlite3_mprintf(
+      "SELECT ts, value FROM \"%w\" WHERE 1%s%s ORDER BY ts", left,
+      !lower                                   ? ""
+      : (idxNum & ASOF_IDX_TS_LOWER_EXCL) ? " AND ts > ?1"
+                                               : " AND ts >= ?1",
+      !upper                                   ? ""
+      : (idxNum & ASOF_IDX_TS_UPPER_EXCL) ? " AND ts < ?2"
+                                               : " AND ts <= ?2");
+  char *right_lower;
+  if (!lower) {
+    right_lower = sqlite3_mprintf("");
+  } else if (!look_back) {
+    right_lower = sqlite3_mprintf(" AND ts >= ?1");
+  } else if (cursor->has_tolerance) {
+    right_lower = sqlite3_mprintf(" AND ts >= ?1 - ?3");
+  } else {
+    right_lower = sqlite3_mprintf(
+        " AND ts >= coalesce((SELECT max(ts) FROM \"%w\" WHERE ts <= ?1), ?1)",
+        right);
+  }
+  char *right_upper;
+  if (!upper) {
+    right_upper = sqlite3_mprintf("");
+  } else if (!look_ahead) {
+    right_upper = sqlite3_mprintf(" AND ts <= ?2");
+  } else if (cursor->has_tolerance) {
+    right_upper = sqlite3_mprintf(" AND ts <= ?2 + ?3");
+  } else {
+    right_upper = sqlite3_mprintf(
+        " AND ts <= coalesce((SELECT min(ts) FROM \"%w\" WHERE ts >= ?2), ?2)",
+        right);
+  }
+  char *right_sql = NULL;
+  if (right_lower && right_upper) {
+    right_sql =
+        sqlite3_mprintf("SELECT ts, value FROM \"%w\" WHERE 1%s%s ORDER BY ts",
+                        right, right_lower, right_upper);
+  }
+  sqlite3_free(right_lower);
+  sqlite3_free(right_upper);
+
+  int rc = SQLITE_NOMEM;
+  if (!left_sql || !right_sql) {
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(vtab->db, left_sql, -1, &cursor->left, NULL);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = sqlite3_prepare_v2(vtab->db, right_sql, -1, &cursor->right, NULL);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  for (int j = 0; j < 2; j++) {
+    sqlite3_stmt *stmt = j ? cursor->right : cursor->left;
+    if (lower) {
+      sqlite3_bind_value(stmt, 1, lower);
+    }
+    if (upper) {
+      sqlite3_bind_value(stmt, 2, upper);
+    }
+    if (cursor->has_tolerance && sqlite3_bind_parameter_count(stmt) >= 3) {
+      sqlite3_bind_int64(stmt, 3, cursor->tolerance);
+    }
+  }
+
+  rc = asof_join_step(cursor->right, &cursor->right_eof);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  rc = asof_join_step(cursor->left, &cursor->left_eof);
+  if (rc != SQLITE_OK || cursor->left_eof) {
+    goto done;
+  }
+  rc = asof_join_match(cursor);
+
+done:
+  if (rc != SQLITE_OK && rc != SQLITE_NOMEM) {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+  }
+  sqlite3_free(left_sql);
+  sqlite3_free(right_sql);
+  return rc;
+}
+
+static int asof_join_vtab_best_index(sqlite3_vtab *vtab,
+                                     sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  // Constraint index per argument slot, in xFilter argument order.
+  int slots[ASOF_IDX_ARGS] = {-1, -1, -1, -1, -1, -1};
+  int idxNum = 0;
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    int slot = -1;
+    switch (constraint->iColumn) {
+      case ASOF_JOIN_VTAB_LEFT_TABLE:
+      case ASOF_JOIN_VTAB_RIGHT_TABLE:
+      case ASOF_JOIN_VTAB_TOLERANCE:
+      case ASOF_JOIN_VTAB_DIRECTION:
+        if (!constraint->usable) {
+          // Unusable constraint on an argument, reject the entire plan.
+          return SQLITE_CONSTRAINT;
+        }
+        if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+          slot = constraint->iColumn - ASOF_JOIN_VTAB_LEFT_TABLE;
+        }
+        break;
+
+      case ASOF_JOIN_VTAB_TS:
+        if (!constraint->usable) {
+          break;
+        }
+        switch (constraint->op) {
+          case SQLITE_INDEX_CONSTRAINT_GT:
+          case SQLITE_INDEX_CONSTRAINT_GE:
+            if (slots[4] < 0) {
+              slot = 4;
+              if (constraint->op == SQLITE_INDEX_CONSTRAINT_GT) {
+                idxNum |= ASOF_IDX_TS_LOWER_EXCL;
+              }
+            }
+            break;
+          case SQLITE_INDEX_CONSTRAINT_LT:
+          case SQLITE_INDEX_CONSTRAINT_LE:
+            if (slots[5] < 0) {
+              slot = 5;
+              if (constraint->op == SQLITE_INDEX_CONSTRAINT_LT) {
+                idxNum |= ASOF_IDX_TS_UPPER_EXCL;
+              }
+            }
+            break;
+        }
+        break;
+    }
+    if (slot >= 0) {
+      slots[slot] = i;
+      idxNum |= 1 << slot;
+    }
+  }
+
+  int argvIndex = 1;
+  for (int slot = 0; slot < ASOF_IDX_ARGS; slot++) {
+    if (slots[slot] >= 0) {
+      pIdxInfo->aConstraintUsage[slots[slot]].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[slots[slot]].omit = 1;
+    }
+  }
+  pIdxInfo->idxNum = idxNum;
+
+  pIdxInfo->estimatedCost = 1000000.0;
+  if (idxNum & (ASOF_IDX_TS_LOWER | ASOF_IDX_TS_UPPER)) {
+    pIdxInfo->estimatedCost = 1000.0;
+  }
+  if (pIdxInfo->nOrderBy == 1 &&
+      pIdxInfo->aOrderBy[0].iColumn == ASOF_JOIN_VTAB_TS &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+sqlite3_module asof_join_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ asof_join_vtab_connect,
+    /* xBestIndex  */ asof_join_vtab_best_index,
+    /* xDisconnect */ asof_join_vtab_disconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ asof_join_vtab_open,
+    /* xClose      */ asof_join_vtab_close,
+    /* xFilter     */ asof_join_vtab_filter,
+    /* xNext       */ asof_join_vtab_next,
+    /* xEof        */ asof_join_vtab_eof,
+    /* xColumn     */ asof_join_vtab_column,
+    /* xRowid      */ asof_join_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
@@ -0,0 +1,40 @@
+#ifndef TSLITE_ASOF_H
+#define TSLITE_ASOF_H
+
+#include "tslite.h"
+
+#define ASOF_BACKWARD 0
+#define ASOF_FORWARD 1
+#define ASOF_NEAREST 2
+
+// A copy of a right-hand row that outlives the statement step it came from.
+// Numeric values are kept inline, only TEXT and BLOB values are duplicated.
+typedef struct {
+  int present;
+  sqlite3_int64 ts;
+  int type;
+  sqlite3_int64 i;
+  double f;
+  sqlite3_value *v;
+} asof_row;
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+} asof_join_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 row_id;
+  sqlite3_stmt *left;
+  sqlite3_stmt *right;
+  int left_eof;
+  int right_eof;
+  int direction;
+  int has_tolerance;
+  sqlite3_int64 tolerance;
+  asof_row prev;
+  asof_row match;
+} asof_join_vtab_cursor;
+
+#endif  // TSLITE_ASOF_H
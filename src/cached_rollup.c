@@ -0,0 +1,708 @@
+#include "cached_rollup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rollup.h"
+
+#define CACHED_ROLLUP_VTAB_BUCKET 0
+#define CACHED_ROLLUP_VTAB_VALUE 1
+#define CACHED_ROLLUP_VTAB_SOURCE 2
+#define CACHED_ROLLUP_VTAB_WIDTH 3
+#define CACHED_ROLLUP_VTAB_AGGREGATE 4
+#define CACHED_ROLLUP_VTAB_FROM 5
+#define CACHED_ROLLUP_VTAB_TO 6
+#define CACHED_ROLLUP_ARGS 5
+
+// Beyond this many changed rows between two reads a cache is dropped as a
+// whole instead of bucket by bucket.
+#define CACHED_ROLLUP_MAX_PENDING (1 << 20)
+
+// Buckets kept per cache. Ranges with more buckets bypass the cache.
+#define CACHED_ROLLUP_MAX_BUCKETS (1 << 20)
+
+static sqlite3_int64 cached_rollup_floor(sqlite3_int64 ts,
+                                         sqlite3_int64 width) {
+  sqlite3_int64 q = ts / width;
+  if (ts % width < 0) {
+    q--;
+  }
+  return q * width;
+}
+
+static unsigned int cached_bucket_hash(sqlite3_int64 start) {
+  sqlite3_uint64 h = (sqlite3_uint64)start * 0x9e3779b97f4a7c15ull;
+  return (unsigned int)(h >> 32);
+}
+
+static cached_bucket *cached_rollup_find(const cached_rollup *cache,
+                                         sqlite3_int64 start) {
+  if (!cache->n_slots) {
+    return NULL;
+  }
+  unsigned int slot = cached_bucket_hash(start) & (cache->n_slots - 1);
+  for (cached_bucket *b = cache->slots[slot]; b; b = b->next) {
+    if (b->start == start) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static void cached_bucket_free(cached_bucket *b) {
+  sqlite3_value_free(b->value);
+  sqlite3_free(b);
+}
+
+static void cached_rollup_remove(cached_rollup *cache, sqlite3_int64 start) {
+  if (!cache->n_slots) {
+    return;
+  }
+  cached_bucket **p =
+      &cache->slots[cached_bucket_hash(start) & (cache->n_slots - 1)];
+  while (*p && (*p)->start != start) {
+    p = &(*p)->next;
+  }
+  if (*p) {
+    cached_bucket *b = *p;
+    *p = b->next;
+    cached_bucket_free(b);
+    cache->count--;
+  }
+}
+
+static void cached_rollup_clear(cached_rollup *cache) {
+  for (int k = 0; k < cache->n_slots; k++) {
+    cached_bucket *next;
+    for (cached_bucket *b = cache->slots[k]; b; b = next) {
+      next = b->next;
+      cached_bucket_free(b);
+    }
+  }
+  sqlite3_free(cache->slots);
+  cache->slots = NULL;
+  cache->n_slots = cache->count = 0;
+  cache->max_rowid = 0;
+  cache->n_pending = 0;
+  cache->overflow = 0;
+}
+
+// Add a bucket that isn't cached yet, value is NULL for an empty bucket.
+static int cached_rollup_store(cached_rollup *cache, sqlite3_int64 start,
+                               sqlite3_value *value, sqlite3_int64 min_rowid,
+                               sqlite3_int64 max_rowid) {
+  if (cache->count >= cache->n_slots / 2) {
+    int n_slots = cache->n_slots ? cache->n_slots * 2 : 64;
+    cached_bucket **slots = sqlite3_malloc64(n_slots * sizeof(cached_bucket *));
+    if (!slots) {
+      return SQLITE_NOMEM;
+    }
+    memset(slots, 0, n_slots * sizeof(cached_bucket *));
+    for (int k = 0; k < cache->n_slots; k++) {
+      cached_bucket *next;
+      for (cached_bucket *b = cache->slots[k]; b; b = next) {
+        next = b->next;
+        unsigned int slot = cached_bucket_hash(b->start) & (n_slots - 1);
+        b->next = slots[slot];
+        slots[slot] = b;
+      }
+    }
+    sqlite3_free(cache->slots);
+    cache->slots = slots;
+    cache->n_slots = n_slots;
+  }
+
+  cached_bucket *b = sqlite3_malloc(sizeof(cached_bucket));
+  if (!b) {
+    return SQLITE_NOMEM;
+  }
+  b->start = start;
+  b->value = NULL;
+  b->min_rowid = min_rowid;
+  b->max_rowid = max_rowid;
+  if (value) {
+    b->value = sqlite3_value_dup(value);
+    if (!b->value) {
+      sqlite3_free(b);
+      return SQLITE_NOMEM;
+    }
+  }
+  unsigned int slot = cached_bucket_hash(start) & (cache->n_slots - 1);
+  b->next = cache->slots[slot];
+  cache->slots[slot] = b;
+  cache->count++;
+  if (max_rowid > cache->max_rowid) {
+    cache->max_rowid = max_rowid;
+  }
+  return SQLITE_OK;
+}
+
+static void cached_rollup_free(cached_rollup *cache) {
+  cached_rollup_clear(cache);
+  sqlite3_finalize(cache->ts_stmt);
+  sqlite3_finalize(cache->agg_stmt);
+  sqlite3_free(cache->pending);
+  sqlite3_free(cache->table);
+  sqlite3_free(cache->aggregate);
+  sqlite3_free(cache);
+}
+
+static int cached_rollup_compare_rowid(const void *a, const void *b) {
+  sqlite3_int64 x = *(const sqlite3_int64 *)a;
+  sqlite3_int64 y = *(const sqlite3_int64 *)b;
+  return (x > y) - (x < y);
+}
+
+// Whether one of the sorted pending rowids lies within the rowids of b.
+static int cached_rollup_touched(const cached_rollup *cache,
+                                 const cached_bucket *b) {
+  int lo = 0;
+  int hi = cache->n_pending;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cache->pending[mid] < b->min_rowid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < cache->n_pending && cache->pending[lo] <= b->max_rowid;
+}
+
+// Drop the buckets the pending rowids were in before they changed, found by
+// rowid range, and the buckets they are in now, found by their timestamp.
+// While writing the rowids stay pending: once the transaction ends they may
+// be back in their committed buckets.
+static int cached_rollup_resolve(cached_rollup *cache, int writing) {
+  if (cache->overflow) {
+    cached_rollup_clear(cache);
+    return SQLITE_OK;
+  }
+  if (!cache->count) {
+    cache->n_pending = 0;
+    return SQLITE_OK;
+  }
+  if (!cache->n_pending) {
+    return SQLITE_OK;
+  }
+
+  qsort(cache->pending, cache->n_pending, sizeof(sqlite3_int64),
+        cached_rollup_compare_rowid);
+  int n = 1;
+  for (int k = 1; k < cache->n_pending; k++) {
+    if (cache->pending[k] != cache->pending[n - 1]) {
+      cache->pending[n++] = cache->pending[k];
+    }
+  }
+  cache->n_pending = n;
+  if (cache->pending[0] <= cache->max_rowid) {
+    for (int k = 0; k < cache->n_slots; k++) {
+      cached_bucket **p = &cache->slots[k];
+      while (*p) {
+        cached_bucket *b = *p;
+        if (cached_rollup_touched(cache, b)) {
+          *p = b->next;
+          cached_bucket_free(b);
+          cache->count--;
+        } else {
+          p = &b->next;
+        }
+      }
+    }
+  }
+
+  sqlite3_stmt *stmt = cache->ts_stmt;
+  int rc = SQLITE_OK;
+  for (int k = 0; k < cache->n_pending && cache->count; k++) {
+    sqlite3_bind_int64(stmt, 1, cache->pending[k]);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        cached_rollup_remove(
+            cache,
+            cached_rollup_floor(sqlite3_column_int64(stmt, 0), cache->width));
+      }
+      rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+      cached_rollup_clear(cache);
+      return rc;
+    }
+  }
+  if (!writing) {
+    cache->n_pending = 0;
+  }
+  return SQLITE_OK;
+}
+
+static void cached_rollup_vtab_update_hook(void *arg, int op, const char *db,
+                                           const char *table,
+                                           sqlite3_int64 rowid) {
+  UNUSED(op);
+
+  cached_rollup_vtab *vtab = (cached_rollup_vtab *)arg;
+  if (sqlite3_stricmp(db, "main") != 0) {
+    return;
+  }
+  for (cached_rollup *cache = vtab->caches; cache; cache = cache->next) {
+    if (cache->overflow || sqlite3_stricmp(table, cache->table) != 0) {
+      continue;
+    }
+    if (cache->n_pending == cache->cap_pending) {
+      int cap = cache->cap_pending ? cache->cap_pending * 2 : 64;
+      sqlite3_int64 *pending = NULL;
+      if (cap <= CACHED_ROLLUP_MAX_PENDING) {
+        pending = sqlite3_realloc(cache->pending, cap * sizeof(sqlite3_int64));
+      }
+      if (!pending) {
+        // Too many changes to track (or out of memory), drop the cache on
+        // the next read.
+        cache->overflow = 1;
+        cache->n_pending = 0;
+        continue;
+      }
+      cache->pending = pending;
+      cache->cap_pending = cap;
+    }
+    cache->pending[cache->n_pending++] = rowid;
+  }
+}
+
+// Catch up with the changes since the last read. Changes by other
+// connections, and those that bypass the update hook, drop all caches.
+static int cached_rollup_vtab_sync(cached_rollup_vtab *vtab) {
+  int rc = sqlite3_step(vtab->version_stmt);
+  sqlite3_int64 version = sqlite3_column_int64(vtab->version_stmt, 0);
+  sqlite3_reset(vtab->version_stmt);
+  if (rc != SQLITE_ROW) {
+    return rc;
+  }
+
+  int stale = version != vtab->data_version ||
+              tslite_hooks_missed(vtab->hooks, &vtab->mark);
+  int writing = sqlite3_txn_state(vtab->db, "main") == SQLITE_TXN_WRITE;
+  rc = SQLITE_OK;
+  for (cached_rollup *cache = vtab->caches; cache && rc == SQLITE_OK;
+       cache = cache->next) {
+    if (stale) {
+      cached_rollup_clear(cache);
+    } else {
+      rc = cached_rollup_resolve(cache, writing);
+    }
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  vtab->data_version = version;
+  tslite_hooks_mark_set(vtab->hooks, &vtab->mark);
+  return SQLITE_OK;
+}
+
+// Find the cache of (table, width, aggregate), or create it.
+static int cached_rollup_vtab_cache(cached_rollup_vtab *vtab,
+                                    const char *table, sqlite3_int64 width,
+                                    const char *aggregate,
+                                    cached_rollup **pCache) {
+  for (cached_rollup *cache = vtab->caches; cache; cache = cache->next) {
+    if (cache->width == width && strcmp(cache->table, table) == 0 &&
+        sqlite3_stricmp(cache->aggregate, aggregate) == 0) {
+      *pCache = cache;
+      return SQLITE_OK;
+    }
+  }
+
+  cached_rollup *cache = sqlite3_malloc(sizeof(cached_rollup));
+  if (!cache) {
+    return SQLITE_NOMEM;
+  }
+  memset(cache, 0, sizeof(*cache));
+  cache->width = width;
+  cache->table = sqlite3_mprintf("%s", table);
+  cache->aggregate = sqlite3_mprintf("%s", aggregate);
+  char *ts_sql = sqlite3_mprintf(
+      "SELECT ts FROM \"main\".\"%w\" WHERE rowid = ?1", table);
+  char *agg_sql = sqlite3_mprintf(
+      "SELECT time_bucket(?1, ts) AS bucket, %s(value), min(rowid), "
+      "max(rowid) FROM \"main\".\"%w\" WHERE ts >= ?2 AND ts < ?3 "
+      "GROUP BY bucket ORDER BY bucket",
+      aggregate, table);
+
+  int rc = SQLITE_OK;
+  if (!cache->table || !cache->aggregate || !ts_sql || !agg_sql) {
+    rc = SQLITE_NOMEM;
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v3(vtab->db, ts_sql, -1, SQLITE_PREPARE_PERSISTENT,
+                            &cache->ts_stmt, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v3(vtab->db, agg_sql, -1, SQLITE_PREPARE_PERSISTENT,
+                            &cache->agg_stmt, NULL);
+  }
+  sqlite3_free(ts_sql);
+  sqlite3_free(agg_sql);
+  if (rc != SQLITE_OK) {
+    if (rc != SQLITE_NOMEM) {
+      vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    }
+    cached_rollup_free(cache);
+    return rc;
+  }
+
+  cache->next = vtab->caches;
+  vtab->caches = cache;
+  *pCache = cache;
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_push(cached_rollup_vtab_cursor *cursor,
+                                   sqlite3_int64 bucket,
+                                   sqlite3_value *value) {
+  if (cursor->n == cursor->cap) {
+    int cap = cursor->cap ? cursor->cap * 2 : 64;
+    cached_rollup_row *rows =
+        sqlite3_realloc64(cursor->rows, cap * sizeof(cached_rollup_row));
+    if (!rows) {
+      return SQLITE_NOMEM;
+    }
+    cursor->rows = rows;
+    cursor->cap = cap;
+  }
+  sqlite3_value *dup = sqlite3_value_dup(value);
+  if (!dup) {
+    return SQLITE_NOMEM;
+  }
+  cursor->rows[cursor->n].bucket = bucket;
+  cursor->rows[cursor->n].value = dup;
+  cursor->n++;
+  return SQLITE_OK;
+}
+
+// Aggregate the buckets in [from, to) into the cursor. The buckets before
+// closed are final and stored in the cache, empty ones included.
+static int cached_rollup_compute(cached_rollup_vtab_cursor *cursor,
+                                 cached_rollup *cache, sqlite3_int64 from,
+                                 sqlite3_int64 to, sqlite3_int64 closed) {
+  sqlite3_stmt *stmt = cache->agg_stmt;
+  sqlite3_bind_int64(stmt, 1, cache->width);
+  sqlite3_bind_int64(stmt, 2, from);
+  sqlite3_bind_int64(stmt, 3, to);
+
+  sqlite3_int64 next = from;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    sqlite3_int64 bucket = sqlite3_column_int64(stmt, 0);
+    sqlite3_value *value = sqlite3_column_value(stmt, 1);
+    rc = cached_rollup_vtab_push(cursor, bucket, value);
+    for (; rc == SQLITE_OK && next < bucket && next < closed;
+         next += cache->width) {
+      rc = cached_rollup_store(cache, next, NULL, 1, 0);
+    }
+    if (rc == SQLITE_OK && bucket < closed) {
+      rc = cached_rollup_store(cache, bucket, value,
+                               sqlite3_column_int64(stmt, 2),
+                               sqlite3_column_int64(stmt, 3));
+    }
+    if (rc != SQLITE_OK) {
+      break;
+    }
+    next = bucket + cache->width;
+  }
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+    for (; rc == SQLITE_OK && next < to && next < closed;
+         next += cache->width) {
+      rc = cached_rollup_store(cache, next, NULL, 1, 0);
+    }
+  }
+  sqlite3_reset(stmt);
+  return rc;
+}
+
+static int cached_rollup_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                      const char *const *argv,
+                                      sqlite3_vtab **ppVtab, char **pzErr) {
+  UNUSED(argc);
+  UNUSED(argv);
+  UNUSED(pzErr);
+
+  cached_rollup_vtab *vtab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(
+      db,
+      "CREATE TABLE x(bucket, value, source HIDDEN, bucket_width HIDDEN, "
+      "aggregate HIDDEN, \"from\" HIDDEN, \"to\" HIDDEN)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+
+  rc = sqlite3_prepare_v3(db, "PRAGMA main.data_version", -1,
+                          SQLITE_PREPARE_PERSISTENT, &vtab->version_stmt,
+                          NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(vtab);
+    *ppVtab = NULL;
+    return rc;
+  }
+
+  vtab->hooks = (tslite_hooks *)pAux;
+  vtab->listener.arg = vtab;
+  vtab->listener.xUpdate = cached_rollup_vtab_update_hook;
+  tslite_hooks_add(vtab->hooks, &vtab->listener);
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_disconnect(sqlite3_vtab *pVtab) {
+  cached_rollup_vtab *vtab = (cached_rollup_vtab *)pVtab;
+  tslite_hooks_remove(vtab->hooks, &vtab->listener);
+  while (vtab->caches) {
+    cached_rollup *cache = vtab->caches;
+    vtab->caches = cache->next;
+    cached_rollup_free(cache);
+  }
+  sqlite3_finalize(vtab->version_stmt);
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_open(sqlite3_vtab *p,
+                                   sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  cached_rollup_vtab_cursor *cursor;
+  cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static void cached_rollup_vtab_reset(cached_rollup_vtab_cursor *cursor) {
+  for (int k = 0; k < cursor->n; k++) {
+    sqlite3_value_free(cursor->rows[k].value);
+  }
+  cursor->n = cursor->i = 0;
+}
+
+static int cached_rollup_vtab_close(sqlite3_vtab_cursor *cur) {
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  cached_rollup_vtab_reset(cursor);
+  sqlite3_free(cursor->rows);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_next(sqlite3_vtab_cursor *cur) {
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  cursor->i++;
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_eof(sqlite3_vtab_cursor *cur) {
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  return cursor->i >= cursor->n;
+}
+
+static int cached_rollup_vtab_column(sqlite3_vtab_cursor *cur,
+                                     sqlite3_context *context, int i) {
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  cached_rollup_row *row = &cursor->rows[cursor->i];
+  switch (i) {
+    case CACHED_ROLLUP_VTAB_BUCKET:
+      sqlite3_result_int64(context, row->bucket);
+      break;
+    case CACHED_ROLLUP_VTAB_VALUE:
+      sqlite3_result_value(context, row->value);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int cached_rollup_vtab_rowid(sqlite3_vtab_cursor *cur,
+                                    sqlite_int64 *pRowid) {
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  *pRowid = cursor->rows[cursor->i].bucket;
+  return SQLITE_OK;
+}
+
+// Returns the buckets starting in [from, to), every one aggregated over its
+// whole width. Cached buckets are copied, runs of missing buckets are
+// aggregated with one query each.
+static int cached_rollup_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                                     const char *idxStr, int argc,
+                                     sqlite3_value **argv) {
+  UNUSED(idxStr);
+  UNUSED(argc);
+
+  cached_rollup_vtab_cursor *cursor = (cached_rollup_vtab_cursor *)cur;
+  cached_rollup_vtab *vtab = (cached_rollup_vtab *)cursor->base.pVtab;
+  cached_rollup_vtab_reset(cursor);
+
+  if (!idxNum) {
+    vtab->base.zErrMsg = sqlite3_mprintf(
+        "tslite_cached_rollup requires a table, bucket width, aggregate, "
+        "from and to");
+    return SQLITE_ERROR;
+  }
+  const char *table = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_int64 width = sqlite3_value_int64(argv[1]);
+  const unsigned char *aggregate = sqlite3_value_text(argv[2]);
+  sqlite3_int64 from = sqlite3_value_int64(argv[3]);
+  sqlite3_int64 to = sqlite3_value_int64(argv[4]);
+  if (!table) {
+    vtab->base.zErrMsg = sqlite3_mprintf("invalid table name");
+    return SQLITE_ERROR;
+  }
+  if (width < 1) {
+    vtab->base.zErrMsg = sqlite3_mprintf("invalid bucket width");
+    return SQLITE_ERROR;
+  }
+  if (!rollup_valid_identifier(aggregate)) {
+    vtab->base.zErrMsg = sqlite3_mprintf("invalid aggregate function");
+    return SQLITE_ERROR;
+  }
+
+  int rc = cached_rollup_vtab_sync(vtab);
+  if (rc != SQLITE_OK) {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return rc;
+  }
+  cached_rollup *cache;
+  rc = cached_rollup_vtab_cache(vtab, table, width, (const char *)aggregate,
+                                &cache);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  sqlite3_int64 first = cached_rollup_floor(from, width);
+  if (first < from) {
+    first += width;
+  }
+  sqlite3_int64 end = cached_rollup_floor(to, width);
+  if (end < to) {
+    end += width;
+  }
+  if (first >= end) {
+    return SQLITE_OK;
+  }
+
+  // Only closed buckets are stored, and nothing while this connection has
+  // uncommitted changes: ROLLBACK TO reverts them without telling any hook.
+  sqlite3_int64 closed = cached_rollup_floor((sqlite3_int64)time(NULL), width);
+  if (sqlite3_txn_state(vtab->db, "main") == SQLITE_TXN_WRITE) {
+    closed = first;
+  }
+  sqlite3_int64 n = (end - first) / width;
+  if (n > CACHED_ROLLUP_MAX_BUCKETS) {
+    rc = cached_rollup_compute(cursor, cache, first, end, first);
+  } else {
+    if (cache->count + n > CACHED_ROLLUP_MAX_BUCKETS) {
+      cached_rollup_clear(cache);
+    }
+    sqlite3_int64 b = first;
+    while (b < end && rc == SQLITE_OK) {
+      cached_bucket *cached = cached_rollup_find(cache, b);
+      if (cached) {
+        if (cached->value) {
+          rc = cached_rollup_vtab_push(cursor, b, cached->value);
+        }
+        b += width;
+        continue;
+      }
+      sqlite3_int64 run_end = b + width;
+      while (run_end < end && !cached_rollup_find(cache, run_end)) {
+        run_end += width;
+      }
+      rc = cached_rollup_compute(cursor, cache, b, run_end, closed);
+      b = run_end;
+    }
+  }
+  if (rc != SQLITE_OK && rc != SQLITE_NOMEM) {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+  }
+  return rc;
+}
+
+static int cached_rollup_vtab_best_index(sqlite3_vtab *vtab,
+                                         sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  int slots[CACHED_ROLLUP_ARGS] = {-1, -1, -1, -1, -1};
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    if (constraint->iColumn < CACHED_ROLLUP_VTAB_SOURCE) {
+      continue;
+    }
+    if (!constraint->usable) {
+      // Unusable constraint on an argument, reject the entire plan.
+      return SQLITE_CONSTRAINT;
+    }
+    if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      slots[constraint->iColumn - CACHED_ROLLUP_VTAB_SOURCE] = i;
+    }
+  }
+
+  pIdxInfo->idxNum = 1;
+  for (int slot = 0; slot < CACHED_ROLLUP_ARGS; slot++) {
+    if (slots[slot] < 0) {
+      pIdxInfo->idxNum = 0;
+    }
+  }
+  if (pIdxInfo->idxNum) {
+    for (int slot = 0; slot < CACHED_ROLLUP_ARGS; slot++) {
+      pIdxInfo->aConstraintUsage[slots[slot]].argvIndex = slot + 1;
+      pIdxInfo->aConstraintUsage[slots[slot]].omit = 1;
+    }
+  }
+
+  pIdxInfo->estimatedCost = 1000.0;
+  if (pIdxInfo->nOrderBy == 1 &&
+      pIdxInfo->aOrderBy[0].iColumn == CACHED_ROLLUP_VTAB_BUCKET &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+sqlite3_module cached_rollup_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ cached_rollup_vtab_connect,
+    /* xBestIndex  */ cached_rollup_vtab_best_index,
+    /* xDisconnect */ cached_rollup_vtab_disconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ cached_rollup_vtab_open,
+    /* xClose      */ cached_rollup_vtab_close,
+    /* xFilter     */ cached_rollup_vtab_filter,
+    /* xNext       */ cached_rollup_vtab_next,
+    /* xEof        */ cached_rollup_vtab_eof,
+    /* xColumn     */ cached_rollup_vtab_column,
+    /* xRowid      */ cached_rollup_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
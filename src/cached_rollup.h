@@ -0,0 +1,60 @@
+#ifndef TSLITE_CACHED_ROLLUP_H
+#define TSLITE_CACHED_ROLLUP_H
+
+#include "hooks.h"
+#include "tslite.h"
+
+// The finalized aggregate of one bucket, value is NULL for an empty bucket.
+// The rows of the bucket have rowids in [min_rowid, max_rowid].
+typedef struct cached_bucket {
+  sqlite3_int64 start;
+  sqlite3_value *value;
+  sqlite3_int64 min_rowid, max_rowid;
+  struct cached_bucket *next;
+} cached_bucket;
+
+// The buckets of one (table, bucket width, aggregate), by bucket start.
+typedef struct cached_rollup {
+  char *table;
+  sqlite3_int64 width;
+  char *aggregate;
+  sqlite3_stmt *ts_stmt;
+  sqlite3_stmt *agg_stmt;
+
+  cached_bucket **slots;
+  int n_slots, count;
+  sqlite3_int64 max_rowid;
+
+  // Source rowids changed since the last read.
+  sqlite3_int64 *pending;
+  int n_pending, cap_pending;
+  int overflow;
+
+  struct cached_rollup *next;
+} cached_rollup;
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  sqlite3_stmt *version_stmt;
+  sqlite3_int64 data_version;
+
+  tslite_hooks *hooks;
+  tslite_hooks_listener listener;
+  tslite_hooks_mark mark;
+
+  cached_rollup *caches;
+} cached_rollup_vtab;
+
+typedef struct {
+  sqlite3_int64 bucket;
+  sqlite3_value *value;
+} cached_rollup_row;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  cached_rollup_row *rows;
+  int n, cap, i;
+} cached_rollup_vtab_cursor;
+
+#endif  // TSLITE_CACHED_ROLLUP_H
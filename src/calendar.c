@@ -0,0 +1,657 @@
+#include "calendar.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TZ_DEFAULT_DIR "/usr/share/zoneinfo"
+#define TZ_LOCALTIME "/etc/localtime"
+#define TZ_MAX_FILE (1 << 20)
+
+// Daylight saving time rules from the POSIX TZ footer of a zone file are
+// expanded into transitions up to and including this year.
+#define TZ_LAST_YEAR 2200
+
+// Timestamps are limited to about a million years around the epoch, which
+// keeps all calendar arithmetic far away from overflows.
+#define CALENDAR_MAX_TS ((sqlite3_int64)1 << 45)
+
+#define SECONDS_PER_DAY 86400
+
+// A time zone as a sorted list of periods with a constant UTC offset.
+// Period k starts at at[k], at[0] is INT64_MIN.
+typedef struct tz_zone {
+  char *name;
+  int n, cap;
+  sqlite3_int64 *at;
+  int *offset;
+  struct tz_zone *next;
+} tz_zone;
+
+struct tz_cache {
+  tz_zone *zones;
+};
+
+typedef struct {
+  int kind;  // 'J' (1-365, no leap day), 'D' (0-365) or 'M'.
+  int month, week, day;
+  int time;  // Seconds after local midnight, may be negative.
+} tz_rule;
+
+typedef struct {
+  int std_offset, dst_offset;
+  int has_dst;
+  tz_rule start, end;
+} tz_posix;
+
+// A bucket width is either a number of months or a number of seconds with an
+// origin (Monday for weeks).
+typedef struct {
+  sqlite3_int64 months;
+  sqlite3_int64 seconds;
+  sqlite3_int64 origin;
+} calendar_width;
+
+static sqlite3_int64 floor_div(sqlite3_int64 a, sqlite3_int64 b) {
+  sqlite3_int64 q = a / b;
+  return a % b < 0 ? q - 1 : q;
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+//
+// Source from days_from_civil in
+// http://howardhinnant.github.io/date_algorithms.html.
+static sqlite3_int64 days_from_civil(sqlite3_int64 y, int m, int d) {
+  y -= m <= 2;
+  sqlite3_int64 era = floor_div(y, 400);
+  sqlite3_int64 yoe = y - era * 400;
+  sqlite3_int64 doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  sqlite3_int64 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Year and month of a day since 1970-01-01.
+//
+// Source from civil_from_days in
+// http://howardhinnant.github.io/date_algorithms.html.
+static void civil_from_days(sqlite3_int64 z, sqlite3_int64 *y, int *m) {
+  z += 719468;
+  sqlite3_int64 era = floor_div(z, 146097);
+  sqlite3_int64 doe = z - era * 146097;
+  sqlite3_int64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  sqlite3_int64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  sqlite3_int64 mp = (5 * doy + 2) / 153;
+  *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+static int is_leap_year(sqlite3_int64 y) {
+  return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+static int tz_zone_push(tz_zone *zone, sqlite3_int64 at, int offset) {
+  if (zone->n > 0 &&
+      (at <= zone->at[zone->n - 1] || offset == zone->offset[zone->n - 1])) {
+    return SQLITE_OK;
+  }
+  if (zone->n == zone->cap) {
+    int cap = zone->cap ? zone->cap * 2 : 64;
+    sqlite3_int64 *at = sqlite3_realloc(zone->at, cap * sizeof(*at));
+    if (!at) {
+      return SQLITE_NOMEM;
+    }
+    zone->at = at;
+    int *offset = sqlite3_realloc(zone->offset, cap * sizeof(*offset));
+    if (!offset) {
+      return SQLITE_NOMEM;
+    }
+    zone->offset = offset;
+    zone->cap = cap;
+  }
+  zone->at[zone->n] = at;
+  zone->offset[zone->n] = offset;
+  zone->n++;
+  return SQLITE_OK;
+}
+
+static void tz_zone_free(tz_zone *zone) {
+  sqlite3_free(zone->name);
+  sqlite3_free(zone->at);
+  sqlite3_free(zone->offset);
+  sqlite3_free(zone);
+}
+
+static int tz_is_digit(char c) { return '0' <= c && c <= '9'; }
+
+static const char *tz_parse_number(const char *p, int max, int *v) {
+  if (!tz_is_digit(*p)) {
+    return NULL;
+  }
+  for (*v = 0; tz_is_digit(*p); p++) {
+    *v = *v * 10 + (*p - '0');
+    if (*v > max) {
+      return NULL;
+    }
+  }
+  return p;
+}
+
+static const char *tz_parse_name(const char *p) {
+  if (*p == '<') {
+    while (*p && *p != '>') {
+      p++;
+    }
+    return *p ? p + 1 : NULL;
+  }
+  const char *start = p;
+  while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')) {
+    p++;
+  }
+  return p - start >= 3 ? p : NULL;
+}
+
+// Parse [+-]hh[:mm[:ss]] into seconds.
+static const char *tz_parse_time(const char *p, int *secs) {
+  int sign = 1;
+  if (*p == '+' || *p == '-') {
+    sign = *p == '-' ? -1 : 1;
+    p++;
+  }
+  int h = 0, m = 0, s = 0;
+  p = tz_parse_number(p, 167, &h);
+  if (p && *p == ':') {
+    p = tz_parse_number(p + 1, 59, &m);
+    if (p && *p == ':') {
+      p = tz_parse_number(p + 1, 59, &s);
+    }
+  }
+  *secs = sign * (h * 3600 + m * 60 + s);
+  return p;
+}
+
+static const char *tz_parse_rule(const char *p, tz_rule *r) {
+  r->kind = *p;
+  switch (*p) {
+    case 'M':
+      p = tz_parse_number(p + 1, 12, &r->month);
+      if (!p || *p != '.' || r->month < 1) {
+        return NULL;
+      }
+      p = tz_parse_number(p + 1, 5, &r->week);
+      if (!p || *p != '.' || r->week < 1) {
+        return NULL;
+      }
+      p = tz_parse_number(p + 1, 6, &r->day);
+      break;
+
+    case 'J':
+      p = tz_parse_number(p + 1, 365, &r->day);
+      if (p && r->day < 1) {
+        return NULL;
+      }
+      break;
+
+    default:
+      r->kind = 'D';
+      p = tz_parse_number(p, 365, &r->day);
+      break;
+  }
+  if (!p) {
+    return NULL;
+  }
+
+  r->time = 2 * 3600;
+  if (*p == '/') {
+    p = tz_parse_time(p + 1, &r->time);
+  }
+  return p;
+}
+
+// Parse a POSIX TZ string like "CET-1CEST,M3.5.0,M10.5.0/3". Offsets in the
+// string count west of Greenwich, the parsed ones east.
+static int tz_parse_posix(const char *p, tz_posix *tz) {
+  int secs;
+  memset(tz, 0, sizeof(*tz));
+
+  p = tz_parse_name(p);
+  if (!p || !(p = tz_parse_time(p, &secs))) {
+    return -1;
+  }
+  tz->std_offset = -secs;
+  if (!*p) {
+    return 0;
+  }
+
+  p = tz_parse_name(p);
+  if (!p) {
+    return -1;
+  }
+  tz->has_dst = 1;
+  tz->dst_offset = tz->std_offset + 3600;
+  if (*p && *p != ',') {
+    if (!(p = tz_parse_time(p, &secs))) {
+      return -1;
+    }
+    tz->dst_offset = -secs;
+  }
+  // Without rules the switches are implementation defined, skip those.
+  if (*p != ',' || !(p = tz_parse_rule(p + 1, &tz->start)) || *p != ',' ||
+      !(p = tz_parse_rule(p + 1, &tz->end)) || *p) {
+    return -1;
+  }
+  return 0;
+}
+
+// Day since the epoch on which rule r switches in year y.
+static sqlite3_int64 tz_rule_day(const tz_rule *r, sqlite3_int64 y) {
+  sqlite3_int64 jan1 = days_from_civil(y, 1, 1);
+  switch (r->kind) {
+    case 'J':
+      return jan1 + r->day - 1 + (r->day >= 60 && is_leap_year(y));
+
+    case 'D':
+      return jan1 + r->day;
+  }
+
+  // Day d (0 is Sunday) of week w of month m, week 5 being the last one.
+  // 1970-01-01 was a Thursday.
+  sqlite3_int64 first = days_from_civil(y, r->month, 1);
+  sqlite3_int64 next = r->month == 12 ? days_from_civil(y + 1, 1, 1)
+                                      : days_from_civil(y, r->month + 1, 1);
+  int wday = (int)((first + 4) % 7 + 7) % 7;
+  sqlite3_int64 day = first + (r->day - wday + 7) % 7 + (r->week - 1) * 7;
+  while (day >= next) {
+    day -= 7;
+  }
+  return day;
+}
+
+// Extend the transitions of zone with the rules of tz up to TZ_LAST_YEAR.
+static int tz_zone_extend(tz_zone *zone, const tz_posix *tz) {
+  if (!tz->has_dst) {
+    return tz_zone_push(zone, zone->at[zone->n - 1] + 1, tz->std_offset);
+  }
+
+  sqlite3_int64 y = 1900;
+  if (zone->n > 1) {
+    int m;
+    civil_from_days(floor_div(zone->at[zone->n - 1], SECONDS_PER_DAY), &y,
+                    &m);
+  }
+  for (; y <= TZ_LAST_YEAR; y++) {
+    sqlite3_int64 start = tz_rule_day(&tz->start, y) * SECONDS_PER_DAY +
+                          tz->start.time - tz->std_offset;
+    sqlite3_int64 end = tz_rule_day(&tz->end, y) * SECONDS_PER_DAY +
+                        tz->end.time - tz->dst_offset;
+    // On the southern hemisphere daylight saving time ends first.
+    int res;
+    if (start < end) {
+      res = tz_zone_push(zone, start, tz->dst_offset);
+      if (!res) {
+        res = tz_zone_push(zone, end, tz->std_offset);
+      }
+    } else {
+      res = tz_zone_push(zone, end, tz->std_offset);
+      if (!res) {
+        res = tz_zone_push(zone, start, tz->dst_offset);
+      }
+    }
+    if (res) {
+      return res;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_int64 tz_get_be(const unsigned char *p, int size) {
+  sqlite3_uint64 v = 0;
+  for (int i = 0; i < size; i++) {
+    v = v << 8 | p[i];
+  }
+  if (size == 4) {
+    return (sqlite3_int64)(int32_t)(uint32_t)v;
+  }
+  return (sqlite3_int64)v;
+}
+
+// Parse a TZif file (RFC 8536). Version 2 and later files are read from
+// their 64-bit data block and footer.
+static int tz_zone_parse(tz_zone *zone, const unsigned char *z, int n) {
+  const unsigned char *end = z + n;
+  const unsigned char *p = z;
+  sqlite3_int64 counts[6];
+  sqlite3_int64 block = 0;
+  int size = 4;
+
+  for (int pass = 0; pass < 2; pass++) {
+    if (end - p < 44 || memcmp(p, "TZif", 4) != 0) {
+      return SQLITE_ERROR;
+    }
+    // isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt.
+    for (int i = 0; i < 6; i++) {
+      counts[i] = (sqlite3_int64)(uint32_t)tz_get_be(&p[20 + i * 4], 4);
+    }
+    block = counts[3] * (size + 1) + counts[4] * 6 + counts[5] +
+            counts[2] * (size + 4) + counts[1] + counts[0];
+    if (block > end - p - 44 || counts[4] < 1) {
+      return SQLITE_ERROR;
+    }
+    if (z[4] < '2' || pass == 1) {
+      break;
+    }
+    p += 44 + block;
+    size = 8;
+  }
+
+  const unsigned char *times = p + 44;
+  const unsigned char *types = times + counts[3] * size;
+  const unsigned char *infos = types + counts[3];
+  int res = tz_zone_push(zone, INT64_MIN, (int)tz_get_be(infos, 4));
+  for (sqlite3_int64 i = 0; i < counts[3] && !res; i++) {
+    if (types[i] >= counts[4]) {
+      return SQLITE_ERROR;
+    }
+    res = tz_zone_push(zone, tz_get_be(&times[i * size], size),
+                       (int)tz_get_be(&infos[types[i] * 6], 4));
+  }
+  if (res || size == 4) {
+    return res;
+  }
+
+  // The footer holds a POSIX TZ string for times after the last transition.
+  const unsigned char *footer = p + 44 + block;
+  if (footer < end && *footer == '\n') {
+    const unsigned char *nl = memchr(footer + 1, '\n', end - footer - 1);
+    char rule[128];
+    tz_posix tz;
+    if (nl && nl - footer - 1 < (int)sizeof(rule)) {
+      memcpy(rule, footer + 1, nl - footer - 1);
+      rule[nl - footer - 1] = 0;
+      if (tz_parse_posix(rule, &tz) == 0) {
+        res = tz_zone_extend(zone, &tz);
+      }
+    }
+  }
+  return res;
+}
+
+// Only plain relative paths below the zoneinfo directory are accepted.
+static int tz_valid_name(const char *name) {
+  if (!*name || *name == '/') {
+    return 0;
+  }
+  for (const char *p = name; *p; p++) {
+    if (*p == '.' && (p == name || p[-1] == '/')) {
+      return 0;
+    }
+    if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+          tz_is_digit(*p) || strchr("_+-/.", *p))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static tz_zone *tz_zone_load(const char *name) {
+  char *path;
+  if (strcmp(name, "localtime") == 0) {
+    path = sqlite3_mprintf("%s", TZ_LOCALTIME);
+  } else if (tz_valid_name(name)) {
+    const char *dir = getenv("TZDIR");
+    path = sqlite3_mprintf("%s/%s", dir && *dir ? dir : TZ_DEFAULT_DIR, name);
+  } else {
+    return NULL;
+  }
+  if (!path) {
+    return NULL;
+  }
+
+  FILE *f = fopen(path, "rb");
+  sqlite3_free(path);
+  if (!f) {
+    return NULL;
+  }
+  unsigned char *z = NULL;
+  long n = -1;
+  if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0 && n <= TZ_MAX_FILE &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    z = sqlite3_malloc(n);
+    if (z && fread(z, 1, n, f) != (size_t)n) {
+      sqlite3_free(z);
+      z = NULL;
+    }
+  }
+  fclose(f);
+
+  tz_zone *zone = sqlite3_malloc(sizeof(tz_zone));
+  if (zone) {
+    memset(zone, 0, sizeof(*zone));
+    zone->name = sqlite3_mprintf("%s", name);
+  }
+  if (!z || !zone || !zone->name ||
+      tz_zone_parse(zone, z, (int)n) != SQLITE_OK) {
+    if (zone) {
+      tz_zone_free(zone);
+    }
+    zone = NULL;
+  }
+  sqlite3_free(z);
+  return zone;
+}
+
+tz_cache *tz_cache_new(void) {
+  tz_cache *cache = sqlite3_malloc(sizeof(tz_cache));
+  if (cache) {
+    cache->zones = NULL;
+  }
+  return cache;
+}
+
+void tz_cache_free(void *p) {
+  tz_cache *cache = (tz_cache *)p;
+  while (cache->zones) {
+    tz_zone *zone = cache->zones;
+    cache->zones = zone->next;
+    tz_zone_free(zone);
+  }
+  sqlite3_free(cache);
+}
+
+static tz_zone *tz_cache_get(tz_cache *cache, const char *name) {
+  for (tz_zone *zone = cache->zones; zone; zone = zone->next) {
+    if (strcmp(zone->name, name) == 0) {
+      return zone;
+    }
+  }
+  tz_zone *zone = tz_zone_load(name);
+  if (zone) {
+    zone->next = cache->zones;
+    cache->zones = zone;
+  }
+  return zone;
+}
+
+// Index of the period containing t.
+static int tz_period(const tz_zone *zone, sqlite3_int64 t) {
+  int lo = 0;
+  int hi = zone->n - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (zone->at[mid] <= t) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// The first instant at which the local time is t or later. Local times
+// repeated when the clock is set back map to their first occurrence, local
+// times skipped when it is set forward to the transition.
+static sqlite3_int64 tz_local_to_utc(const tz_zone *zone, sqlite3_int64 t) {
+  int k = tz_period(zone, t - zone->offset[tz_period(zone, t)]);
+
+  // Offsets are far smaller than the time between transitions, so only the
+  // neighbouring periods can contain t.
+  int lo = k > 0 ? k - 1 : 0;
+  int hi = k + 1 < zone->n ? k + 1 : k;
+  for (int i = lo; i <= hi; i++) {
+    sqlite3_int64 u = t - zone->offset[i];
+    if (u >= zone->at[i] && (i + 1 == zone->n || u < zone->at[i + 1])) {
+      return u;
+    }
+  }
+  for (int i = lo + 1; i <= hi; i++) {
+    if (t - zone->offset[i - 1] >= zone->at[i] &&
+        t - zone->offset[i] < zone->at[i]) {
+      return zone->at[i];
+    }
+  }
+  return t - zone->offset[k];
+}
+
+// Parse "[n] unit", e.g. "1 month", "15 minutes" or "week".
+static int calendar_parse_width(const char *p, calendar_width *w) {
+  static const struct {
+    const char *name;
+    sqlite3_int64 seconds;
+    int months;
+  } units[] = {
+      {"second", 1, 0},
+      {"minute", 60, 0},
+      {"hour", 3600, 0},
+      {"day", SECONDS_PER_DAY, 0},
+      {"week", 7 * SECONDS_PER_DAY, 0},
+      {"month", 0, 1},
+      {"quarter", 0, 3},
+      {"year", 0, 12},
+  };
+
+  int n = 1;
+  while (*p == ' ') {
+    p++;
+  }
+  if (tz_is_digit(*p)) {
+    p = tz_parse_number(p, 1000000, &n);
+    if (!p || n < 1) {
+      return -1;
+    }
+    while (*p == ' ') {
+      p++;
+    }
+  }
+
+  const char *unit = p;
+  while (*p >= 'a' && *p <= 'z') {
+    p++;
+  }
+  size_t len = p - unit;
+  while (*p == ' ') {
+    p++;
+  }
+  if (*p || !len) {
+    return -1;
+  }
+  if (unit[len - 1] == 's') {
+    len--;
+  }
+
+  for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+    if (strlen(units[i].name) == len && memcmp(units[i].name, unit, len) == 0) {
+      w->months = (sqlite3_int64)units[i].months * n;
+      w->seconds = units[i].seconds * n;
+      // Weeks start on Monday, 1970-01-05.
+      w->origin = units[i].seconds == 7 * SECONDS_PER_DAY ? 4 * SECONDS_PER_DAY
+                                                          : 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Start of the bucket containing local time t, in local time.
+static sqlite3_int64 calendar_bucket(const calendar_width *w, sqlite3_int64 t) {
+  if (!w->months) {
+    return floor_div(t - w->origin, w->seconds) * w->seconds + w->origin;
+  }
+
+  sqlite3_int64 y;
+  int m;
+  civil_from_days(floor_div(t, SECONDS_PER_DAY), &y, &m);
+  sqlite3_int64 month = floor_div(y * 12 + m - 1, w->months) * w->months;
+  y = floor_div(month, 12);
+  return days_from_civil(y, (int)(month - y * 12) + 1, 1) * SECONDS_PER_DAY;
+}
+
+void time_bucket_calendar_func(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  if (argc < 2 || argc > 3) {
+    sqlite3_result_error(
+        context, "wrong number of arguments to function time_bucket_calendar",
+        -1);
+    return;
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+
+  // The parsed width and the zone are kept as auxiliary data, so constant
+  // arguments are only looked at for the first row.
+  calendar_width width;
+  calendar_width *aux = sqlite3_get_auxdata(context, 0);
+  if (aux) {
+    width = *aux;
+  } else {
+    const char *z = (const char *)sqlite3_value_text(argv[0]);
+    if (!z || calendar_parse_width(z, &width) != 0) {
+      sqlite3_result_error(context, "invalid bucket width", -1);
+      return;
+    }
+    aux = sqlite3_malloc(sizeof(calendar_width));
+    if (!aux) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    *aux = width;
+    sqlite3_set_auxdata(context, 0, aux, sqlite3_free);
+  }
+
+  tz_zone *zone = NULL;
+  if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+    zone = sqlite3_get_auxdata(context, 2);
+    if (!zone) {
+      const char *name = (const char *)sqlite3_value_text(argv[2]);
+      if (!name) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+      if (strcmp(name, "UTC") != 0) {
+        zone = tz_cache_get((tz_cache *)sqlite3_user_data(context), name);
+        if (!zone) {
+          char *err = sqlite3_mprintf("unknown time zone: %s", name);
+          sqlite3_result_error(context, err ? err : "unknown time zone", -1);
+          sqlite3_free(err);
+          return;
+        }
+        // Zones live as long as the connection, so no destructor.
+        sqlite3_set_auxdata(context, 2, zone, NULL);
+      }
+    }
+  }
+
+  sqlite3_int64 ts = sqlite3_value_int64(argv[1]);
+  if (ts < -CALENDAR_MAX_TS || ts > CALENDAR_MAX_TS) {
+    sqlite3_result_error(context, "timestamp out of range", -1);
+    return;
+  }
+  if (!zone) {
+    sqlite3_result_int64(context, calendar_bucket(&width, ts));
+    return;
+  }
+
+  sqlite3_int64 local = ts + zone->offset[tz_period(zone, ts)];
+  sqlite3_int64 bucket = calendar_bucket(&width, local);
+  sqlite3_result_int64(context, tz_local_to_utc(zone, bucket));
+}
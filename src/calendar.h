@@ -0,0 +1,16 @@
+#ifndef TSLITE_CALENDAR_H
+#define TSLITE_CALENDAR_H
+
+#include "tslite.h"
+
+// Per connection cache of parsed time zones, passed as user data to
+// time_bucket_calendar.
+typedef struct tz_cache tz_cache;
+
+tz_cache *tz_cache_new(void);
+void tz_cache_free(void *cache);
+
+void time_bucket_calendar_func(sqlite3_context *context, int argc,
+                               sqlite3_value **argv);
+
+#endif  // TSLITE_CALENDAR_H
@@ -0,0 +1,153 @@
+#include "first_last.h"
+
+#include <string.h>
+
+#include "array_buffer.h"
+
+// Replace the kept value with v, at timestamp ts.
+static int first_last_set(first_last *s, sqlite3_int64 ts,
+                          const array_value *v) {
+  if ((v->type == SQLITE_TEXT || v->type == SQLITE_BLOB) && v->n > 0) {
+    if (v->n > s->cap) {
+      unsigned char *buf = sqlite3_realloc(s->buf, v->n);
+      if (!buf) {
+        return SQLITE_NOMEM;
+      }
+      s->buf = buf;
+      s->cap = v->n;
+    }
+    memcpy(s->buf, v->z, v->n);
+  }
+  s->value = *v;
+  s->value.z = v->n > 0 ? s->buf : (const unsigned char *)"";
+  s->ts = ts;
+  s->set = 1;
+  return SQLITE_OK;
+}
+
+static void first_last_step(sqlite3_context *context, sqlite3_value **argv,
+                            int last) {
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+  first_last *s = sqlite3_aggregate_context(context, sizeof(first_last));
+  if (!s) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  // Ties go to the row seen first for first and last for last, as they would
+  // in a sort by ts.
+  sqlite3_int64 ts = sqlite3_value_int64(argv[1]);
+  if (s->set && (last ? ts < s->ts : ts >= s->ts)) {
+    return;
+  }
+
+  array_value v;
+  v.type = sqlite3_value_type(argv[0]);
+  v.i = sqlite3_value_int64(argv[0]);
+  v.f = sqlite3_value_double(argv[0]);
+  v.z = NULL;
+  v.n = 0;
+  if (v.type == SQLITE_TEXT) {
+    v.z = sqlite3_value_text(argv[0]);
+    v.n = sqlite3_value_bytes(argv[0]);
+  } else if (v.type == SQLITE_BLOB) {
+    v.z = sqlite3_value_blob(argv[0]);
+    v.n = sqlite3_value_bytes(argv[0]);
+  }
+  if (first_last_set(s, ts, &v)) {
+    sqlite3_result_error_nomem(context);
+  }
+}
+
+void first_step_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  first_last_step(context, argv, 0);
+}
+
+void last_step_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  first_last_step(context, argv, 1);
+}
+
+// States are two element arrays of ts and value, as returned by first_state
+// and last_state.
+static void first_last_merge_step(sqlite3_context *context,
+                                  sqlite3_value **argv, int last) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+  first_last *s = sqlite3_aggregate_context(context, sizeof(first_last));
+  if (!s) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  int n = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+  array_iter it;
+  array_value ts, v, end;
+  array_iter_init(&it, z, n);
+  if (array_iter_next(&it, &ts) != 1 || ts.type != SQLITE_INTEGER ||
+      array_iter_next(&it, &v) != 1 || array_iter_next(&it, &end) != 0) {
+    sqlite3_result_error(context, "invalid first/last state", -1);
+    return;
+  }
+
+  if (s->set && (last ? ts.i < s->ts : ts.i >= s->ts)) {
+    return;
+  }
+  if (first_last_set(s, ts.i, &v)) {
+    sqlite3_result_error_nomem(context);
+  }
+}
+
+void first_merge_step_func(sqlite3_context *context, int argc,
+                           sqlite3_value **argv) {
+  UNUSED(argc);
+  first_last_merge_step(context, argv, 0);
+}
+
+void last_merge_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  UNUSED(argc);
+  first_last_merge_step(context, argv, 1);
+}
+
+void first_last_final_func(sqlite3_context *context) {
+  first_last *s = sqlite3_aggregate_context(context, 0);
+  if (!s) {
+    sqlite3_result_null(context);
+    return;
+  }
+  if (s->set) {
+    array_value_result(context, &s->value);
+  }
+  sqlite3_free(s->buf);
+}
+
+void first_last_state_final_func(sqlite3_context *context) {
+  first_last *s = sqlite3_aggregate_context(context, 0);
+  if (!s || !s->set) {
+    sqlite3_result_null(context);
+    if (s) {
+      sqlite3_free(s->buf);
+    }
+    return;
+  }
+
+  array_buffer buf = {NULL, 0, 0};
+  array_value ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.type = SQLITE_INTEGER;
+  ts.i = s->ts;
+  if (array_buffer_append_element(&buf, &ts) ||
+      array_buffer_append_element(&buf, &s->value)) {
+    sqlite3_result_error_nomem(context);
+  } else {
+    sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  }
+  sqlite3_free(buf.buf);
+  sqlite3_free(s->buf);
+}
@@ -0,0 +1,25 @@
+#ifndef TSLITE_FIRST_LAST_H
+#define TSLITE_FIRST_LAST_H
+
+#include "array.h"
+
+// The value at the smallest (first) or largest (last) ts seen so far. TEXT
+// and BLOB values are copied into buf, which is reused within the group.
+typedef struct {
+  int set;
+  sqlite3_int64 ts;
+  array_value value;
+  unsigned char *buf;
+  int cap;
+} first_last;
+
+void first_step_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void last_step_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void first_merge_step_func(sqlite3_context *context, int argc,
+                           sqlite3_value **argv);
+void last_merge_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+void first_last_final_func(sqlite3_context *context);
+void first_last_state_final_func(sqlite3_context *context);
+
+#endif  // TSLITE_FIRST_LAST_H
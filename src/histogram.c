@@ -0,0 +1,207 @@
+#include "histogram.h"
+
+#include <math.h>
+
+#include "array.h"
+#include "array_buffer.h"
+
+#define HISTOGRAM_MAX_BUCKETS 65536
+
+// Counts are laid out as [underflow, bucket 0 .. bucket n-1, overflow], so a
+// histogram always accounts for every value it has seen.
+typedef struct {
+  sqlite3_int64 *counts;
+  int n;  // Number of buckets, excluding underflow and overflow.
+  double lo, hi;
+  double width;  // Linear: bucket width. Log-linear: sub-buckets per octave.
+} histogram;
+
+static int histogram_init(sqlite3_context *context, histogram *h, int n) {
+  if (n < 1 || n > HISTOGRAM_MAX_BUCKETS) {
+    sqlite3_result_error(context, "invalid number of histogram buckets", -1);
+    return SQLITE_ERROR;
+  }
+  h->counts = sqlite3_malloc64((n + 2) * sizeof(sqlite3_int64));
+  if (!h->counts) {
+    sqlite3_result_error_nomem(context);
+    return SQLITE_NOMEM;
+  }
+  memset(h->counts, 0, (n + 2) * sizeof(sqlite3_int64));
+  h->n = n;
+  return SQLITE_OK;
+}
+
+// The bounds are taken from the first row of the group.
+void histogram_step_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  UNUSED(argc);
+
+  histogram *h = sqlite3_aggregate_context(context, sizeof(histogram));
+  if (!h) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (!h->counts) {
+    h->lo = sqlite3_value_double(argv[1]);
+    h->hi = sqlite3_value_double(argv[2]);
+    if (!(h->lo < h->hi)) {
+      sqlite3_result_error(context, "invalid histogram bounds", -1);
+      return;
+    }
+    // Checked before narrowing to int, which would wrap large counts.
+    sqlite3_int64 n = sqlite3_value_int64(argv[3]);
+    if (n < 1 || n > HISTOGRAM_MAX_BUCKETS) {
+      sqlite3_result_error(context, "invalid number of histogram buckets", -1);
+      return;
+    }
+    if (histogram_init(context, h, (int)n)) {
+      return;
+    }
+    h->width = (h->hi - h->lo) / h->n;
+  }
+
+  if (sqlite3_value_numeric_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+  double v = sqlite3_value_double(argv[0]);
+  int k;
+  if (v < h->lo) {
+    k = 0;
+  } else if (v >= h->hi) {
+    k = h->n + 1;
+  } else {
+    k = 1 + (int)((v - h->lo) / h->width);
+    if (k > h->n) {
+      k = h->n;  // Rounding right below hi.
+    }
+  }
+  h->counts[k]++;
+}
+
+// Log-linear buckets: every power of two above lo is split into a fixed
+// number of equally wide sub-buckets, so the relative bucket width (and thus
+// the relative error) is the same over the whole range.
+void histogram_loglinear_step_func(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  UNUSED(argc);
+
+  histogram *h = sqlite3_aggregate_context(context, sizeof(histogram));
+  if (!h) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (!h->counts) {
+    h->lo = sqlite3_value_double(argv[1]);
+    h->hi = sqlite3_value_double(argv[2]);
+    sqlite3_int64 sub = sqlite3_value_int64(argv[3]);
+    if (!(h->lo > 0 && h->lo < h->hi) || sub < 1) {
+      sqlite3_result_error(context, "invalid histogram bounds", -1);
+      return;
+    }
+    // Checked in floating point, the product of user input can't overflow.
+    double n = ceil(log2(h->hi / h->lo)) * (double)sub;
+    if (!(n <= HISTOGRAM_MAX_BUCKETS)) {
+      sqlite3_result_error(context, "invalid number of histogram buckets", -1);
+      return;
+    }
+    if (histogram_init(context, h, (int)n)) {
+      return;
+    }
+    h->width = (double)sub;
+  }
+
+  if (sqlite3_value_numeric_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+  double v = sqlite3_value_double(argv[0]);
+  int k;
+  if (!(v >= h->lo)) {
+    k = 0;
+  } else if (v >= h->hi) {
+    k = h->n + 1;
+  } else {
+    // v / lo = m * 2^e with m in [0.5, 1), so v lies in octave e - 1 at
+    // relative position 2m - 1.
+    int e;
+    double m = frexp(v / h->lo, &e);
+    k = 1 + (e - 1) * (int)h->width + (int)((2 * m - 1) * h->width);
+    if (k > h->n) {
+      k = h->n;
+    }
+  }
+  h->counts[k]++;
+}
+
+// Sum histograms element-wise, for combining stored histograms of finer
+// tiers. All histograms must have the same bucket layout.
+void histogram_merge_step_func(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  UNUSED(argc);
+
+  histogram *h = sqlite3_aggregate_context(context, sizeof(histogram));
+  if (!h) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  int s = sqlite3_value_bytes(argv[0]);
+  const unsigned char *z = sqlite3_value_blob(argv[0]);
+  array_iter it;
+  array_value v;
+  int rc;
+
+  if (!h->counts) {
+    int n = 0;
+    array_iter_init(&it, z, s);
+    while ((rc = array_iter_next(&it, &v)) == 1) {
+      n++;
+    }
+    if (rc == -1 || n < 3) {
+      sqlite3_result_error(context, "malformed histogram", -1);
+      return;
+    }
+    if (histogram_init(context, h, n - 2)) {
+      return;
+    }
+  }
+
+  int k = 0;
+  array_iter_init(&it, z, s);
+  while ((rc = array_iter_next(&it, &v)) == 1) {
+    if (k >= h->n + 2 || v.type != SQLITE_INTEGER) {
+      rc = -1;
+      break;
+    }
+    h->counts[k++] += v.i;
+  }
+  if (rc == -1 || k != h->n + 2) {
+    sqlite3_result_error(context, "histogram bucket layouts differ", -1);
+  }
+}
+
+void histogram_final_func(sqlite3_context *context) {
+  histogram *h = sqlite3_aggregate_context(context, 0);
+  if (!h || !h->counts) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  array_buffer buf = {NULL, 0, 0};
+  if (array_buffer_grow(&buf, (h->n + 2) * 10)) {
+    sqlite3_result_error_nomem(context);
+    sqlite3_free(h->counts);
+    return;
+  }
+  array_value v = {SQLITE_INTEGER, 0, 0.0, NULL, 0};
+  for (int k = 0; k < h->n + 2; k++) {
+    v.i = h->counts[k];
+    array_buffer_append_element(&buf, &v);
+  }
+  sqlite3_free(h->counts);
+
+  sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  sqlite3_free(buf.buf);
+}
@@ -0,0 +1,14 @@
+#ifndef TSLITE_HISTOGRAM_H
+#define TSLITE_HISTOGRAM_H
+
+#include "tslite.h"
+
+void histogram_step_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv);
+void histogram_loglinear_step_func(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv);
+void histogram_merge_step_func(sqlite3_context *context, int argc,
+                               sqlite3_value **argv);
+void histogram_final_func(sqlite3_context *context);
+
+#endif  // TSLITE_HISTOGRAM_H
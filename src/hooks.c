@@ -0,0 +1,115 @@
+#include "hooks.h"
+
+#include <string.h>
+
+static void hooks_update(void *arg, int op, const char *db, const char *table,
+                         sqlite3_int64 rowid) {
+  tslite_hooks *hooks = (tslite_hooks *)arg;
+  hooks->events++;
+  hooks->open = 1;
+  for (tslite_hooks_listener *l = hooks->listeners; l; l = l->next) {
+    if (l->xUpdate) {
+      l->xUpdate(l->arg, op, db, table, rowid);
+    }
+  }
+}
+
+static int hooks_commit(void *arg) {
+  tslite_hooks *hooks = (tslite_hooks *)arg;
+  hooks->open = 0;
+  for (tslite_hooks_listener *l = hooks->listeners; l; l = l->next) {
+    if (l->xCommit) {
+      l->xCommit(l->arg);
+    }
+  }
+  return 0;
+}
+
+static void hooks_rollback(void *arg) {
+  tslite_hooks *hooks = (tslite_hooks *)arg;
+  hooks->open = 0;
+  for (tslite_hooks_listener *l = hooks->listeners; l; l = l->next) {
+    if (l->xRollback) {
+      l->xRollback(l->arg);
+    }
+  }
+}
+
+tslite_hooks *tslite_hooks_new(sqlite3 *db) {
+  tslite_hooks *hooks = sqlite3_malloc(sizeof(tslite_hooks));
+  if (!hooks) {
+    return NULL;
+  }
+  memset(hooks, 0, sizeof(*hooks));
+  hooks->db = db;
+  hooks->ref = 1;
+  return hooks;
+}
+
+void tslite_hooks_ref(tslite_hooks *hooks) { hooks->ref++; }
+
+// The last reference goes when the connection closes (or the modules are
+// registered again), the hooks must not point to freed memory after that.
+void tslite_hooks_unref(void *p) {
+  tslite_hooks *hooks = (tslite_hooks *)p;
+  if (--hooks->ref == 0) {
+    if (hooks->installed) {
+      sqlite3_update_hook(hooks->db, NULL, NULL);
+      sqlite3_commit_hook(hooks->db, NULL, NULL);
+      sqlite3_rollback_hook(hooks->db, NULL, NULL);
+    }
+    sqlite3_free(hooks);
+  }
+}
+
+// The hooks are only installed once there are listeners, so a connection that
+// doesn't use the caches pays nothing.
+void tslite_hooks_add(tslite_hooks *hooks, tslite_hooks_listener *listener) {
+  listener->next = hooks->listeners;
+  hooks->listeners = listener;
+  tslite_hooks_ref(hooks);
+  if (hooks->installed) {
+    return;
+  }
+
+  void *update = sqlite3_update_hook(hooks->db, hooks_update, hooks);
+  void *commit = sqlite3_commit_hook(hooks->db, hooks_commit, hooks);
+  void *rollback = sqlite3_rollback_hook(hooks->db, hooks_rollback, hooks);
+  hooks->installed = 1;
+  if (update || commit || rollback) {
+    sqlite3_log(SQLITE_WARNING,
+                "tslite replaced the update, commit or rollback hook of the "
+                "connection");
+  }
+}
+
+void tslite_hooks_remove(tslite_hooks *hooks,
+                         tslite_hooks_listener *listener) {
+  tslite_hooks_listener **l = &hooks->listeners;
+  while (*l && *l != listener) {
+    l = &(*l)->next;
+  }
+  if (!*l) {
+    return;
+  }
+  *l = listener->next;
+  tslite_hooks_unref(hooks);
+}
+
+void tslite_hooks_mark_set(tslite_hooks *hooks, tslite_hooks_mark *mark) {
+  mark->changes = sqlite3_total_changes64(hooks->db);
+  mark->events = hooks->events;
+}
+
+// Whether events were missed since mark. Rows changed without passing through
+// the update hook: the truncate optimization of an unconditional DELETE and
+// changes to WITHOUT ROWID tables are counted as changes, but don't call the
+// hook, nor does a hook the application installed in place of the
+// dispatcher's. Outside of a transaction, updates without a commit or
+// rollback event mean the commit and rollback hooks were replaced.
+int tslite_hooks_missed(tslite_hooks *hooks, const tslite_hooks_mark *mark) {
+  return sqlite3_total_changes64(hooks->db) - mark->changes >
+             hooks->events - mark->events ||
+         (hooks->open && sqlite3_get_autocommit(hooks->db) &&
+          sqlite3_txn_state(hooks->db, NULL) != SQLITE_TXN_WRITE);
+}
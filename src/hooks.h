@@ -0,0 +1,58 @@
+#ifndef TSLITE_HOOKS_H
+#define TSLITE_HOOKS_H
+
+#include "tslite.h"
+
+// A connection has a single update, commit and rollback hook. The hooks
+// dispatcher owns those for tslite and fans the events out to listeners, so
+// several caches can follow the same connection.
+//
+// SQLite only returns the argument of a replaced hook, not its callback, so
+// the dispatcher can't chain to hooks installed by the application. Replacing
+// one is logged with sqlite3_log. Once installed, the hooks stay until the
+// connection closes: removing them would also remove hooks the application
+// installed since. A listener whose hooks were replaced stops getting events,
+// which tslite_hooks_missed reports so it can start over.
+//
+// Hook callbacks must not use the connection, listeners only record what
+// changed and catch up on the next read.
+typedef struct tslite_hooks_listener {
+  void *arg;
+  void (*xUpdate)(void *arg, int op, const char *db, const char *table,
+                  sqlite3_int64 rowid);
+  void (*xCommit)(void *arg);
+  void (*xRollback)(void *arg);
+  struct tslite_hooks_listener *next;
+} tslite_hooks_listener;
+
+typedef struct {
+  sqlite3 *db;
+  int ref;
+  int installed;
+  tslite_hooks_listener *listeners;
+
+  // Number of update hook events seen, to detect changes that bypass the
+  // update hook (see tslite_hooks_missed).
+  sqlite3_int64 events;
+  // Whether update events were seen since the last commit or rollback event.
+  int open;
+} tslite_hooks;
+
+// A per connection counter snapshot taken by listeners.
+typedef struct {
+  sqlite3_int64 changes;
+  sqlite3_int64 events;
+} tslite_hooks_mark;
+
+tslite_hooks *tslite_hooks_new(sqlite3 *db);
+void tslite_hooks_ref(tslite_hooks *hooks);
+void tslite_hooks_unref(void *hooks);
+
+void tslite_hooks_add(tslite_hooks *hooks, tslite_hooks_listener *listener);
+void tslite_hooks_remove(tslite_hooks *hooks,
+                         tslite_hooks_listener *listener);
+
+void tslite_hooks_mark_set(tslite_hooks *hooks, tslite_hooks_mark *mark);
+int tslite_hooks_missed(tslite_hooks *hooks, const tslite_hooks_mark *mark);
+
+#endif  // TSLITE_HOOKS_H
@@ -0,0 +1,25 @@
+#ifndef TSLITE_KAHAN_H
+#define TSLITE_KAHAN_H
+
+#include <math.h>
+
+// Running sum with Neumaier's compensation, so adding and later removing the
+// same values (xStep and xInverse) doesn't drift.
+typedef struct {
+  double sum;
+  double c;
+} kahan_sum;
+
+static inline void kahan_add(kahan_sum *k, double x) {
+  double t = k->sum + x;
+  if (fabs(k->sum) >= fabs(x)) {
+    k->c += (k->sum - t) + x;
+  } else {
+    k->c += (x - t) + k->sum;
+  }
+  k->sum = t;
+}
+
+static inline double kahan_value(const kahan_sum *k) { return k->sum + k->c; }
+
+#endif  // TSLITE_KAHAN_H
@@ -0,0 +1,740 @@
+#include "last.h"
+
+#include <math.h>
+#include <string.h>
+
+#define LAST_VTAB_SERIES 0
+#define LAST_VTAB_TS 1
+#define LAST_VTAB_VALUE 2
+
+#define LAST_IDX_SERIES 1
+
+// Beyond this many changed rows between two reads, reloading the whole
+// table is cheaper than looking up every row.
+#define LAST_MAX_PENDING 65536
+
+// Series keys compare like SQL values: integral floats equal integers.
+static int last_key_integer(sqlite3_value *v, sqlite3_int64 *i) {
+  switch (sqlite3_value_type(v)) {
+    case SQLITE_INTEGER:
+      *i = sqlite3_value_int64(v);
+      return 1;
+
+    case SQLITE_FLOAT:
+      double f = sqlite3_value_double(v);
+      if (f == floor(f) && f >= -9.2e18 && f <= 9.2e18) {
+        *i = (sqlite3_int64)f;
+        return 1;
+      }
+      return 0;
+  }
+  return 0;
+}
+
+static unsigned int last_hash_bytes(unsigned int h, const void *z, int n) {
+  const unsigned char *p = z;
+  for (int k = 0; k < n; k++) {
+    h = (h ^ p[k]) * 16777619u;
+  }
+  return h;
+}
+
+static unsigned int last_hash(sqlite3_value *v) {
+  unsigned int h = 2166136261u;
+  sqlite3_int64 i;
+  int type = sqlite3_value_type(v);
+  if (last_key_integer(v, &i)) {
+    return last_hash_bytes(h, &i, sizeof(i));
+  }
+  if (type == SQLITE_FLOAT) {
+    double f = sqlite3_value_double(v);
+    return last_hash_bytes(h, &f, sizeof(f));
+  }
+  h = last_hash_bytes(h, &type, sizeof(type));
+  return last_hash_bytes(h, sqlite3_value_blob(v), sqlite3_value_bytes(v));
+}
+
+static int last_key_equal(sqlite3_value *a, sqlite3_value *b) {
+  sqlite3_int64 x, y;
+  int ia = last_key_integer(a, &x);
+  int ib = last_key_integer(b, &y);
+  if (ia || ib) {
+    return ia && ib && x == y;
+  }
+  int type = sqlite3_value_type(a);
+  if (type != sqlite3_value_type(b)) {
+    return 0;
+  }
+  if (type == SQLITE_FLOAT) {
+    return sqlite3_value_double(a) == sqlite3_value_double(b);
+  }
+  int n = sqlite3_value_bytes(a);
+  if (n != sqlite3_value_bytes(b)) {
+    return 0;
+  }
+  return n == 0 || memcmp(sqlite3_value_blob(a), sqlite3_value_blob(b), n) == 0;
+}
+
+static unsigned int last_rowid_hash(sqlite3_int64 rowid) {
+  sqlite3_uint64 h = (sqlite3_uint64)rowid * 0x9e3779b97f4a7c15ull;
+  return (unsigned int)(h >> 32);
+}
+
+static void last_entry_free(last_entry *e) {
+  sqlite3_value_free(e->series);
+  sqlite3_value_free(e->value);
+  sqlite3_free(e);
+}
+
+static last_entry *last_map_find(const last_map *map, sqlite3_value *series,
+                                 unsigned int hash) {
+  if (!map->n_slots) {
+    return NULL;
+  }
+  for (last_entry *e = map->slots[hash & (map->n_slots - 1)]; e; e = e->next) {
+    if (e->hash == hash && last_key_equal(e->series, series)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static last_entry *last_map_find_rowid(const last_map *map,
+                                       sqlite3_int64 rowid) {
+  if (!map->n_slots) {
+    return NULL;
+  }
+  unsigned int slot = last_rowid_hash(rowid) & (map->n_slots - 1);
+  for (last_entry *e = map->rowid_slots[slot]; e; e = e->next_rowid) {
+    if (e->rowid == rowid) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void last_map_link(last_map *map, last_entry *e) {
+  unsigned int slot = e->hash & (map->n_slots - 1);
+  e->next = map->slots[slot];
+  map->slots[slot] = e;
+  e->next_rowid = NULL;
+  if (!e->deleted) {
+    slot = last_rowid_hash(e->rowid) & (map->n_slots - 1);
+    e->next_rowid = map->rowid_slots[slot];
+    map->rowid_slots[slot] = e;
+  }
+}
+
+static int last_map_insert(last_map *map, last_entry *e) {
+  if (map->count >= map->n_slots / 2) {
+    int n_slots = map->n_slots ? map->n_slots * 2 : 64;
+    last_entry **slots = sqlite3_malloc64(2 * n_slots * sizeof(last_entry *));
+    if (!slots) {
+      return SQLITE_NOMEM;
+    }
+    memset(slots, 0, 2 * n_slots * sizeof(last_entry *));
+    last_map old = *map;
+    map->slots = slots;
+    map->rowid_slots = &slots[n_slots];
+    map->n_slots = n_slots;
+    for (int k = 0; k < old.n_slots; k++) {
+      last_entry *next;
+      for (last_entry *o = old.slots[k]; o; o = next) {
+        next = o->next;
+        last_map_link(map, o);
+      }
+    }
+    sqlite3_free(old.slots);
+  }
+  last_map_link(map, e);
+  map->count++;
+  return SQLITE_OK;
+}
+
+static void last_map_unlink(last_map *map, last_entry *e) {
+  last_entry **p = &map->slots[e->hash & (map->n_slots - 1)];
+  while (*p != e) {
+    p = &(*p)->next;
+  }
+  *p = e->next;
+  if (!e->deleted) {
+    p = &map->rowid_slots[last_rowid_hash(e->rowid) & (map->n_slots - 1)];
+    while (*p != e) {
+      p = &(*p)->next_rowid;
+    }
+    *p = e->next_rowid;
+  }
+  map->count--;
+}
+
+static void last_vtab_discard(last_vtab *vtab, last_entry *e) {
+  e->next = vtab->garbage;
+  vtab->garbage = e;
+}
+
+static void last_vtab_collect(last_vtab *vtab) {
+  while (vtab->garbage) {
+    last_entry *e = vtab->garbage;
+    vtab->garbage = e->next;
+    last_entry_free(e);
+  }
+}
+
+// Move all entries of map to the garbage list.
+static void last_vtab_clear(last_vtab *vtab, last_map *map) {
+  for (int k = 0; k < map->n_slots; k++) {
+    last_entry *next;
+    for (last_entry *e = map->slots[k]; e; e = next) {
+      next = e->next;
+      last_vtab_discard(vtab, e);
+    }
+  }
+  sqlite3_free(map->slots);
+  memset(map, 0, sizeof(*map));
+}
+
+// The value of a series is its entry in the overlay, if any, and otherwise
+// the committed one.
+static last_entry *last_vtab_get(last_vtab *vtab, sqlite3_value *series,
+                                 unsigned int hash) {
+  last_entry *e = last_map_find(&vtab->overlay, series, hash);
+  if (e) {
+    return e->deleted ? NULL : e;
+  }
+  return last_map_find(&vtab->committed, series, hash);
+}
+
+static last_entry *last_vtab_get_rowid(last_vtab *vtab, sqlite3_int64 rowid) {
+  last_entry *e = last_map_find_rowid(&vtab->overlay, rowid);
+  if (e) {
+    return e;
+  }
+  e = last_map_find_rowid(&vtab->committed, rowid);
+  if (e && last_map_find(&vtab->overlay, e->series, e->hash)) {
+    return NULL;
+  }
+  return e;
+}
+
+// Store the latest row of a series, or a deletion when value is NULL, in
+// target.
+static int last_vtab_set(last_vtab *vtab, last_map *target,
+                         sqlite3_value *series, unsigned int hash,
+                         sqlite3_int64 ts, sqlite3_value *value,
+                         sqlite3_int64 rowid) {
+  last_entry *old = last_map_find(target, series, hash);
+  if (old) {
+    last_map_unlink(target, old);
+    last_vtab_discard(vtab, old);
+  }
+  if (!value && target == &vtab->committed) {
+    return SQLITE_OK;
+  }
+
+  last_entry *e = sqlite3_malloc(sizeof(last_entry));
+  if (!e) {
+    return SQLITE_NOMEM;
+  }
+  memset(e, 0, sizeof(*e));
+  e->series = sqlite3_value_dup(series);
+  e->value = value ? sqlite3_value_dup(value) : NULL;
+  e->ts = ts;
+  e->rowid = rowid;
+  e->hash = hash;
+  e->deleted = !value;
+  if (!e->series || (value && !e->value) || last_map_insert(target, e)) {
+    last_entry_free(e);
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+// Offer a row to its series, it wins on a later timestamp and on ties on a
+// later rowid.
+static int last_vtab_offer(last_vtab *vtab, last_map *target,
+                           sqlite3_value *series, sqlite3_int64 ts,
+                           sqlite3_value *value, sqlite3_int64 rowid) {
+  unsigned int hash = last_hash(series);
+  last_entry *e = last_vtab_get(vtab, series, hash);
+  if (e && (e->ts > ts || (e->ts == ts && e->rowid > rowid))) {
+    return SQLITE_OK;
+  }
+  return last_vtab_set(vtab, target, series, hash, ts, value, rowid);
+}
+
+static int last_vtab_prepare(last_vtab *vtab) {
+  if (vtab->version_stmt) {
+    return SQLITE_OK;
+  }
+
+  char *sql[4];
+  sql[0] = sqlite3_mprintf("PRAGMA \"%w\".data_version", vtab->schema);
+  sql[1] = sqlite3_mprintf(
+      "SELECT \"%w\", \"%w\", \"%w\", rowid FROM \"%w\".\"%w\" "
+      "WHERE \"%w\" IS NOT NULL AND \"%w\" IS NOT NULL",
+      vtab->series_column, vtab->ts_column, vtab->value_column, vtab->schema,
+      vtab->table, vtab->series_column, vtab->ts_column);
+  sql[2] = sqlite3_mprintf(
+      "SELECT \"%w\", \"%w\", \"%w\" FROM \"%w\".\"%w\" WHERE rowid = ?1",
+      vtab->series_column, vtab->ts_column, vtab->value_column, vtab->schema,
+      vtab->table);
+  sql[3] = sqlite3_mprintf(
+      "SELECT \"%w\", \"%w\", rowid FROM \"%w\".\"%w\" "
+      "WHERE \"%w\" = ?1 AND \"%w\" IS NOT NULL "
+      "ORDER BY \"%w\" DESC, rowid DESC LIMIT 1",
+      vtab->ts_column, vtab->value_column, vtab->schema, vtab->table,
+      vtab->series_column, vtab->ts_column, vtab->ts_column);
+  sqlite3_stmt **stmts[4] = {&vtab->version_stmt, &vtab->scan_stmt,
+                             &vtab->rowid_stmt, &vtab->series_stmt};
+
+  int rc = SQLITE_OK;
+  for (int k = 0; k < 4; k++) {
+    if (!sql[k]) {
+      rc = SQLITE_NOMEM;
+    } else if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v3(vtab->db, sql[k], -1, SQLITE_PREPARE_PERSISTENT,
+                              stmts[k], NULL);
+    }
+    sqlite3_free(sql[k]);
+  }
+  if (rc != SQLITE_OK) {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    for (int k = 0; k < 4; k++) {
+      sqlite3_finalize(*stmts[k]);
+      *stmts[k] = NULL;
+    }
+  }
+  return rc;
+}
+
+static int last_vtab_reload(last_vtab *vtab) {
+  last_vtab_clear(vtab, &vtab->overlay);
+  last_vtab_clear(vtab, &vtab->committed);
+  vtab->n_pending = vtab->n_committed = 0;
+
+  sqlite3_stmt *stmt = vtab->scan_stmt;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rc = last_vtab_offer(vtab, &vtab->committed, sqlite3_column_value(stmt, 0),
+                         sqlite3_column_int64(stmt, 1),
+                         sqlite3_column_value(stmt, 2),
+                         sqlite3_column_int64(stmt, 3));
+    if (rc != SQLITE_OK) {
+      break;
+    }
+  }
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_DONE) {
+    last_vtab_clear(vtab, &vtab->committed);
+    return rc;
+  }
+  vtab->warm = 1;
+  return SQLITE_OK;
+}
+
+// Find the latest row of a series again, after its latest row changed.
+static int last_vtab_rescan(last_vtab *vtab, last_map *target,
+                            sqlite3_value *series) {
+  sqlite3_stmt *stmt = vtab->series_stmt;
+  int rc = sqlite3_bind_value(stmt, 1, series);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = sqlite3_step(stmt);
+  unsigned int hash = last_hash(series);
+  if (rc == SQLITE_ROW) {
+    rc = last_vtab_set(vtab, target, series, hash,
+                       sqlite3_column_int64(stmt, 0),
+                       sqlite3_column_value(stmt, 1),
+                       sqlite3_column_int64(stmt, 2));
+  } else if (rc == SQLITE_DONE) {
+    rc = last_vtab_set(vtab, target, series, hash, 0, NULL, 0);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return rc;
+}
+
+// Whether the row with the given rowid is no longer the latest row of the
+// series of e: it was deleted, moved to another series or back in time.
+static int last_vtab_stale(last_vtab *vtab, last_entry *e,
+                           sqlite3_int64 rowid, int *stale) {
+  sqlite3_stmt *stmt = vtab->rowid_stmt;
+  sqlite3_bind_int64(stmt, 1, rowid);
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *stale = sqlite3_column_type(stmt, 0) == SQLITE_NULL ||
+             sqlite3_column_type(stmt, 1) == SQLITE_NULL ||
+             !last_key_equal(e->series, sqlite3_column_value(stmt, 0)) ||
+             sqlite3_column_int64(stmt, 1) < e->ts;
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    *stale = 1;
+    rc = SQLITE_OK;
+  }
+  sqlite3_reset(stmt);
+  return rc;
+}
+
+// Bring the rows changed by the update hook into target. The stale entries
+// are all found before anything changes: once a series is rescanned or
+// offered a row, a rowid may briefly belong to two entries.
+static int last_vtab_resolve(last_vtab *vtab, last_map *target) {
+  last_entry **stale = sqlite3_malloc64(
+      (vtab->n_pending ? vtab->n_pending : 1) * sizeof(last_entry *));
+  if (!stale) {
+    return SQLITE_NOMEM;
+  }
+
+  int n_stale = 0;
+  int rc = SQLITE_OK;
+  for (int k = 0; k < vtab->n_pending && rc == SQLITE_OK; k++) {
+    last_entry *e = last_vtab_get_rowid(vtab, vtab->pending[k]);
+    int is_stale = 0;
+    if (e) {
+      rc = last_vtab_stale(vtab, e, vtab->pending[k], &is_stale);
+    }
+    if (is_stale) {
+      stale[n_stale++] = e;
+    }
+  }
+
+  // Replaced entries stay allocated, so their series outlive the rescans.
+  for (int k = 0; k < n_stale && rc == SQLITE_OK; k++) {
+    rc = last_vtab_rescan(vtab, target, stale[k]->series);
+  }
+  sqlite3_free(stale);
+
+  sqlite3_stmt *stmt = vtab->rowid_stmt;
+  for (int k = 0; k < vtab->n_pending && rc == SQLITE_OK; k++) {
+    sqlite3_bind_int64(stmt, 1, vtab->pending[k]);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      rc = SQLITE_OK;
+      if (sqlite3_column_type(stmt, 0) != SQLITE_NULL &&
+          sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+        rc = last_vtab_offer(vtab, target, sqlite3_column_value(stmt, 0),
+                             sqlite3_column_int64(stmt, 1),
+                             sqlite3_column_value(stmt, 2), vtab->pending[k]);
+      }
+    } else if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
+    }
+    sqlite3_reset(stmt);
+  }
+  return rc;
+}
+
+// Catch up with the source table before a read.
+static int last_vtab_sync(last_vtab *vtab) {
+  int rc = last_vtab_prepare(vtab);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_step(vtab->version_stmt);
+  sqlite3_int64 version = sqlite3_column_int64(vtab->version_stmt, 0);
+  sqlite3_reset(vtab->version_stmt);
+  if (rc != SQLITE_ROW) {
+    return rc;
+  }
+
+  // Changes this connection hasn't committed yet only go to the overlay,
+  // which is rebuilt from the pending rowids on every read and dropped on
+  // rollback.
+  int writing = sqlite3_txn_state(vtab->db, vtab->schema) == SQLITE_TXN_WRITE;
+  last_vtab_clear(vtab, &vtab->overlay);
+  if (!vtab->warm || version != vtab->data_version ||
+      tslite_hooks_missed(vtab->hooks, &vtab->mark)) {
+    rc = last_vtab_reload(vtab);
+    // A load that sees uncommitted changes can't be kept: ROLLBACK TO
+    // reverts them without telling any hook.
+    if (writing) {
+      vtab->warm = 0;
+    }
+  } else if (writing) {
+    rc = last_vtab_resolve(vtab, &vtab->overlay);
+  } else {
+    rc = last_vtab_resolve(vtab, &vtab->committed);
+    vtab->n_pending = vtab->n_committed = 0;
+  }
+  if (rc != SQLITE_OK) {
+    vtab->warm = 0;
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return rc;
+  }
+  vtab->data_version = version;
+  tslite_hooks_mark_set(vtab->hooks, &vtab->mark);
+  return SQLITE_OK;
+}
+
+static void last_vtab_update_hook(void *arg, int op, const char *db,
+                                  const char *table, sqlite3_int64 rowid) {
+  UNUSED(op);
+
+  last_vtab *vtab = (last_vtab *)arg;
+  if (!vtab->warm || sqlite3_stricmp(table, vtab->table) != 0 ||
+      sqlite3_stricmp(db, vtab->schema) != 0) {
+    return;
+  }
+  if (vtab->n_pending == vtab->cap_pending) {
+    int cap = vtab->cap_pending ? vtab->cap_pending * 2 : 64;
+    sqlite3_int64 *pending = NULL;
+    if (cap <= LAST_MAX_PENDING) {
+      pending = sqlite3_realloc(vtab->pending, cap * sizeof(sqlite3_int64));
+    }
+    if (!pending) {
+      // Too many changes to track (or out of memory), reload on next read.
+      vtab->warm = 0;
+      vtab->n_pending = vtab->n_committed = 0;
+      return;
+    }
+    vtab->pending = pending;
+    vtab->cap_pending = cap;
+  }
+  vtab->pending[vtab->n_pending++] = rowid;
+}
+
+static void last_vtab_commit_hook(void *arg) {
+  last_vtab *vtab = (last_vtab *)arg;
+  vtab->n_committed = vtab->n_pending;
+}
+
+static void last_vtab_rollback_hook(void *arg) {
+  last_vtab *vtab = (last_vtab *)arg;
+  vtab->n_pending = vtab->n_committed;
+}
+
+static int last_vtab_disconnect(sqlite3_vtab *pVtab) {
+  last_vtab *vtab = (last_vtab *)pVtab;
+  if (vtab->hooks) {
+    tslite_hooks_remove(vtab->hooks, &vtab->listener);
+  }
+  sqlite3_finalize(vtab->version_stmt);
+  sqlite3_finalize(vtab->scan_stmt);
+  sqlite3_finalize(vtab->rowid_stmt);
+  sqlite3_finalize(vtab->series_stmt);
+  last_vtab_clear(vtab, &vtab->overlay);
+  last_vtab_clear(vtab, &vtab->committed);
+  last_vtab_collect(vtab);
+  sqlite3_free(vtab->pending);
+  sqlite3_free(vtab->schema);
+  sqlite3_free(vtab->table);
+  sqlite3_free(vtab->series_column);
+  sqlite3_free(vtab->ts_column);
+  sqlite3_free(vtab->value_column);
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+// CREATE VIRTUAL TABLE name USING tslite_last(table [, series [, ts [,
+// value]]]), the column names default to series, ts and value.
+static int last_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                             const char *const *argv, sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+  if (argc < 4 || argc > 7) {
+    *pzErr = sqlite3_mprintf(
+        "usage: tslite_last(table [, series [, ts [, value]]])");
+    return SQLITE_ERROR;
+  }
+
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(series, ts, value)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  last_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+  vtab->schema = sqlite3_mprintf("%s", argv[1]);
+  vtab->table = vtab_dequote(argv[3]);
+  vtab->series_column = vtab_dequote(argc > 4 ? argv[4] : "series");
+  vtab->ts_column = vtab_dequote(argc > 5 ? argv[5] : "ts");
+  vtab->value_column = vtab_dequote(argc > 6 ? argv[6] : "value");
+  if (!vtab->schema || !vtab->table || !vtab->series_column ||
+      !vtab->ts_column || !vtab->value_column) {
+    last_vtab_disconnect(&vtab->base);
+    *ppVtab = NULL;
+    return SQLITE_NOMEM;
+  }
+
+  vtab->hooks = (tslite_hooks *)pAux;
+  vtab->listener.arg = vtab;
+  vtab->listener.xUpdate = last_vtab_update_hook;
+  vtab->listener.xCommit = last_vtab_commit_hook;
+  vtab->listener.xRollback = last_vtab_rollback_hook;
+  tslite_hooks_add(vtab->hooks, &vtab->listener);
+  return SQLITE_OK;
+}
+
+static int last_vtab_open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  last_vtab_cursor *cursor;
+  cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  ((last_vtab *)p)->cursors++;
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static int last_vtab_close(sqlite3_vtab_cursor *cur) {
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  last_vtab *vtab = (last_vtab *)cursor->base.pVtab;
+  sqlite3_free(cursor->rows);
+  sqlite3_free(cursor);
+  if (--vtab->cursors == 0) {
+    last_vtab_collect(vtab);
+  }
+  return SQLITE_OK;
+}
+
+static int last_vtab_next(sqlite3_vtab_cursor *cur) {
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  cursor->i++;
+  return SQLITE_OK;
+}
+
+static int last_vtab_eof(sqlite3_vtab_cursor *cur) {
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  return cursor->i >= cursor->n;
+}
+
+static int last_vtab_column(sqlite3_vtab_cursor *cur,
+                            sqlite3_context *context, int i) {
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  last_entry *e = cursor->rows[cursor->i];
+  switch (i) {
+    case LAST_VTAB_SERIES:
+      sqlite3_result_value(context, e->series);
+      break;
+    case LAST_VTAB_TS:
+      sqlite3_result_int64(context, e->ts);
+      break;
+    case LAST_VTAB_VALUE:
+      sqlite3_result_value(context, e->value);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+// The rowid is the rowid of the row in the source table.
+static int last_vtab_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  *pRowid = cursor->rows[cursor->i]->rowid;
+  return SQLITE_OK;
+}
+
+// Snapshot the entries to return, so a read in between (a self join) can't
+// move them around under the cursor. Replaced entries stay allocated until
+// the last cursor closes.
+static int last_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                            const char *idxStr, int argc,
+                            sqlite3_value **argv) {
+  UNUSED(idxStr);
+  UNUSED(argc);
+
+  last_vtab_cursor *cursor = (last_vtab_cursor *)cur;
+  last_vtab *vtab = (last_vtab *)cursor->base.pVtab;
+  sqlite3_free(cursor->rows);
+  cursor->rows = NULL;
+  cursor->n = cursor->i = 0;
+  if (vtab->cursors == 1) {
+    last_vtab_collect(vtab);
+  }
+
+  int rc = last_vtab_sync(vtab);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (idxNum & LAST_IDX_SERIES) {
+    last_entry *e = last_vtab_get(vtab, argv[0], last_hash(argv[0]));
+    if (e) {
+      cursor->rows = sqlite3_malloc(sizeof(last_entry *));
+      if (!cursor->rows) {
+        return SQLITE_NOMEM;
+      }
+      cursor->rows[0] = e;
+      cursor->n = 1;
+    }
+    return SQLITE_OK;
+  }
+
+  int n = vtab->committed.count + vtab->overlay.count;
+  cursor->rows = sqlite3_malloc64((n ? n : 1) * sizeof(last_entry *));
+  if (!cursor->rows) {
+    return SQLITE_NOMEM;
+  }
+  for (int k = 0; k < vtab->committed.n_slots; k++) {
+    for (last_entry *e = vtab->committed.slots[k]; e; e = e->next) {
+      if (!last_map_find(&vtab->overlay, e->series, e->hash)) {
+        cursor->rows[cursor->n++] = e;
+      }
+    }
+  }
+  for (int k = 0; k < vtab->overlay.n_slots; k++) {
+    for (last_entry *e = vtab->overlay.slots[k]; e; e = e->next) {
+      if (!e->deleted) {
+        cursor->rows[cursor->n++] = e;
+      }
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int last_vtab_best_index(sqlite3_vtab *pVtab,
+                                sqlite3_index_info *pIdxInfo) {
+  last_vtab *vtab = (last_vtab *)pVtab;
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    if (constraint->usable && constraint->iColumn == LAST_VTAB_SERIES &&
+        constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      pIdxInfo->idxNum = LAST_IDX_SERIES;
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      pIdxInfo->estimatedCost = 1.0;
+      pIdxInfo->estimatedRows = 1;
+      pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+      return SQLITE_OK;
+    }
+  }
+
+  int n = vtab->committed.count;
+  pIdxInfo->estimatedCost = n > 0 ? (double)n : 1000.0;
+  pIdxInfo->estimatedRows = n > 0 ? n : 1000;
+  return SQLITE_OK;
+}
+
+sqlite3_module last_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ last_vtab_connect,
+    /* xConnect    */ last_vtab_connect,
+    /* xBestIndex  */ last_vtab_best_index,
+    /* xDisconnect */ last_vtab_disconnect,
+    /* xDestroy    */ last_vtab_disconnect,
+    /* xOpen       */ last_vtab_open,
+    /* xClose      */ last_vtab_close,
+    /* xFilter     */ last_vtab_filter,
+    /* xNext       */ last_vtab_next,
+    /* xEof        */ last_vtab_eof,
+    /* xColumn     */ last_vtab_column,
+    /* xRowid      */ last_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
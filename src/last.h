@@ -0,0 +1,68 @@
+#ifndef TSLITE_LAST_H
+#define TSLITE_LAST_H
+
+#include "hooks.h"
+#include "tslite.h"
+#include "vtab.h"
+
+// Latest row of a series. In the overlay a deleted entry hides the series
+// in the base map.
+typedef struct last_entry {
+  sqlite3_value *series;
+  sqlite3_value *value;
+  sqlite3_int64 ts;
+  sqlite3_int64 rowid;
+  unsigned int hash;
+  int deleted;
+  struct last_entry *next;
+  struct last_entry *next_rowid;
+} last_entry;
+
+// Hash map of series to entries, with a second index on the source rowid.
+typedef struct {
+  last_entry **slots;
+  last_entry **rowid_slots;
+  int n_slots;
+  int count;
+} last_map;
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  char *schema;
+  char *table;
+  char *series_column;
+  char *ts_column;
+  char *value_column;
+
+  sqlite3_stmt *version_stmt;
+  sqlite3_stmt *scan_stmt;
+  sqlite3_stmt *rowid_stmt;
+  sqlite3_stmt *series_stmt;
+
+  // Committed state, and the changes of the open write transaction on top.
+  last_map committed;
+  last_map overlay;
+  int warm;
+  sqlite3_int64 data_version;
+
+  // Source rowids changed since the last read, the first n_committed of
+  // them by transactions that committed since.
+  tslite_hooks *hooks;
+  tslite_hooks_listener listener;
+  tslite_hooks_mark mark;
+  sqlite3_int64 *pending;
+  int n_pending, n_committed, cap_pending;
+
+  // Entries replaced while cursors may still point at them.
+  last_entry *garbage;
+  int cursors;
+} last_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  last_entry **rows;
+  int n, i;
+} last_vtab_cursor;
+
+#endif  // TSLITE_LAST_H
@@ -0,0 +1,288 @@
+#include "regression.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "array_buffer.h"
+
+#define REGR_STATE_LENGTH 6
+
+// Move the origin of sum, the sum of n values relative to *origin, to their
+// mean. The mean only rounds to the values' precision, while the sum relative
+// to a far away origin loses precision to the distance.
+static void regr_rebase(kahan_sum *sum, double *origin, sqlite3_int64 n) {
+  double mean = *origin + kahan_value(sum) / (double)n;
+  kahan_add(sum, -(double)n * (mean - *origin));
+  *origin = mean;
+}
+
+// Add (sign 1) or remove (sign -1) the pairs summarized by b. Removing is
+// Chan's formula solved for the other operand, so xInverse and merging
+// share the same arithmetic.
+static void regr_combine(regr_state *s, const regr_moments *b, int sign) {
+  if (!b->n) {
+    return;
+  }
+  sqlite3_int64 rest = s->n - b->n;
+  if (sign < 0 && rest <= 0) {
+    // Empty frame, start over exactly.
+    memset(s, 0, offsetof(regr_state, at));
+    return;
+  }
+
+  if (!s->n) {
+    s->x0 = b->mean_x;
+    s->y0 = b->mean_y;
+  }
+  double bx = b->mean_x - s->x0;
+  double by = b->mean_y - s->y0;
+
+  // Deviations of b's means from those of the other operand: s before
+  // adding, what is left of s after removing.
+  double n = (double)(sign > 0 ? s->n + b->n : s->n);
+  double other = (double)(sign > 0 ? s->n : rest);
+  kahan_sum x = s->x, y = s->y;
+  if (sign < 0) {
+    kahan_add(&x, -(double)b->n * bx);
+    kahan_add(&y, -(double)b->n * by);
+  }
+  double dx = other ? bx - kahan_value(&x) / other : 0.0;
+  double dy = other ? by - kahan_value(&y) / other : 0.0;
+  double f = other * (double)b->n / n;
+
+  kahan_add(&s->x, sign * (double)b->n * bx);
+  kahan_add(&s->y, sign * (double)b->n * by);
+  kahan_add(&s->sxx, sign * (b->sxx + dx * dx * f));
+  kahan_add(&s->syy, sign * (b->syy + dy * dy * f));
+  kahan_add(&s->sxy, sign * (b->sxy + dx * dy * f));
+  s->n += sign * b->n;
+  if (s->n == 1) {
+    // A single pair has no deviations, drop the rounding left over.
+    memset(&s->sxx, 0, sizeof(s->sxx));
+    memset(&s->syy, 0, sizeof(s->syy));
+    memset(&s->sxy, 0, sizeof(s->sxy));
+  }
+  if (sign < 0) {
+    // Follow a sliding frame, the first pair may be long gone.
+    regr_rebase(&s->x, &s->x0, s->n);
+    regr_rebase(&s->y, &s->y0, s->n);
+  }
+}
+
+// The moments of the pairs in s.
+static void regr_moments_get(const regr_state *s, regr_moments *m) {
+  m->n = s->n;
+  m->mean_x = s->x0 + kahan_value(&s->x) / (double)s->n;
+  m->mean_y = s->y0 + kahan_value(&s->y) / (double)s->n;
+  m->sxx = fmax(kahan_value(&s->sxx), 0.0);
+  m->syy = fmax(kahan_value(&s->syy), 0.0);
+  m->sxy = kahan_value(&s->sxy);
+}
+
+// Pairs with a NULL on either side are skipped, like SQL's regr_* functions.
+static void regr_update(sqlite3_context *context, int argc,
+                        sqlite3_value **argv, int sign) {
+  regr_state *s = sqlite3_aggregate_context(context, sizeof(regr_state));
+  if (!s) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (argc > 2) {
+    s->at = sqlite3_value_double(argv[2]);
+  }
+  if (sqlite3_value_numeric_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_numeric_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+
+  regr_moments pair;
+  memset(&pair, 0, sizeof(pair));
+  pair.n = 1;
+  pair.mean_y = sqlite3_value_double(argv[0]);
+  pair.mean_x = sqlite3_value_double(argv[1]);
+  regr_combine(s, &pair, sign);
+}
+
+void regr_step_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  regr_update(context, argc, argv, 1);
+}
+
+void regr_inverse_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  regr_update(context, argc, argv, -1);
+}
+
+static double regr_state_number(const array_value *v) {
+  return v->type == SQLITE_INTEGER ? (double)v->i : v->f;
+}
+
+// States are arrays of n, mean_x, mean_y, sxx, syy and sxy, as returned by
+// regr_state.
+static int regr_state_decode(sqlite3_value *arg, regr_moments *m) {
+  int n = sqlite3_value_bytes(arg);
+  const unsigned char *z = sqlite3_value_blob(arg);
+  array_iter it;
+  array_value v[REGR_STATE_LENGTH], end;
+  array_iter_init(&it, z, n);
+  for (int i = 0; i < REGR_STATE_LENGTH; i++) {
+    if (array_iter_next(&it, &v[i]) != 1 ||
+        (v[i].type != SQLITE_INTEGER && v[i].type != SQLITE_FLOAT)) {
+      return SQLITE_ERROR;
+    }
+  }
+  if (array_iter_next(&it, &end) != 0 || v[0].type != SQLITE_INTEGER ||
+      v[0].i < 0) {
+    return SQLITE_ERROR;
+  }
+  m->n = v[0].i;
+  m->mean_x = regr_state_number(&v[1]);
+  m->mean_y = regr_state_number(&v[2]);
+  m->sxx = regr_state_number(&v[3]);
+  m->syy = regr_state_number(&v[4]);
+  m->sxy = regr_state_number(&v[5]);
+  return SQLITE_OK;
+}
+
+static void regr_merge_update(sqlite3_context *context, int argc,
+                              sqlite3_value **argv, int sign) {
+  regr_state *s = sqlite3_aggregate_context(context, sizeof(regr_state));
+  if (!s) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (argc > 1) {
+    s->at = sqlite3_value_double(argv[1]);
+  }
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    return;
+  }
+
+  regr_moments m;
+  if (regr_state_decode(argv[0], &m)) {
+    sqlite3_result_error(context, "invalid regression state", -1);
+    return;
+  }
+  regr_combine(s, &m, sign);
+}
+
+void regr_merge_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  regr_merge_update(context, argc, argv, 1);
+}
+
+void regr_merge_inverse_func(sqlite3_context *context, int argc,
+                             sqlite3_value **argv) {
+  regr_merge_update(context, argc, argv, -1);
+}
+
+// The state of the group and its moments in m, or NULL (with a NULL result)
+// if it has no pairs or, if need_sxx, all x are equal.
+static const regr_state *regr_get(sqlite3_context *context, int need_sxx,
+                                  regr_moments *m) {
+  const regr_state *s = sqlite3_aggregate_context(context, 0);
+  if (!s || !s->n) {
+    sqlite3_result_null(context);
+    return NULL;
+  }
+  regr_moments_get(s, m);
+  if (need_sxx && m->sxx == 0.0) {
+    sqlite3_result_null(context);
+    return NULL;
+  }
+  return s;
+}
+
+void regr_slope_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 1, &m);
+  if (s) {
+    sqlite3_result_double(context, m.sxy / m.sxx);
+  }
+}
+
+void regr_intercept_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 1, &m);
+  if (s) {
+    sqlite3_result_double(context, m.mean_y - m.sxy / m.sxx * m.mean_x);
+  }
+}
+
+void regr_r2_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 1, &m);
+  if (!s) {
+    return;
+  }
+  if (m.syy == 0.0) {
+    // A horizontal line fits perfectly.
+    sqlite3_result_double(context, 1.0);
+  } else {
+    sqlite3_result_double(context, m.sxy * m.sxy / (m.sxx * m.syy));
+  }
+}
+
+void corr_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 1, &m);
+  if (!s) {
+    return;
+  }
+  if (m.syy == 0.0) {
+    sqlite3_result_null(context);
+  } else {
+    sqlite3_result_double(context, m.sxy / sqrt(m.sxx * m.syy));
+  }
+}
+
+void covar_pop_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 0, &m);
+  if (s) {
+    sqlite3_result_double(context, m.sxy / (double)m.n);
+  }
+}
+
+// The value of the fitted line at at_ts, evaluated around the mean so a far
+// away at_ts doesn't amplify the rounding of the intercept.
+void predict_linear_value_func(sqlite3_context *context) {
+  regr_moments m;
+  const regr_state *s = regr_get(context, 1, &m);
+  if (s) {
+    sqlite3_result_double(context,
+                          m.mean_y + m.sxy / m.sxx * (s->at - m.mean_x));
+  }
+}
+
+void regr_state_value_func(sqlite3_context *context) {
+  const regr_state *s = sqlite3_aggregate_context(context, 0);
+  if (!s || !s->n) {
+    sqlite3_result_null(context);
+    return;
+  }
+  regr_moments m;
+  regr_moments_get(s, &m);
+
+  array_value v[REGR_STATE_LENGTH];
+  memset(v, 0, sizeof(v));
+  v[0].type = SQLITE_INTEGER;
+  v[0].i = m.n;
+  double f[REGR_STATE_LENGTH - 1] = {m.mean_x, m.mean_y, m.sxx, m.syy,
+                                     m.sxy};
+  for (int i = 1; i < REGR_STATE_LENGTH; i++) {
+    v[i].type = SQLITE_FLOAT;
+    v[i].f = f[i - 1];
+  }
+
+  array_buffer buf = {NULL, 0, 0};
+  for (int i = 0; i < REGR_STATE_LENGTH; i++) {
+    if (array_buffer_append_element(&buf, &v[i])) {
+      sqlite3_free(buf.buf);
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+  sqlite3_result_blob(context, buf.buf, buf.len, SQLITE_TRANSIENT);
+  sqlite3_free(buf.buf);
+}
@@ -0,0 +1,53 @@
+#ifndef TSLITE_REGRESSION_H
+#define TSLITE_REGRESSION_H
+
+#include "kahan.h"
+#include "tslite.h"
+
+// Count, means and sums of squared and cross deviations from the means of
+// (x, y) pairs, combined with Chan's formula so neither loses precision to
+// large offsets like unix timestamps.
+typedef struct {
+  sqlite3_int64 n;
+  double mean_x;
+  double mean_y;
+  double sxx;
+  double syy;
+  double sxy;
+} regr_moments;
+
+// The moments of the pairs seen so far. The means are kept as sums relative
+// to an origin (x0, y0), which starts at the first pair and moves to the
+// current means whenever pairs are removed, so it follows a sliding frame.
+// All sums are compensated, so removing pairs in a sliding window (xInverse)
+// cancels adding them instead of accumulating rounding.
+typedef struct {
+  sqlite3_int64 n;
+  double x0;
+  double y0;
+  kahan_sum x;
+  kahan_sum y;
+  kahan_sum sxx;
+  kahan_sum syy;
+  kahan_sum sxy;
+  // The at_ts argument of predict_linear.
+  double at;
+} regr_state;
+
+void regr_step_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void regr_inverse_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv);
+void regr_merge_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+void regr_merge_inverse_func(sqlite3_context *context, int argc,
+                             sqlite3_value **argv);
+
+void regr_slope_value_func(sqlite3_context *context);
+void regr_intercept_value_func(sqlite3_context *context);
+void regr_r2_value_func(sqlite3_context *context);
+void corr_value_func(sqlite3_context *context);
+void covar_pop_value_func(sqlite3_context *context);
+void predict_linear_value_func(sqlite3_context *context);
+void regr_state_value_func(sqlite3_context *context);
+
+#endif  // TSLITE_REGRESSION_H
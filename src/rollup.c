@@ -0,0 +1,292 @@
+#include "rollup.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROLLUP_MAX_THREADS 256
+
+typedef struct {
+  sqlite3_int64 bucket;
+  sqlite3_value *value;
+} rollup_row;
+
+typedef struct {
+  // Input, set before the thread starts.
+  const char *filename;
+  const char *sql;
+  sqlite3_int64 width;
+  sqlite3_int64 from, to;
+
+  // Output, owned by the worker until it is joined.
+  rollup_row *rows;
+  int len, cap;
+  int rc;
+  char *err;
+} rollup_worker;
+
+static void rollup_worker_free(rollup_worker *w) {
+  for (int i = 0; i < w->len; i++) {
+    sqlite3_value_free(w->rows[i].value);
+  }
+  sqlite3_free(w->rows);
+  sqlite3_free(w->err);
+}
+
+static int rollup_worker_push(rollup_worker *w, sqlite3_int64 bucket,
+                              sqlite3_value *value) {
+  if (w->len == w->cap) {
+    int cap = w->cap ? w->cap * 2 : 256;
+    rollup_row *rows = sqlite3_realloc(w->rows, cap * sizeof(rollup_row));
+    if (!rows) {
+      return SQLITE_NOMEM;
+    }
+    w->rows = rows;
+    w->cap = cap;
+  }
+  sqlite3_value *dup = sqlite3_value_dup(value);
+  if (!dup) {
+    return SQLITE_NOMEM;
+  }
+  w->rows[w->len].bucket = bucket;
+  w->rows[w->len].value = dup;
+  w->len++;
+  return SQLITE_OK;
+}
+
+// Aggregate one partition on a private read-only connection.
+static void *rollup_worker_main(void *arg) {
+  rollup_worker *w = (rollup_worker *)arg;
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+
+  w->rc = sqlite3_open_v2(w->filename, &db,
+                          SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+  if (w->rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_busy_timeout(db, 5000);
+
+  // The aggregate may be one of ours, so the worker connection needs the
+  // extension functions too.
+  w->rc = sqlite3_tslite_init(db, NULL, sqlite3_api);
+  if (w->rc != SQLITE_OK) {
+    goto done;
+  }
+
+  w->rc = sqlite3_prepare_v2(db, w->sql, -1, &stmt, NULL);
+  if (w->rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_bind_int64(stmt, 1, w->width);
+  sqlite3_bind_int64(stmt, 2, w->from);
+  sqlite3_bind_int64(stmt, 3, w->to);
+
+  while ((w->rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    w->rc = rollup_worker_push(w, sqlite3_column_int64(stmt, 0),
+                               sqlite3_column_value(stmt, 1));
+    if (w->rc != SQLITE_OK) {
+      goto done;
+    }
+  }
+  if (w->rc == SQLITE_DONE) {
+    w->rc = SQLITE_OK;
+  }
+
+done:
+  if (w->rc != SQLITE_OK && db) {
+    w->err = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return NULL;
+}
+
+// Only accept plain function names for the aggregate, it is pasted into SQL.
+int rollup_valid_identifier(const unsigned char *z) {
+  if (!z || !*z) {
+    return 0;
+  }
+  for (; *z; z++) {
+    if (!((*z >= 'a' && *z <= 'z') || (*z >= 'A' && *z <= 'Z') ||
+          (*z >= '0' && *z <= '9') || *z == '_')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Split [from, to) into nthreads partitions. Partition boundaries are always
+// positive multiples of width, which time_bucket never puts in the middle of
+// a bucket, so every bucket is aggregated by exactly one worker.
+static void rollup_partition(sqlite3_int64 width, sqlite3_int64 from,
+                             sqlite3_int64 to, int nthreads,
+                             sqlite3_int64 *bounds) {
+  sqlite3_int64 kmin = from / width + 1;
+  if (kmin < 1) {
+    kmin = 1;
+  }
+  sqlite3_int64 kmax = (to - 1) / width;
+  sqlite3_int64 nb = kmax - kmin + 1;
+
+  bounds[0] = from;
+  bounds[nthreads] = to;
+  for (int i = 1; i < nthreads; i++) {
+    if (nb <= 0) {
+      bounds[i] = to;
+      continue;
+    }
+    sqlite3_int64 k = kmin + (sqlite3_int64)((double)nb * i / nthreads);
+    bounds[i] = k <= kmax ? k * width : to;
+  }
+}
+
+void parallel_rollup_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+
+  const char *src = (const char *)sqlite3_value_text(argv[0]);
+  const char *dst = (const char *)sqlite3_value_text(argv[1]);
+  sqlite3_int64 width = sqlite3_value_int64(argv[2]);
+  const unsigned char *agg = sqlite3_value_text(argv[3]);
+  sqlite3_int64 from = sqlite3_value_int64(argv[4]);
+  sqlite3_int64 to = sqlite3_value_int64(argv[5]);
+  int nthreads;
+  if (argc > 6) {
+    nthreads = sqlite3_value_int(argv[6]);
+  } else {
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  if (!src || !dst) {
+    sqlite3_result_error(context, "invalid table name", -1);
+    return;
+  }
+  if (width < 1) {
+    sqlite3_result_error(context, "invalid bucket width", -1);
+    return;
+  }
+  if (!rollup_valid_identifier(agg)) {
+    sqlite3_result_error(context, "invalid aggregate function", -1);
+    return;
+  }
+  if (from >= to) {
+    sqlite3_result_int(context, 0);
+    return;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  } else if (nthreads > ROLLUP_MAX_THREADS) {
+    nthreads = ROLLUP_MAX_THREADS;
+  }
+
+  // Workers read through their own connections, so they need a database file
+  // to open. They see the last committed state of the database.
+  const char *filename = sqlite3_db_filename(db, "main");
+  if (!filename || !*filename) {
+    sqlite3_result_error(context, "parallel rollup requires a file database",
+                         -1);
+    return;
+  }
+
+  char *sql = sqlite3_mprintf(
+      "SELECT time_bucket(?1, ts) AS bucket, %s(value) FROM \"%w\" "
+      "WHERE ts >= ?2 AND ts < ?3 GROUP BY bucket ORDER BY bucket",
+      agg, src);
+  char *insert_sql =
+      sqlite3_mprintf("INSERT INTO \"%w\" (ts, value) VALUES (?1, ?2)", dst);
+  rollup_worker *workers = sqlite3_malloc(nthreads * sizeof(rollup_worker));
+  pthread_t *threads = sqlite3_malloc(nthreads * sizeof(pthread_t));
+  sqlite3_int64 *bounds =
+      sqlite3_malloc((nthreads + 1) * sizeof(sqlite3_int64));
+  sqlite3_stmt *insert = NULL;
+  int started = 0;
+  sqlite3_int64 written = 0;
+  int rc;
+
+  if (!sql || !insert_sql || !workers || !threads || !bounds) {
+    sqlite3_result_error_nomem(context);
+    goto done;
+  }
+  memset(workers, 0, nthreads * sizeof(rollup_worker));
+
+  rollup_partition(width, from, to, nthreads, bounds);
+  for (int i = 0; i < nthreads; i++) {
+    rollup_worker *w = &workers[i];
+    w->filename = filename;
+    w->sql = sql;
+    w->width = width;
+    w->from = bounds[i];
+    w->to = bounds[i + 1];
+    if (w->from >= w->to) {
+      continue;
+    }
+    if (pthread_create(&threads[i], NULL, rollup_worker_main, w)) {
+      w->rc = SQLITE_ERROR;
+      w->err = sqlite3_mprintf("could not start worker thread");
+      break;
+    }
+    started = i + 1;
+  }
+  for (int i = 0; i < started; i++) {
+    if (workers[i].from < workers[i].to) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    if (workers[i].rc != SQLITE_OK) {
+      const char *err = workers[i].err;
+      sqlite3_result_error(context, err ? err : sqlite3_errstr(workers[i].rc),
+                           -1);
+      goto done;
+    }
+  }
+
+  // Single writer: merge the partitions in order on the calling connection.
+  rc = sqlite3_prepare_v2(db, insert_sql, -1, &insert, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    goto done;
+  }
+  rc = sqlite3_exec(db, "SAVEPOINT tslite_parallel_rollup", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    goto done;
+  }
+  for (int i = 0; i < nthreads && rc == SQLITE_OK; i++) {
+    rollup_worker *w = &workers[i];
+    for (int j = 0; j < w->len; j++) {
+      sqlite3_bind_int64(insert, 1, w->rows[j].bucket);
+      sqlite3_bind_value(insert, 2, w->rows[j].value);
+      rc = sqlite3_step(insert);
+      sqlite3_reset(insert);
+      if (rc != SQLITE_DONE) {
+        break;
+      }
+      rc = SQLITE_OK;
+      written++;
+    }
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    sqlite3_exec(db, "ROLLBACK TO tslite_parallel_rollup", NULL, NULL, NULL);
+    sqlite3_exec(db, "RELEASE tslite_parallel_rollup", NULL, NULL, NULL);
+    goto done;
+  }
+  sqlite3_exec(db, "RELEASE tslite_parallel_rollup", NULL, NULL, NULL);
+  sqlite3_result_int64(context, written);
+
+done:
+  sqlite3_finalize(insert);
+  if (workers) {
+    for (int i = 0; i < nthreads; i++) {
+      rollup_worker_free(&workers[i]);
+    }
+  }
+  sqlite3_free(bounds);
+  sqlite3_free(threads);
+  sqlite3_free(workers);
+  sqlite3_free(insert_sql);
+  sqlite3_free(sql);
+}
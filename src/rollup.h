@@ -0,0 +1,11 @@
+#ifndef TSLITE_ROLLUP_H
+#define TSLITE_ROLLUP_H
+
+#include "tslite.h"
+
+int rollup_valid_identifier(const unsigned char *z);
+
+void parallel_rollup_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+
+#endif  // TSLITE_ROLLUP_H
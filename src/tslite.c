@@ -4,7 +4,16 @@
 
 #include <stddef.h>
 
+#include "archive.h"
 #include "array.h"
+#include "array_math.h"
+#include "calendar.h"
+#include "first_last.h"
+#include "histogram.h"
+#include "hooks.h"
+#include "regression.h"
+#include "rollup.h"
+#include "window.h"
 
 static void interval_func(sqlite3_context *context, int argc,
                           sqlite3_value **argv) {
@@ -55,16 +64,21 @@ static void interval_func(sqlite3_context *context, int argc,
 
 static void time_bucket_func(sqlite3_context *context, int argc,
                              sqlite3_value **argv) {
-  UNUSED(argc);
-
   sqlite3_int64 width = sqlite3_value_int64(argv[0]);
   if (width < 1) {
     sqlite3_result_error(context, "invalid bucket width", -1);
     return;
   }
   sqlite3_int64 ts = sqlite3_value_int64(argv[1]);
-  sqlite3_int64 bucket = (ts / width) * width;
-  sqlite3_result_int64(context, bucket);
+  sqlite3_int64 origin = argc > 2 ? sqlite3_value_int64(argv[2]) : 0;
+
+  // Floor division, so timestamps before the origin are bucketed correctly.
+  sqlite3_int64 d = ts - origin;
+  sqlite3_int64 q = d / width;
+  if (d % width < 0) {
+    q--;
+  }
+  sqlite3_result_int64(context, q * width + origin);
 }
 
 static void lerp_func(sqlite3_context *context, int argc,
@@ -158,6 +172,26 @@ __declspec(dllexport)
     return rc;
   }
 
+  rc = sqlite3_create_function(db, "time_bucket", 3,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               time_bucket_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Not deterministic: the result depends on the installed zoneinfo. The
+  // zone cache lives as long as the function.
+  tz_cache *cache = tz_cache_new();
+  if (!cache) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_create_function_v2(db, "time_bucket_calendar", -1, SQLITE_UTF8,
+                                  cache, time_bucket_calendar_func, NULL, NULL,
+                                  tz_cache_free);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   rc =
       sqlite3_create_function(db, "lerp", 5, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
                               NULL, lerp_func, NULL, NULL);
@@ -172,6 +206,209 @@ __declspec(dllexport)
     return rc;
   }
 
+  rc = sqlite3_create_window_function(
+      db, "moving_min", 1, SQLITE_UTF8, NULL, moving_min_step_func,
+      moving_extreme_final_func, moving_extreme_value_func,
+      moving_extreme_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "moving_max", 1, SQLITE_UTF8, NULL, moving_max_step_func,
+      moving_extreme_final_func, moving_extreme_value_func,
+      moving_extreme_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "moving_sum", 1, SQLITE_UTF8, NULL, moving_sum_step_func,
+      moving_sum_value_func, moving_sum_value_func, moving_sum_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "moving_avg", 1, SQLITE_UTF8, NULL, moving_sum_step_func,
+      moving_avg_value_func, moving_avg_value_func, moving_sum_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "ewma", 3, SQLITE_UTF8, NULL, ewma_step_func, ewma_value_func,
+      ewma_value_func, ewma_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "first", 2, SQLITE_UTF8, NULL, NULL,
+                               first_step_func, first_last_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "last", 2, SQLITE_UTF8, NULL, NULL,
+                               last_step_func, first_last_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "first_state", 2, SQLITE_UTF8, NULL, NULL,
+                               first_step_func, first_last_state_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "last_state", 2, SQLITE_UTF8, NULL, NULL,
+                               last_step_func, first_last_state_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "first_merge", 1, SQLITE_UTF8, NULL, NULL,
+                               first_merge_step_func,
+                               first_last_state_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "last_merge", 1, SQLITE_UTF8, NULL, NULL,
+                               last_merge_step_func,
+                               first_last_state_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "histogram", 4, SQLITE_UTF8, NULL, NULL,
+                               histogram_step_func, histogram_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "histogram_loglinear", 4, SQLITE_UTF8,
+                               NULL, NULL, histogram_loglinear_step_func,
+                               histogram_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "histogram_merge", 1, SQLITE_UTF8, NULL,
+                               NULL, histogram_merge_step_func,
+                               histogram_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_slope", 2, SQLITE_UTF8, NULL, regr_step_func,
+      regr_slope_value_func, regr_slope_value_func, regr_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_intercept", 2, SQLITE_UTF8, NULL, regr_step_func,
+      regr_intercept_value_func, regr_intercept_value_func, regr_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_r2", 2, SQLITE_UTF8, NULL, regr_step_func, regr_r2_value_func,
+      regr_r2_value_func, regr_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "corr", 2, SQLITE_UTF8, NULL, regr_step_func, corr_value_func,
+      corr_value_func, regr_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "covar_pop", 2, SQLITE_UTF8, NULL, regr_step_func,
+      covar_pop_value_func, covar_pop_value_func, regr_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_state", 2, SQLITE_UTF8, NULL, regr_step_func,
+      regr_state_value_func, regr_state_value_func, regr_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "predict_linear", 3, SQLITE_UTF8, NULL, regr_step_func,
+      predict_linear_value_func, predict_linear_value_func, regr_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // The same aggregates over states from regr_state, for rollup tiers.
+  rc = sqlite3_create_window_function(
+      db, "regr_slope", 1, SQLITE_UTF8, NULL, regr_merge_step_func,
+      regr_slope_value_func, regr_slope_value_func, regr_merge_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_intercept", 1, SQLITE_UTF8, NULL, regr_merge_step_func,
+      regr_intercept_value_func, regr_intercept_value_func,
+      regr_merge_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_r2", 1, SQLITE_UTF8, NULL, regr_merge_step_func,
+      regr_r2_value_func, regr_r2_value_func, regr_merge_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "corr", 1, SQLITE_UTF8, NULL, regr_merge_step_func, corr_value_func,
+      corr_value_func, regr_merge_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "covar_pop", 1, SQLITE_UTF8, NULL, regr_merge_step_func,
+      covar_pop_value_func, covar_pop_value_func, regr_merge_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "regr_merge", 1, SQLITE_UTF8, NULL, regr_merge_step_func,
+      regr_state_value_func, regr_state_value_func, regr_merge_inverse_func,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_window_function(
+      db, "predict_linear", 2, SQLITE_UTF8, NULL, regr_merge_step_func,
+      predict_linear_value_func, predict_linear_value_func,
+      regr_merge_inverse_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   rc = sqlite3_create_function(db, "array", -1,
                                SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
                                array_func, NULL, NULL);
@@ -200,14 +437,276 @@ __declspec(dllexport)
     return rc;
   }
 
+  rc = sqlite3_create_function(db, "array_slice", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_slice_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_slice", 3,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_slice_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Like min and max: with one argument array_concat is an aggregate, with
+  // more it concatenates its arguments.
+  rc = sqlite3_create_function(db, "array_concat", -1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_concat_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_concat", 1, SQLITE_UTF8, NULL, NULL,
+                               array_concat_step_func, array_concat_final_func);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_compress", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_compress_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_decompress", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_decompress_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_resample", 5,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_resample_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_resample", 6,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_resample_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_add", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_add_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_sub", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_sub_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_mul", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_mul_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_div", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_div_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_abs", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_abs_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_clamp", 3,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_clamp_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_eq", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_eq_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_ne", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_ne_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_lt", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_lt_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_le", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_le_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_gt", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_gt_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_ge", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_ge_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_filter", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_filter_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_sort", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_sort_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_argsort", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_argsort_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_take", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_take_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_dedupe_sorted", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_dedupe_sorted_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_dedupe_sorted", 2,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_dedupe_sorted_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "array_dedupe_sorted", 3,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               array_dedupe_sorted_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   rc = sqlite3_create_module(db, "array_each", &array_each_module, NULL);
   if (rc != SQLITE_OK) {
     return rc;
   }
 
+  rc = sqlite3_create_module(db, "array_each_stream", &array_each_stream_module,
+                             NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module(db, "arrays_zip", &arrays_zip_module, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module(db, "asof_join", &asof_join_module, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module(db, "tslite_zonemap", &zonemap_module, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module(db, "tslite_archive", &archive_module, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module(db, "tslite_buffer", &write_buffer_module, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // The caches follow changes through the hooks dispatcher of the connection.
+  tslite_hooks *hooks = tslite_hooks_new(db);
+  if (!hooks) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_create_module_v2(db, "tslite_last", &last_module, hooks,
+                                tslite_hooks_unref);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  tslite_hooks_ref(hooks);
+  rc = sqlite3_create_module_v2(db, "tslite_cached_rollup",
+                                &cached_rollup_module, hooks,
+                                tslite_hooks_unref);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   rc = sqlite3_create_window_function(
       db, "array_agg", -1, SQLITE_UTF8, NULL, array_agg_step_func,
       array_agg_final_func, array_agg_value_func, array_agg_step_func, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Writes a file, so it can't be called from triggers or views.
+  rc = sqlite3_create_function(db, "tslite_archive_write", 2,
+                               SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL,
+                               archive_write_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "tslite_parallel_rollup", 6,
+                               SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL,
+                               parallel_rollup_func, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_function(db, "tslite_parallel_rollup", 7,
+                               SQLITE_UTF8 | SQLITE_DIRECTONLY, NULL,
+                               parallel_rollup_func, NULL, NULL);
 
   return rc;
 }
@@ -5,11 +5,22 @@
 
 #ifdef TSLITE_MAIN
 SQLITE_EXTENSION_INIT1
+extern sqlite3_module archive_module;
 extern sqlite3_module array_each_module;
+extern sqlite3_module array_each_stream_module;
+extern sqlite3_module arrays_zip_module;
+extern sqlite3_module asof_join_module;
+extern sqlite3_module cached_rollup_module;
+extern sqlite3_module last_module;
+extern sqlite3_module write_buffer_module;
+extern sqlite3_module zonemap_module;
 #else
 SQLITE_EXTENSION_INIT3
 #endif
 
 #define UNUSED(x) (void)(x)
 
+int sqlite3_tslite_init(sqlite3 *db, char **pzErrMsg,
+                        const sqlite3_api_routines *pApi);
+
 #endif  // TSLITE_TSLITE_H
@@ -0,0 +1,210 @@
+#include "tslite_array.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "array_buffer.h"
+
+_Static_assert(sizeof(array_iter) <= sizeof(tslite_array_iter),
+               "tslite_array_iter too small for array_iter");
+
+void tslite_array_builder_init(tslite_array_builder *b) {
+  memset(b, 0, sizeof(*b));
+}
+
+void tslite_array_builder_free(tslite_array_builder *b) {
+  free(b->buf);
+  memset(b, 0, sizeof(*b));
+}
+
+// Make room for n more bytes. Arrays are SQLite blobs, so they are limited
+// to INT_MAX bytes.
+static int tslite_array_reserve(tslite_array_builder *b, size_t n) {
+  if (b->rc != TSLITE_ARRAY_OK) {
+    return b->rc;
+  }
+  if (n > (size_t)INT_MAX - b->len) {
+    b->rc = TSLITE_ARRAY_TOOBIG;
+    return b->rc;
+  }
+  if (b->cap - b->len >= n) {
+    return TSLITE_ARRAY_OK;
+  }
+  size_t cap = b->cap ? b->cap * 2 : 256;
+  while (cap - b->len < n) {
+    cap *= 2;
+  }
+  unsigned char *buf = realloc(b->buf, cap);
+  if (!buf) {
+    b->rc = TSLITE_ARRAY_NOMEM;
+    return b->rc;
+  }
+  b->buf = buf;
+  b->cap = cap;
+  return TSLITE_ARRAY_OK;
+}
+
+// Encode an integer like array() does, at most 10 bytes.
+static size_t tslite_array_put_i64(unsigned char *p, int64_t v) {
+  if (v == 0) {
+    p[0] = ARRAY_TYPE_ZERO;
+    return 1;
+  }
+  if (v == 1) {
+    p[0] = ARRAY_TYPE_ONE;
+    return 1;
+  }
+  if (v < 0) {
+    p[0] = ARRAY_TYPE_INTEGER_NEG;
+    return 1 + put_varint64(&p[1], -(sqlite3_uint64)v);
+  }
+  p[0] = ARRAY_TYPE_INTEGER;
+  return 1 + put_varint64(&p[1], (sqlite3_uint64)v);
+}
+
+static void tslite_array_put_f64(unsigned char *p, double v) {
+  double_rep value;
+  value.f = v;
+  p[0] = ARRAY_TYPE_FLOAT;
+  put_u64(&p[1], value.d);
+}
+
+int tslite_array_append_null(tslite_array_builder *b) {
+  int rc = tslite_array_reserve(b, 1);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  b->buf[b->len++] = ARRAY_TYPE_NULL;
+  return TSLITE_ARRAY_OK;
+}
+
+int tslite_array_append_i64(tslite_array_builder *b, int64_t v) {
+  int rc = tslite_array_reserve(b, 10);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  b->len += tslite_array_put_i64(&b->buf[b->len], v);
+  return TSLITE_ARRAY_OK;
+}
+
+int tslite_array_append_f64(tslite_array_builder *b, double v) {
+  int rc = tslite_array_reserve(b, 9);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  tslite_array_put_f64(&b->buf[b->len], v);
+  b->len += 9;
+  return TSLITE_ARRAY_OK;
+}
+
+static int tslite_array_append_bytes(tslite_array_builder *b,
+                                     unsigned char type, const void *z,
+                                     int n) {
+  if (n < 0) {
+    b->rc = b->rc ? b->rc : TSLITE_ARRAY_ERROR;
+    return b->rc;
+  }
+  int rc = tslite_array_reserve(b, 10 + (size_t)n);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  b->buf[b->len++] = type;
+  b->len += put_varint64(&b->buf[b->len], (sqlite3_uint64)n);
+  if (n > 0) {
+    memcpy(&b->buf[b->len], z, n);
+    b->len += n;
+  }
+  return TSLITE_ARRAY_OK;
+}
+
+int tslite_array_append_text(tslite_array_builder *b, const char *z, int n) {
+  if (n < 0) {
+    size_t len = strlen(z);
+    if (len > INT_MAX) {
+      b->rc = b->rc ? b->rc : TSLITE_ARRAY_TOOBIG;
+      return b->rc;
+    }
+    n = (int)len;
+  }
+  return tslite_array_append_bytes(b, ARRAY_TYPE_TEXT, z, n);
+}
+
+int tslite_array_append_blob(tslite_array_builder *b, const void *z, int n) {
+  return tslite_array_append_bytes(b, ARRAY_TYPE_BLOB, z, n);
+}
+
+int tslite_array_append_i64s(tslite_array_builder *b, const int64_t *v,
+                             size_t n) {
+  if (n > (size_t)INT_MAX / 10) {
+    b->rc = b->rc ? b->rc : TSLITE_ARRAY_TOOBIG;
+    return b->rc;
+  }
+  int rc = tslite_array_reserve(b, 10 * n);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  unsigned char *p = &b->buf[b->len];
+  for (size_t k = 0; k < n; k++) {
+    p += tslite_array_put_i64(p, v[k]);
+  }
+  b->len = p - b->buf;
+  return TSLITE_ARRAY_OK;
+}
+
+int tslite_array_append_f64s(tslite_array_builder *b, const double *v,
+                             size_t n) {
+  if (n > (size_t)INT_MAX / 9) {
+    b->rc = b->rc ? b->rc : TSLITE_ARRAY_TOOBIG;
+    return b->rc;
+  }
+  int rc = tslite_array_reserve(b, 9 * n);
+  if (rc != TSLITE_ARRAY_OK) {
+    return rc;
+  }
+  unsigned char *p = &b->buf[b->len];
+  for (size_t k = 0; k < n; k++, p += 9) {
+    tslite_array_put_f64(p, v[k]);
+  }
+  b->len += 9 * n;
+  return TSLITE_ARRAY_OK;
+}
+
+int tslite_array_finish(tslite_array_builder *b, void **blob, int *n) {
+  int rc = b->rc;
+  *blob = NULL;
+  *n = 0;
+  if (rc == TSLITE_ARRAY_OK && b->len > 0) {
+    *blob = b->buf;
+    *n = (int)b->len;
+    b->buf = NULL;
+  }
+  tslite_array_builder_free(b);
+  return rc;
+}
+
+void tslite_array_iter_init(tslite_array_iter *it, const void *blob, int n) {
+  array_iter_init((array_iter *)it, blob, n);
+}
+
+int tslite_array_iter_next(tslite_array_iter *it, tslite_array_value *v) {
+  array_value value;
+  int rc = array_iter_next((array_iter *)it, &value);
+  if (rc == 1) {
+    v->type = value.type;
+    v->i = value.i;
+    v->f = value.f;
+    v->z = value.z;
+    v->n = value.n;
+  }
+  return rc;
+}
+
+int64_t tslite_array_iter_skip(tslite_array_iter *it, int64_t k) {
+  return array_iter_skip((array_iter *)it, k);
+}
+
+int64_t tslite_array_length(const void *blob, int n) {
+  return blob ? array_count(blob, n) : 0;
+}
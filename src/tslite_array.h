@@ -0,0 +1,89 @@
+#ifndef TSLITE_TSLITE_ARRAY_H
+#define TSLITE_TSLITE_ARRAY_H
+
+// C API to build and read tslite array blobs in-process, linked from
+// libtslite.a. It doesn't depend on SQLite or on the extension being loaded:
+// a finished blob is bound like any other, for example with
+// sqlite3_bind_blob(stmt, i, blob, n, free).
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Result codes, equal to the SQLite ones.
+#define TSLITE_ARRAY_OK 0
+#define TSLITE_ARRAY_ERROR 1
+#define TSLITE_ARRAY_NOMEM 7
+#define TSLITE_ARRAY_TOOBIG 18
+
+// Element types, equal to the SQLite fundamental datatypes.
+#define TSLITE_ARRAY_INTEGER 1
+#define TSLITE_ARRAY_FLOAT 2
+#define TSLITE_ARRAY_TEXT 3
+#define TSLITE_ARRAY_BLOB 4
+#define TSLITE_ARRAY_NULL 5
+
+// Appends an encoded element at a time to a growing buffer. Errors are
+// sticky: after a failed append all further calls return the same error.
+typedef struct {
+  unsigned char *buf;
+  size_t len, cap;
+  int rc;
+} tslite_array_builder;
+
+void tslite_array_builder_init(tslite_array_builder *b);
+void tslite_array_builder_free(tslite_array_builder *b);
+
+int tslite_array_append_null(tslite_array_builder *b);
+int tslite_array_append_i64(tslite_array_builder *b, int64_t v);
+int tslite_array_append_f64(tslite_array_builder *b, double v);
+// A negative n appends z up to its terminating NUL.
+int tslite_array_append_text(tslite_array_builder *b, const char *z, int n);
+int tslite_array_append_blob(tslite_array_builder *b, const void *z, int n);
+
+// Append n contiguous values, growing the buffer once.
+int tslite_array_append_i64s(tslite_array_builder *b, const int64_t *v,
+                             size_t n);
+int tslite_array_append_f64s(tslite_array_builder *b, const double *v,
+                             size_t n);
+
+// Hand the blob over to the caller, who releases it with free(). The
+// builder is empty again afterwards. An empty array is a zero-length blob
+// with *blob set to NULL.
+int tslite_array_finish(tslite_array_builder *b, void **blob, int *n);
+
+// An element. TEXT and BLOB payloads point into the array, which must
+// outlive the value.
+typedef struct {
+  int type;
+  int64_t i;
+  double f;
+  const void *z;
+  int n;
+} tslite_array_value;
+
+// Sequential reader over the elements of an array, expanding the runs
+// written by array_compress. Needs no allocation.
+typedef struct {
+  int64_t opaque[16];
+} tslite_array_iter;
+
+void tslite_array_iter_init(tslite_array_iter *it, const void *blob, int n);
+// Returns 1 if an element was read into v, 0 at the end of the array and -1
+// if the array is malformed.
+int tslite_array_iter_next(tslite_array_iter *it, tslite_array_value *v);
+// Skips k elements without expanding whole runs. Returns the number of
+// elements skipped, or -1 if the array is malformed.
+int64_t tslite_array_iter_skip(tslite_array_iter *it, int64_t k);
+
+// Number of elements in an array, or -1 if it is malformed.
+int64_t tslite_array_length(const void *blob, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TSLITE_TSLITE_ARRAY_H
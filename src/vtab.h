@@ -0,0 +1,47 @@
+#ifndef TSLITE_VTAB_H
+#define TSLITE_VTAB_H
+
+#include <math.h>
+#include <string.h>
+
+#include "tslite.h"
+
+// Strip SQL quotes from a module argument.
+static inline char *vtab_dequote(const char *z) {
+  int n = (int)strlen(z);
+  char q = z[0] == '[' ? ']' : z[0];
+  if (n >= 2 && (q == '\'' || q == '"' || q == '`' || q == ']') &&
+      z[n - 1] == q) {
+    return sqlite3_mprintf("%.*s", n - 2, z + 1);
+  }
+  return sqlite3_mprintf("%s", z);
+}
+
+// Lower (or upper) integer bound implied by comparing an integer column to
+// v. Returns 0 if v doesn't bound it, SQLite checks those constraints itself.
+// Text and blobs sort after every number, so they never bound the column.
+static inline int vtab_ts_bound(sqlite3_value *v, int upper,
+                                sqlite3_int64 *bound) {
+  switch (sqlite3_value_type(v)) {
+    case SQLITE_INTEGER:
+      *bound = sqlite3_value_int64(v);
+      return 1;
+    case SQLITE_FLOAT:
+      double f = upper ? floor(sqlite3_value_double(v))
+                       : ceil(sqlite3_value_double(v));
+      if (isnan(f)) {
+        return 0;
+      }
+      if (f >= 9223372036854775807.0) {
+        *bound = 0x7fffffffffffffffLL;
+      } else if (f < -9223372036854775807.0) {
+        *bound = -0x7fffffffffffffffLL - 1;
+      } else {
+        *bound = (sqlite3_int64)f;
+      }
+      return 1;
+  }
+  return 0;
+}
+
+#endif  // TSLITE_VTAB_H
@@ -0,0 +1,308 @@
+#include "window.h"
+
+#include <math.h>
+#include <string.h>
+
+typedef struct {
+  sqlite3_int64 seq;
+  double f;
+  sqlite3_int64 i;
+  int is_int;
+} moving_entry;
+
+// Monotonic deque over the frame for moving_min and moving_max. Every row
+// gets a sequence number; SQLite removes rows from the frame in the order
+// they were added, so xInverse only has to check whether the oldest row is
+// at the front of the deque. Each row is pushed and popped at most once,
+// which makes both xStep and xInverse O(1) amortized.
+typedef struct {
+  moving_entry *entries;
+  int head, len, cap;
+  sqlite3_int64 next_seq;
+  sqlite3_int64 first_seq;
+} moving_extreme;
+
+static int moving_extreme_grow(moving_extreme *d) {
+  int cap = d->cap ? d->cap * 2 : 64;
+  moving_entry *entries = sqlite3_malloc64(cap * sizeof(moving_entry));
+  if (!entries) {
+    return SQLITE_NOMEM;
+  }
+  for (int k = 0; k < d->len; k++) {
+    entries[k] = d->entries[(d->head + k) & (d->cap - 1)];
+  }
+  sqlite3_free(d->entries);
+  d->entries = entries;
+  d->head = 0;
+  d->cap = cap;
+  return SQLITE_OK;
+}
+
+// Integers are compared as integers, doubles lose the low bits above 2^53.
+static int moving_entry_cmp(const moving_entry *a, const moving_entry *b) {
+  if (a->is_int && b->is_int) {
+    return (a->i > b->i) - (a->i < b->i);
+  }
+  return (a->f > b->f) - (a->f < b->f);
+}
+
+static void moving_extreme_step(sqlite3_context *context, sqlite3_value *arg,
+                                int max) {
+  moving_extreme *d =
+      sqlite3_aggregate_context(context, sizeof(moving_extreme));
+  if (!d) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  sqlite3_int64 seq = d->next_seq++;
+  // Text and blobs are skipped like NULL, there's no number to order them by.
+  int type = sqlite3_value_numeric_type(arg);
+  if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+    return;
+  }
+
+  moving_entry e;
+  e.seq = seq;
+  e.is_int = type == SQLITE_INTEGER;
+  e.i = e.is_int ? sqlite3_value_int64(arg) : 0;
+  e.f = sqlite3_value_double(arg);
+
+  // Drop the entries the new value dominates, they can never be the extreme
+  // again.
+  while (d->len > 0) {
+    moving_entry *back = &d->entries[(d->head + d->len - 1) & (d->cap - 1)];
+    int cmp = moving_entry_cmp(back, &e);
+    if (max ? cmp > 0 : cmp < 0) {
+      break;
+    }
+    d->len--;
+  }
+
+  if (d->len == d->cap && moving_extreme_grow(d)) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  d->entries[(d->head + d->len) & (d->cap - 1)] = e;
+  d->len++;
+}
+
+void moving_min_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  UNUSED(argc);
+  moving_extreme_step(context, argv[0], 0);
+}
+
+void moving_max_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  UNUSED(argc);
+  moving_extreme_step(context, argv[0], 1);
+}
+
+void moving_extreme_inverse_func(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
+  UNUSED(argc);
+  UNUSED(argv);
+
+  moving_extreme *d =
+      sqlite3_aggregate_context(context, sizeof(moving_extreme));
+  if (!d) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  sqlite3_int64 seq = d->first_seq++;
+  if (d->len > 0 && d->entries[d->head].seq == seq) {
+    d->head = (d->head + 1) & (d->cap - 1);
+    d->len--;
+  }
+}
+
+static void moving_extreme_result(sqlite3_context *context,
+                                  const moving_extreme *d) {
+  if (!d || !d->len) {
+    sqlite3_result_null(context);
+    return;
+  }
+  const moving_entry *front = &d->entries[d->head];
+  if (front->is_int) {
+    sqlite3_result_int64(context, front->i);
+  } else {
+    sqlite3_result_double(context, front->f);
+  }
+}
+
+void moving_extreme_value_func(sqlite3_context *context) {
+  moving_extreme_result(context, sqlite3_aggregate_context(context, 0));
+}
+
+void moving_extreme_final_func(sqlite3_context *context) {
+  moving_extreme *d = sqlite3_aggregate_context(context, 0);
+  moving_extreme_result(context, d);
+  if (d) {
+    sqlite3_free(d->entries);
+  }
+}
+
+// State of moving_sum and moving_avg. Integers are summed exactly as long as
+// they fit, like sum() does; the compensated float sum is used otherwise.
+typedef struct {
+  kahan_sum sum;
+  sqlite3_int64 isum;
+  sqlite3_int64 count;
+  sqlite3_int64 non_int;
+  int overflow;
+} moving_sum;
+
+static void moving_sum_update(sqlite3_context *context, sqlite3_value *arg,
+                              int sign) {
+  moving_sum *m = sqlite3_aggregate_context(context, sizeof(moving_sum));
+  if (!m) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  int type = sqlite3_value_numeric_type(arg);
+  if (type == SQLITE_NULL) {
+    return;
+  }
+  m->count += sign;
+  kahan_add(&m->sum, sign * sqlite3_value_double(arg));
+  if (type == SQLITE_INTEGER) {
+    sqlite3_int64 v = sqlite3_value_int64(arg);
+    if (sign > 0 ? __builtin_add_overflow(m->isum, v, &m->isum)
+                 : __builtin_sub_overflow(m->isum, v, &m->isum)) {
+      m->overflow = 1;
+    }
+  } else {
+    m->non_int += sign;
+  }
+
+  if (!m->count) {
+    // Empty frame, start over exactly.
+    memset(m, 0, sizeof(*m));
+  }
+}
+
+void moving_sum_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  UNUSED(argc);
+  moving_sum_update(context, argv[0], 1);
+}
+
+void moving_sum_inverse_func(sqlite3_context *context, int argc,
+                             sqlite3_value **argv) {
+  UNUSED(argc);
+  moving_sum_update(context, argv[0], -1);
+}
+
+void moving_sum_value_func(sqlite3_context *context) {
+  moving_sum *m = sqlite3_aggregate_context(context, 0);
+  if (!m || !m->count) {
+    sqlite3_result_null(context);
+    return;
+  }
+  if (!m->non_int && !m->overflow) {
+    sqlite3_result_int64(context, m->isum);
+  } else {
+    sqlite3_result_double(context, kahan_value(&m->sum));
+  }
+}
+
+void moving_avg_value_func(sqlite3_context *context) {
+  moving_sum *m = sqlite3_aggregate_context(context, 0);
+  if (!m || !m->count) {
+    sqlite3_result_null(context);
+    return;
+  }
+  if (!m->non_int && !m->overflow) {
+    sqlite3_result_double(context, (double)m->isum / (double)m->count);
+  } else {
+    sqlite3_result_double(context, kahan_value(&m->sum) / (double)m->count);
+  }
+}
+
+// Exponentially weighted moving average over time. Every sample is weighted
+// by 2^((ts - ref) / half_life), so a sample half_life seconds older than
+// another counts half as much regardless of how many rows lie in between,
+// and the result is sum(w * value) / sum(w). Because the weights don't depend
+// on the other rows, removing a sample is just subtracting its terms.
+typedef struct {
+  kahan_sum sum;
+  kahan_sum weight;
+  sqlite3_int64 count;
+  sqlite3_int64 ref;
+  double half_life;
+  int has_ref;
+} ewma_state;
+
+// Rebase the weights once they grow this many half-lives, far from overflow.
+#define EWMA_REBASE 512.0
+
+static void ewma_update(sqlite3_context *context, sqlite3_value **argv,
+                        int sign) {
+  ewma_state *s = sqlite3_aggregate_context(context, sizeof(ewma_state));
+  if (!s) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_numeric_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+  double half_life = sqlite3_value_double(argv[2]);
+  if (!(half_life > 0)) {
+    sqlite3_result_error(context, "invalid ewma half-life", -1);
+    return;
+  }
+
+  sqlite3_int64 ts = sqlite3_value_int64(argv[0]);
+  double value = sqlite3_value_double(argv[1]);
+  if (!s->has_ref) {
+    s->ref = ts;
+    s->half_life = half_life;
+    s->has_ref = 1;
+  }
+
+  double age = (double)(ts - s->ref) / s->half_life;
+  if (sign > 0 && age > EWMA_REBASE) {
+    double scale = exp2(-age);
+    s->sum.sum *= scale;
+    s->sum.c *= scale;
+    s->weight.sum *= scale;
+    s->weight.c *= scale;
+    s->ref = ts;
+    age = 0.0;
+  }
+
+  double w = exp2(age);
+  s->count += sign;
+  kahan_add(&s->sum, sign * w * value);
+  kahan_add(&s->weight, sign * w);
+
+  if (!s->count) {
+    memset(s, 0, sizeof(*s));
+  }
+}
+
+void ewma_step_func(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  UNUSED(argc);
+  ewma_update(context, argv, 1);
+}
+
+void ewma_inverse_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  UNUSED(argc);
+  ewma_update(context, argv, -1);
+}
+
+void ewma_value_func(sqlite3_context *context) {
+  ewma_state *s = sqlite3_aggregate_context(context, 0);
+  double w = s ? kahan_value(&s->weight) : 0.0;
+  if (!s || !s->count || !(w > 0)) {
+    sqlite3_result_null(context);
+    return;
+  }
+  sqlite3_result_double(context, kahan_value(&s->sum) / w);
+}
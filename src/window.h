@@ -0,0 +1,28 @@
+#ifndef TSLITE_WINDOW_H
+#define TSLITE_WINDOW_H
+
+#include "kahan.h"
+#include "tslite.h"
+
+void moving_min_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+void moving_max_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+void moving_extreme_inverse_func(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv);
+void moving_extreme_final_func(sqlite3_context *context);
+void moving_extreme_value_func(sqlite3_context *context);
+
+void moving_sum_step_func(sqlite3_context *context, int argc,
+                          sqlite3_value **argv);
+void moving_sum_inverse_func(sqlite3_context *context, int argc,
+                             sqlite3_value **argv);
+void moving_sum_value_func(sqlite3_context *context);
+void moving_avg_value_func(sqlite3_context *context);
+
+void ewma_step_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+void ewma_inverse_func(sqlite3_context *context, int argc,
+                       sqlite3_value **argv);
+void ewma_value_func(sqlite3_context *context);
+
+#endif  // TSLITE_WINDOW_H
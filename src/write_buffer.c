@@ -0,0 +1,678 @@
+#include "write_buffer.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRITE_BUFFER_IDX_TS_EQ 0x01
+#define WRITE_BUFFER_IDX_TS_LOWER 0x02
+#define WRITE_BUFFER_IDX_TS_UPPER 0x04
+#define WRITE_BUFFER_IDX_ARGS 3
+
+static void write_buffer_row_free(write_buffer_vtab *vtab,
+                                  write_buffer_row *row) {
+  for (int c = 0; c < vtab->n_columns; c++) {
+    sqlite3_value_free(row->values[c]);
+  }
+  sqlite3_free(row);
+}
+
+static void write_buffer_clear(write_buffer_vtab *vtab) {
+  for (sqlite3_int64 i = 0; i < vtab->n_rows; i++) {
+    write_buffer_row_free(vtab, vtab->rows[i]);
+  }
+  vtab->n_rows = 0;
+  vtab->sorted = 1;
+}
+
+static int write_buffer_row_cmp(const void *a, const void *b) {
+  const write_buffer_row *x = *(write_buffer_row *const *)a;
+  const write_buffer_row *y = *(write_buffer_row *const *)b;
+  if (x->ts != y->ts) {
+    return x->ts < y->ts ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Sort the buffer by ts, keeping rows with equal ts in insertion order.
+static void write_buffer_sort(write_buffer_vtab *vtab) {
+  if (!vtab->sorted) {
+    qsort(vtab->rows, vtab->n_rows, sizeof(write_buffer_row *),
+          write_buffer_row_cmp);
+    vtab->sorted = 1;
+  }
+}
+
+// Insert the buffered rows into the target table in ts order, so the target
+// grows by appends instead of random page splits. Inside a savepoint only the
+// rows inserted since it opened are written: a rollback to it undoes their
+// insert and drops them from the buffer alike, while older rows written now
+// would be undone in the target after leaving the buffer.
+static int write_buffer_flush(write_buffer_vtab *vtab) {
+  sqlite3_int64 from = vtab->n_marks ? vtab->marks[vtab->n_marks - 1].seq : 0;
+  // Rows [keep, n_rows) are written. The older rows keep their order.
+  sqlite3_int64 keep = 0;
+  for (sqlite3_int64 i = 0; i < vtab->n_rows; i++) {
+    if (vtab->rows[i]->seq < from) {
+      write_buffer_row *row = vtab->rows[i];
+      vtab->rows[i] = vtab->rows[keep];
+      vtab->rows[keep++] = row;
+    }
+  }
+  if (keep == vtab->n_rows) {
+    return SQLITE_OK;
+  }
+  if (keep) {
+    qsort(vtab->rows + keep, vtab->n_rows - keep, sizeof(write_buffer_row *),
+          write_buffer_row_cmp);
+  } else {
+    write_buffer_sort(vtab);
+  }
+
+  int rc = SQLITE_OK;
+  if (!vtab->insert_stmt) {
+    sqlite3_str *sql = sqlite3_str_new(vtab->db);
+    sqlite3_str_appendf(sql, "INSERT INTO \"%w\".\"%w\" (%s) VALUES (?1",
+                        vtab->schema, vtab->target, vtab->columns);
+    for (int c = 1; c < vtab->n_columns; c++) {
+      sqlite3_str_appendf(sql, ", ?%d", c + 1);
+    }
+    sqlite3_str_appendall(sql, ")");
+    char *z = sqlite3_str_finish(sql);
+    if (!z) {
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v3(vtab->db, z, -1, SQLITE_PREPARE_PERSISTENT,
+                            &vtab->insert_stmt, NULL);
+    sqlite3_free(z);
+  }
+
+  sqlite3_stmt *stmt = vtab->insert_stmt;
+  // Number of rows written.
+  sqlite3_int64 n = 0;
+  while (rc == SQLITE_OK && keep + n < vtab->n_rows) {
+    write_buffer_row *row = vtab->rows[keep + n];
+    for (int c = 0; c < vtab->n_columns; c++) {
+      sqlite3_bind_value(stmt, c + 1, row->values[c]);
+    }
+    rc = sqlite3_step(stmt);
+    rc = rc == SQLITE_DONE ? SQLITE_OK : sqlite3_reset(stmt);
+    sqlite3_reset(stmt);
+    n += rc == SQLITE_OK;
+  }
+  if (stmt) {
+    sqlite3_clear_bindings(stmt);
+  }
+  if (rc == SQLITE_OK && !keep) {
+    write_buffer_clear(vtab);
+    return rc;
+  }
+
+  // After an error the rows from the failing one on were acknowledged but not
+  // written. They stay buffered, so the commit flushes them again and fails
+  // instead of losing them.
+  for (sqlite3_int64 i = 0; i < n; i++) {
+    write_buffer_row_free(vtab, vtab->rows[keep + i]);
+  }
+  memmove(vtab->rows + keep, vtab->rows + keep + n,
+          (vtab->n_rows - keep - n) * sizeof(write_buffer_row *));
+  vtab->n_rows -= n;
+  // The kept rows can be out of order, with each other or with the rows
+  // after them.
+  vtab->sorted = vtab->n_rows <= 1;
+  vtab->first_insert = time(NULL);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+  }
+  return rc;
+}
+
+static int write_buffer_vtab_disconnect(sqlite3_vtab *pVtab) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  write_buffer_clear(vtab);
+  sqlite3_finalize(vtab->insert_stmt);
+  sqlite3_free(vtab->rows);
+  sqlite3_free(vtab->marks);
+  sqlite3_free(vtab->schema);
+  sqlite3_free(vtab->target);
+  sqlite3_free(vtab->columns);
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+// Declare the columns of the target table as the columns of the buffer.
+static int write_buffer_vtab_init(write_buffer_vtab *vtab, char **pzErr) {
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      vtab->db, "SELECT name FROM pragma_table_info(?1, ?2) ORDER BY cid",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, vtab->target, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, vtab->schema, -1, SQLITE_STATIC);
+
+  sqlite3_str *columns = sqlite3_str_new(vtab->db);
+  vtab->ts_column = -1;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 0);
+    if (!name) {
+      continue;
+    }
+    if (!sqlite3_stricmp(name, "ts")) {
+      vtab->ts_column = vtab->n_columns;
+    }
+    sqlite3_str_appendf(columns, "%s\"%w\"", vtab->n_columns ? ", " : "",
+                        name);
+    vtab->n_columns++;
+  }
+  sqlite3_finalize(stmt);
+  vtab->columns = sqlite3_str_finish(columns);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+  if (!vtab->columns) {
+    return vtab->n_columns ? SQLITE_NOMEM : SQLITE_ERROR;
+  }
+  if (vtab->ts_column < 0) {
+    *pzErr = sqlite3_mprintf("table %s has no ts column", vtab->target);
+    return SQLITE_ERROR;
+  }
+
+  char *sql = sqlite3_mprintf("CREATE TABLE x(%s)", vtab->columns);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_declare_vtab(vtab->db, sql);
+  sqlite3_free(sql);
+  return rc;
+}
+
+// CREATE VIRTUAL TABLE name USING tslite_buffer(table [, max_rows
+// [, max_delay]]). Rows are flushed to table once max_rows are buffered, the
+// oldest buffered row is max_delay seconds old (0 is no limit), and always
+// on commit.
+static int write_buffer_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                     const char *const *argv,
+                                     sqlite3_vtab **ppVtab, char **pzErr) {
+  UNUSED(pAux);
+
+  if (argc < 4 || argc > 6) {
+    *pzErr = sqlite3_mprintf(
+        "usage: tslite_buffer(table [, max_rows [, max_delay]])");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 max_rows = WRITE_BUFFER_DEFAULT_MAX_ROWS;
+  sqlite3_int64 max_delay = 0;
+  char *end;
+  if (argc > 4) {
+    max_rows = strtoll(argv[4], &end, 10);
+    if (*end || max_rows < 1) {
+      *pzErr = sqlite3_mprintf("invalid max_rows");
+      return SQLITE_ERROR;
+    }
+  }
+  if (argc > 5) {
+    max_delay = strtoll(argv[5], &end, 10);
+    if (*end || max_delay < 0) {
+      *pzErr = sqlite3_mprintf("invalid max_delay");
+      return SQLITE_ERROR;
+    }
+  }
+
+  write_buffer_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+  vtab->schema = sqlite3_mprintf("%s", argv[1]);
+  vtab->target = vtab_dequote(argv[3]);
+  vtab->max_rows = max_rows;
+  vtab->max_delay = max_delay;
+  vtab->sorted = 1;
+
+  int rc = SQLITE_OK;
+  if (!vtab->schema || !vtab->target) {
+    rc = SQLITE_NOMEM;
+  } else {
+    rc = write_buffer_vtab_init(vtab, pzErr);
+  }
+  if (rc != SQLITE_OK) {
+    if (!*pzErr) {
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+    write_buffer_vtab_disconnect(&vtab->base);
+    *ppVtab = NULL;
+  }
+  return rc;
+}
+
+static int write_buffer_vtab_open(sqlite3_vtab *p,
+                                  sqlite3_vtab_cursor **ppCursor) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)p;
+  write_buffer_vtab_cursor *cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->eof = 1;
+  *ppCursor = &cursor->base;
+  vtab->cursors++;
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_close(sqlite3_vtab_cursor *cur) {
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+  sqlite3_finalize(cursor->stmt);
+  sqlite3_free(cursor);
+  vtab->cursors--;
+  return SQLITE_OK;
+}
+
+// Pick the next row from either side. On equal ts the target row goes
+// first, it was inserted earlier.
+static void write_buffer_vtab_pick(write_buffer_vtab_cursor *cursor) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+  int buffered = cursor->pos < cursor->end &&
+                 vtab->rows[cursor->pos]->ts <= cursor->upper;
+  if (cursor->stmt_eof) {
+    cursor->from_buffer = 1;
+    cursor->eof = !buffered;
+    return;
+  }
+  cursor->eof = 0;
+  cursor->from_buffer =
+      buffered && vtab->rows[cursor->pos]->ts <
+                      sqlite3_column_int64(cursor->stmt, vtab->ts_column);
+}
+
+static int write_buffer_vtab_step(write_buffer_vtab_cursor *cursor) {
+  int rc = sqlite3_step(cursor->stmt);
+  if (rc == SQLITE_ROW) {
+    return SQLITE_OK;
+  }
+  cursor->stmt_eof = 1;
+  if (rc != SQLITE_DONE) {
+    write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+    cursor->base.pVtab->zErrMsg =
+        sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return rc;
+  }
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_next(sqlite3_vtab_cursor *cur) {
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  if (cursor->from_buffer) {
+    cursor->pos++;
+  } else {
+    int rc = write_buffer_vtab_step(cursor);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  write_buffer_vtab_pick(cursor);
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_eof(sqlite3_vtab_cursor *cur) {
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  return cursor->eof;
+}
+
+static int write_buffer_vtab_column(sqlite3_vtab_cursor *cur,
+                                    sqlite3_context *context, int i) {
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+  if (i < 0 || i >= vtab->n_columns) {
+    return SQLITE_ERROR;
+  }
+  if (cursor->from_buffer) {
+    sqlite3_result_value(context, vtab->rows[cursor->pos]->values[i]);
+  } else {
+    sqlite3_result_value(context, sqlite3_column_value(cursor->stmt, i));
+  }
+  return SQLITE_OK;
+}
+
+// Target rows have their own rowid, buffered rows a negative one by their
+// position in the buffer.
+static int write_buffer_vtab_rowid(sqlite3_vtab_cursor *cur,
+                                   sqlite_int64 *pRowid) {
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+  if (cursor->from_buffer) {
+    *pRowid = -1 - cursor->pos;
+  } else {
+    *pRowid = sqlite3_column_int64(cursor->stmt, vtab->n_columns);
+  }
+  return SQLITE_OK;
+}
+
+// Merge the target rows in the ts range, read in ts order, with the sorted
+// buffer. Bounds are inclusive, SQLite rechecks exclusive ones.
+static int write_buffer_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                                    const char *idxStr, int argc,
+                                    sqlite3_value **argv) {
+  UNUSED(idxStr);
+  UNUSED(argc);
+
+  write_buffer_vtab_cursor *cursor = (write_buffer_vtab_cursor *)cur;
+  write_buffer_vtab *vtab = (write_buffer_vtab *)cursor->base.pVtab;
+
+  sqlite3_int64 lower = -0x7fffffffffffffffLL - 1;
+  sqlite3_int64 upper = 0x7fffffffffffffffLL;
+  sqlite3_int64 bound;
+  int i = 0;
+  if (idxNum & WRITE_BUFFER_IDX_TS_EQ) {
+    if (vtab_ts_bound(argv[i], 0, &bound)) {
+      lower = bound;
+    }
+    if (vtab_ts_bound(argv[i++], 1, &bound)) {
+      upper = bound;
+    }
+  }
+  if (idxNum & WRITE_BUFFER_IDX_TS_LOWER) {
+    if (vtab_ts_bound(argv[i++], 0, &bound) && bound > lower) {
+      lower = bound;
+    }
+  }
+  if (idxNum & WRITE_BUFFER_IDX_TS_UPPER) {
+    if (vtab_ts_bound(argv[i++], 1, &bound) && bound < upper) {
+      upper = bound;
+    }
+  }
+
+  sqlite3_finalize(cursor->stmt);
+  cursor->stmt = NULL;
+  char *sql = sqlite3_mprintf(
+      "SELECT %s, rowid FROM \"%w\".\"%w\" WHERE ts BETWEEN ?1 AND ?2 "
+      "ORDER BY ts",
+      vtab->columns, vtab->schema, vtab->target);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(vtab->db, sql, -1, &cursor->stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    cursor->base.pVtab->zErrMsg =
+        sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return rc;
+  }
+  sqlite3_bind_int64(cursor->stmt, 1, lower);
+  sqlite3_bind_int64(cursor->stmt, 2, upper);
+  cursor->stmt_eof = 0;
+  rc = write_buffer_vtab_step(cursor);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // First buffered row at or after the lower bound. Rows inserted while the
+  // cursor is open are not returned.
+  write_buffer_sort(vtab);
+  sqlite3_int64 lo = 0, hi = vtab->n_rows;
+  while (lo < hi) {
+    sqlite3_int64 mid = lo + (hi - lo) / 2;
+    if (vtab->rows[mid]->ts < lower) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cursor->pos = lo;
+  cursor->end = vtab->n_rows;
+  cursor->upper = upper;
+  write_buffer_vtab_pick(cursor);
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_best_index(sqlite3_vtab *vtab,
+                                        sqlite3_index_info *pIdxInfo) {
+  write_buffer_vtab *p = (write_buffer_vtab *)vtab;
+
+  // Constraint index per argument slot, in xFilter argument order.
+  int slots[WRITE_BUFFER_IDX_ARGS] = {-1, -1, -1};
+  int idxNum = 0;
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    if (!constraint->usable || constraint->iColumn != p->ts_column) {
+      continue;
+    }
+    int slot = -1;
+    switch (constraint->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        slot = 0;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        slot = 1;
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        slot = 2;
+        break;
+    }
+    if (slot >= 0 && slots[slot] < 0) {
+      slots[slot] = i;
+      idxNum |= 1 << slot;
+    }
+  }
+
+  int argvIndex = 1;
+  for (int slot = 0; slot < WRITE_BUFFER_IDX_ARGS; slot++) {
+    if (slots[slot] >= 0) {
+      pIdxInfo->aConstraintUsage[slots[slot]].argvIndex = argvIndex++;
+    }
+  }
+  pIdxInfo->idxNum = idxNum;
+
+  pIdxInfo->estimatedCost = 1000000.0;
+  if (idxNum & WRITE_BUFFER_IDX_TS_EQ) {
+    pIdxInfo->estimatedCost = 10.0;
+  } else if (idxNum & (WRITE_BUFFER_IDX_TS_LOWER | WRITE_BUFFER_IDX_TS_UPPER)) {
+    pIdxInfo->estimatedCost = 1000.0;
+  }
+  if (pIdxInfo->nOrderBy == 1 &&
+      pIdxInfo->aOrderBy[0].iColumn == p->ts_column &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+// Only inserts are buffered, argv[2 + c] is the value of column c.
+static int write_buffer_vtab_update(sqlite3_vtab *pVtab, int argc,
+                                    sqlite3_value **argv,
+                                    sqlite_int64 *pRowid) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  if (argc == 1 || sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+    pVtab->zErrMsg = sqlite3_mprintf("tslite_buffer only supports INSERT");
+    return SQLITE_ERROR;
+  }
+  sqlite3_value *ts = argv[2 + vtab->ts_column];
+  if (sqlite3_value_type(ts) != SQLITE_INTEGER) {
+    pVtab->zErrMsg = sqlite3_mprintf("ts must be an integer");
+    return SQLITE_CONSTRAINT;
+  }
+
+  // The buffer is flushed before the new row is added: if that fails, the
+  // insert fails without leaving its row behind in the buffer or the table.
+  // Open cursors point into the buffer, it can't be flushed under them.
+  sqlite3_int64 flushable =
+      vtab->n_rows -
+      (vtab->n_marks ? vtab->marks[vtab->n_marks - 1].n_rows : 0);
+  if (!vtab->cursors &&
+      (flushable >= vtab->max_rows ||
+       (flushable && vtab->max_delay &&
+        time(NULL) - vtab->first_insert >= vtab->max_delay))) {
+    int rc = write_buffer_flush(vtab);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  if (vtab->n_rows == vtab->cap_rows) {
+    sqlite3_int64 cap = vtab->cap_rows ? vtab->cap_rows * 2 : 256;
+    write_buffer_row **rows =
+        sqlite3_realloc64(vtab->rows, cap * sizeof(write_buffer_row *));
+    if (!rows) {
+      return SQLITE_NOMEM;
+    }
+    vtab->rows = rows;
+    vtab->cap_rows = cap;
+  }
+  write_buffer_row *row = sqlite3_malloc64(
+      sizeof(write_buffer_row) + vtab->n_columns * sizeof(sqlite3_value *));
+  if (!row) {
+    return SQLITE_NOMEM;
+  }
+  row->ts = sqlite3_value_int64(ts);
+  row->seq = vtab->seq++;
+  for (int c = 0; c < vtab->n_columns; c++) {
+    row->values[c] = sqlite3_value_dup(argv[2 + c]);
+    if (!row->values[c] && sqlite3_value_type(argv[2 + c]) != SQLITE_NULL) {
+      for (int k = 0; k < c; k++) {
+        sqlite3_value_free(row->values[k]);
+      }
+      sqlite3_free(row);
+      return SQLITE_NOMEM;
+    }
+  }
+
+  if (!vtab->n_rows) {
+    vtab->first_insert = time(NULL);
+  } else if (row->ts < vtab->rows[vtab->n_rows - 1]->ts) {
+    vtab->sorted = 0;
+  }
+  vtab->rows[vtab->n_rows++] = row;
+  *pRowid = row->ts;
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_begin(sqlite3_vtab *pVtab) {
+  ((write_buffer_vtab *)pVtab)->n_marks = 0;
+  return SQLITE_OK;
+}
+
+// The buffer is written out before the commit, like the pending data of an
+// FTS5 table. Savepoints still open end with the transaction.
+static int write_buffer_vtab_sync(sqlite3_vtab *pVtab) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  vtab->n_marks = 0;
+  return write_buffer_flush(vtab);
+}
+
+static int write_buffer_vtab_commit(sqlite3_vtab *pVtab) {
+  ((write_buffer_vtab *)pVtab)->n_marks = 0;
+  return SQLITE_OK;
+}
+
+static int write_buffer_vtab_rollback(sqlite3_vtab *pVtab) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  write_buffer_clear(vtab);
+  vtab->n_marks = 0;
+  return SQLITE_OK;
+}
+
+// SQLite opens a statement savepoint for every multi-row INSERT in a
+// transaction, so savepoints only mark where they opened and the rows stay
+// buffered. A full buffer is flushed first, as far as the enclosing savepoint
+// allows. Savepoints opened before this table joined the transaction get the
+// same mark, none of its rows predate them.
+static int write_buffer_vtab_savepoint(sqlite3_vtab *pVtab, int iSavepoint) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  if (vtab->n_marks > iSavepoint) {
+    vtab->n_marks = iSavepoint;
+  }
+  sqlite3_int64 flushable =
+      vtab->n_rows -
+      (vtab->n_marks ? vtab->marks[vtab->n_marks - 1].n_rows : 0);
+  if (!vtab->cursors && flushable >= vtab->max_rows) {
+    int rc = write_buffer_flush(vtab);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  if (iSavepoint >= vtab->cap_marks) {
+    int cap = vtab->cap_marks ? vtab->cap_marks * 2 : 8;
+    while (cap <= iSavepoint) {
+      cap *= 2;
+    }
+    write_buffer_mark *marks =
+        sqlite3_realloc64(vtab->marks, cap * sizeof(write_buffer_mark));
+    if (!marks) {
+      return SQLITE_NOMEM;
+    }
+    vtab->marks = marks;
+    vtab->cap_marks = cap;
+  }
+  for (int i = vtab->n_marks; i <= iSavepoint; i++) {
+    vtab->marks[i].seq = vtab->seq;
+    vtab->marks[i].n_rows = vtab->n_rows;
+  }
+  vtab->n_marks = iSavepoint + 1;
+  return SQLITE_OK;
+}
+
+// The rows inserted under a released savepoint belong to the enclosing one.
+static int write_buffer_vtab_release(sqlite3_vtab *pVtab, int iSavepoint) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  if (vtab->n_marks > iSavepoint) {
+    vtab->n_marks = iSavepoint;
+  }
+  return SQLITE_OK;
+}
+
+// Drop the rows inserted since the savepoint opened. Those flushed since are
+// rolled back in the target.
+static int write_buffer_vtab_rollback_to(sqlite3_vtab *pVtab, int iSavepoint) {
+  write_buffer_vtab *vtab = (write_buffer_vtab *)pVtab;
+  if (iSavepoint >= vtab->n_marks) {
+    return SQLITE_OK;
+  }
+  sqlite3_int64 from = vtab->marks[iSavepoint].seq;
+  sqlite3_int64 n = 0;
+  for (sqlite3_int64 i = 0; i < vtab->n_rows; i++) {
+    if (vtab->rows[i]->seq < from) {
+      vtab->rows[n++] = vtab->rows[i];
+    } else {
+      write_buffer_row_free(vtab, vtab->rows[i]);
+    }
+  }
+  vtab->n_rows = n;
+  vtab->n_marks = iSavepoint + 1;
+  return SQLITE_OK;
+}
+
+sqlite3_module write_buffer_module = {
+    /* iVersion    */ 2,
+    /* xCreate     */ write_buffer_vtab_connect,
+    /* xConnect    */ write_buffer_vtab_connect,
+    /* xBestIndex  */ write_buffer_vtab_best_index,
+    /* xDisconnect */ write_buffer_vtab_disconnect,
+    /* xDestroy    */ write_buffer_vtab_disconnect,
+    /* xOpen       */ write_buffer_vtab_open,
+    /* xClose      */ write_buffer_vtab_close,
+    /* xFilter     */ write_buffer_vtab_filter,
+    /* xNext       */ write_buffer_vtab_next,
+    /* xEof        */ write_buffer_vtab_eof,
+    /* xColumn     */ write_buffer_vtab_column,
+    /* xRowid      */ write_buffer_vtab_rowid,
+    /* xUpdate     */ write_buffer_vtab_update,
+    /* xBegin      */ write_buffer_vtab_begin,
+    /* xSync       */ write_buffer_vtab_sync,
+    /* xCommit     */ write_buffer_vtab_commit,
+    /* xRollback   */ write_buffer_vtab_rollback,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ write_buffer_vtab_savepoint,
+    /* xRelease    */ write_buffer_vtab_release,
+    /* xRollbackTo */ write_buffer_vtab_rollback_to,
+    /* xShadowName */ 0,
+};
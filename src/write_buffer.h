@@ -0,0 +1,62 @@
+#ifndef TSLITE_WRITE_BUFFER_H
+#define TSLITE_WRITE_BUFFER_H
+
+#include <time.h>
+
+#include "tslite.h"
+#include "vtab.h"
+
+#define WRITE_BUFFER_DEFAULT_MAX_ROWS 65536
+
+// Where a savepoint opened: the seq of the next row and the number of rows
+// buffered before it.
+typedef struct {
+  sqlite3_int64 seq;
+  sqlite3_int64 n_rows;
+} write_buffer_mark;
+
+// A buffered row: the values of all columns of the target table, in order.
+typedef struct {
+  sqlite3_int64 ts;
+  sqlite3_int64 seq;
+  sqlite3_value *values[];
+} write_buffer_row;
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  char *schema;
+  char *target;
+  // Quoted, comma separated column names of the target.
+  char *columns;
+  int n_columns;
+  int ts_column;
+  sqlite3_int64 max_rows;
+  sqlite3_int64 max_delay;
+
+  // Rows inserted since the last flush, in insertion order until sorted.
+  write_buffer_row **rows;
+  sqlite3_int64 n_rows, cap_rows;
+  int sorted;
+  sqlite3_int64 seq;
+  time_t first_insert;
+  sqlite3_stmt *insert_stmt;
+  int cursors;
+
+  // Marks of the open savepoints, indexed by savepoint.
+  write_buffer_mark *marks;
+  int n_marks, cap_marks;
+} write_buffer_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  // Rows of the target table, merged with the buffered rows [pos, end).
+  sqlite3_stmt *stmt;
+  int stmt_eof;
+  sqlite3_int64 pos, end;
+  sqlite3_int64 upper;
+  int from_buffer;
+  int eof;
+} write_buffer_vtab_cursor;
+
+#endif  // TSLITE_WRITE_BUFFER_H
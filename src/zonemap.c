@@ -0,0 +1,462 @@
+#include "zonemap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ZONEMAP_VTAB_BLOCK 0
+#define ZONEMAP_VTAB_MIN_TS 1
+#define ZONEMAP_VTAB_MAX_TS 2
+#define ZONEMAP_VTAB_MIN_VALUE 3
+#define ZONEMAP_VTAB_MAX_VALUE 4
+#define ZONEMAP_VTAB_COUNT 5
+#define ZONEMAP_VTAB_OP 6
+#define ZONEMAP_VTAB_OPERAND 7
+
+// Bits of idxNum, the predicate is passed to xFilter after the constraints
+// on the summary columns, which are listed in idxStr.
+#define ZONEMAP_IDX_OP 0x01
+#define ZONEMAP_IDX_OPERAND 0x02
+
+#define ZONEMAP_DEFAULT_BLOCK_WIDTH 3600
+
+static const char *const zonemap_columns[] = {
+    "block", "min_ts", "max_ts", "min_value", "max_value", "count",
+};
+
+// The block of a timestamp, floor(ts / width) in SQL.
+static char *zonemap_block_sql(const char *ts, sqlite3_int64 width) {
+  return sqlite3_mprintf(
+      "(CAST(%s AS INTEGER) / %lld - (CAST(%s AS INTEGER) %% %lld < 0))", ts,
+      width, ts, width);
+}
+
+// Create the blocks table and the triggers that keep it current, and
+// summarize the rows already in the source table. Inserts widen the
+// summary of their block. Updates and deletes only adjust the count, so
+// min and max may be wider than the rows left, which keeps them correct
+// for finding candidate blocks.
+static int zonemap_vtab_init(zonemap_vtab *vtab, char **pzErr) {
+  char *new_block = zonemap_block_sql("NEW.ts", vtab->block_width);
+  char *old_block = zonemap_block_sql("OLD.ts", vtab->block_width);
+  char *ts_block = zonemap_block_sql("ts", vtab->block_width);
+  char *upsert = sqlite3_mprintf(
+      "INSERT INTO \"%w_blocks\" "
+      "(block, min_ts, max_ts, min_value, max_value, count) "
+      "SELECT %s, NEW.ts, NEW.ts, NEW.value, NEW.value, 1 "
+      "WHERE NEW.ts IS NOT NULL AND NEW.value IS NOT NULL "
+      "ON CONFLICT (block) DO UPDATE SET "
+      "min_ts = min(min_ts, excluded.min_ts), "
+      "max_ts = max(max_ts, excluded.max_ts), "
+      "min_value = min(min_value, excluded.min_value), "
+      "max_value = max(max_value, excluded.max_value), "
+      "count = count + 1;",
+      vtab->name, new_block);
+  char *remove = sqlite3_mprintf(
+      "UPDATE \"%w_blocks\" SET count = count - 1 WHERE block = %s "
+      "AND OLD.ts IS NOT NULL AND OLD.value IS NOT NULL; "
+      "DELETE FROM \"%w_blocks\" WHERE block = %s AND count <= 0;",
+      vtab->name, old_block, vtab->name, old_block);
+  char *sql = NULL;
+  if (new_block && old_block && ts_block && upsert && remove) {
+    sql = sqlite3_mprintf(
+        "CREATE TABLE \"%w\".\"%w_blocks\" (block INTEGER PRIMARY KEY, "
+        "min_ts, max_ts, min_value, max_value, count);"
+        "INSERT INTO \"%w\".\"%w_blocks\" "
+        "SELECT %s AS b, min(ts), max(ts), min(value), max(value), count(*) "
+        "FROM \"%w\".\"%w\" WHERE ts IS NOT NULL AND value IS NOT NULL "
+        "GROUP BY b;"
+        "CREATE TRIGGER \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\" "
+        "BEGIN %s END;"
+        "CREATE TRIGGER \"%w\".\"%w_update\" AFTER UPDATE OF ts, value "
+        "ON \"%w\" BEGIN %s %s END;"
+        "CREATE TRIGGER \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\" "
+        "BEGIN %s END;",
+        vtab->schema, vtab->name, vtab->schema, vtab->name, ts_block,
+        vtab->schema, vtab->table, vtab->schema, vtab->name, vtab->table,
+        upsert, vtab->schema, vtab->name, vtab->table, remove, upsert,
+        vtab->schema, vtab->name, vtab->table, remove);
+  }
+  sqlite3_free(new_block);
+  sqlite3_free(old_block);
+  sqlite3_free(ts_block);
+  sqlite3_free(upsert);
+  sqlite3_free(remove);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+  }
+  return rc;
+}
+
+static int zonemap_vtab_disconnect(sqlite3_vtab *pVtab) {
+  zonemap_vtab *vtab = (zonemap_vtab *)pVtab;
+  sqlite3_free(vtab->schema);
+  sqlite3_free(vtab->name);
+  sqlite3_free(vtab->table);
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+// CREATE VIRTUAL TABLE name USING tslite_zonemap(table [, block_width]),
+// the block width is in seconds of ts.
+static int zonemap_vtab_open_vtab(sqlite3 *db, int create, int argc,
+                                  const char *const *argv,
+                                  sqlite3_vtab **ppVtab, char **pzErr) {
+  if (argc < 4 || argc > 5) {
+    *pzErr = sqlite3_mprintf("usage: tslite_zonemap(table [, block_width])");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 block_width = ZONEMAP_DEFAULT_BLOCK_WIDTH;
+  if (argc > 4) {
+    char *end;
+    block_width = strtoll(argv[4], &end, 10);
+    if (*end || block_width < 1) {
+      *pzErr = sqlite3_mprintf("invalid block width");
+      return SQLITE_ERROR;
+    }
+  }
+
+  int rc = sqlite3_declare_vtab(
+      db,
+      "CREATE TABLE x(block, min_ts, max_ts, min_value, max_value, count, "
+      "op HIDDEN, operand HIDDEN)");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  zonemap_vtab *vtab = sqlite3_malloc(sizeof(*vtab));
+  *ppVtab = (sqlite3_vtab *)vtab;
+  if (!vtab) {
+    return SQLITE_NOMEM;
+  }
+  memset(vtab, 0, sizeof(*vtab));
+  vtab->db = db;
+  vtab->schema = sqlite3_mprintf("%s", argv[1]);
+  vtab->name = sqlite3_mprintf("%s", argv[2]);
+  vtab->table = vtab_dequote(argv[3]);
+  vtab->block_width = block_width;
+  if (!vtab->schema || !vtab->name || !vtab->table) {
+    rc = SQLITE_NOMEM;
+  } else if (create) {
+    rc = zonemap_vtab_init(vtab, pzErr);
+  }
+  if (rc != SQLITE_OK) {
+    zonemap_vtab_disconnect(&vtab->base);
+    *ppVtab = NULL;
+  }
+  return rc;
+}
+
+static int zonemap_vtab_create(sqlite3 *db, void *pAux, int argc,
+                               const char *const *argv, sqlite3_vtab **ppVtab,
+                               char **pzErr) {
+  UNUSED(pAux);
+  return zonemap_vtab_open_vtab(db, 1, argc, argv, ppVtab, pzErr);
+}
+
+static int zonemap_vtab_connect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv, sqlite3_vtab **ppVtab,
+                                char **pzErr) {
+  UNUSED(pAux);
+  return zonemap_vtab_open_vtab(db, 0, argc, argv, ppVtab, pzErr);
+}
+
+static int zonemap_vtab_destroy(sqlite3_vtab *pVtab) {
+  zonemap_vtab *vtab = (zonemap_vtab *)pVtab;
+  char *sql = sqlite3_mprintf(
+      "DROP TRIGGER IF EXISTS \"%w\".\"%w_insert\";"
+      "DROP TRIGGER IF EXISTS \"%w\".\"%w_update\";"
+      "DROP TRIGGER IF EXISTS \"%w\".\"%w_delete\";"
+      "DROP TABLE IF EXISTS \"%w\".\"%w_blocks\";",
+      vtab->schema, vtab->name, vtab->schema, vtab->name, vtab->schema,
+      vtab->name, vtab->schema, vtab->name);
+  if (!sql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(vtab->db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  return zonemap_vtab_disconnect(pVtab);
+}
+
+static int zonemap_vtab_open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  UNUSED(p);
+
+  zonemap_vtab_cursor *cursor;
+  cursor = sqlite3_malloc(sizeof(*cursor));
+  if (!cursor) {
+    return SQLITE_NOMEM;
+  }
+  memset(cursor, 0, sizeof(*cursor));
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+static int zonemap_vtab_close(sqlite3_vtab_cursor *cur) {
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  sqlite3_finalize(cursor->stmt);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int zonemap_vtab_next(sqlite3_vtab_cursor *cur) {
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  int rc = sqlite3_step(cursor->stmt);
+  if (rc == SQLITE_ROW) {
+    return SQLITE_OK;
+  }
+  cursor->eof = 1;
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int zonemap_vtab_eof(sqlite3_vtab_cursor *cur) {
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  return cursor->eof;
+}
+
+static int zonemap_vtab_column(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  if (i <= ZONEMAP_VTAB_COUNT) {
+    sqlite3_result_value(context, sqlite3_column_value(cursor->stmt, i));
+  }
+  return SQLITE_OK;
+}
+
+static int zonemap_vtab_rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  *pRowid = sqlite3_column_int64(cursor->stmt, ZONEMAP_VTAB_BLOCK);
+  return SQLITE_OK;
+}
+
+// The condition on the summary of a block under which some value in it may
+// satisfy "value op operand".
+static const char *zonemap_predicate_sql(const char *op) {
+  if (!op) {
+    return NULL;
+  }
+  if (!strcmp(op, ">")) {
+    return "max_value > ?%d";
+  }
+  if (!strcmp(op, ">=")) {
+    return "max_value >= ?%d";
+  }
+  if (!strcmp(op, "<")) {
+    return "min_value < ?%d";
+  }
+  if (!strcmp(op, "<=")) {
+    return "min_value <= ?%d";
+  }
+  if (!strcmp(op, "=") || !strcmp(op, "==")) {
+    return "min_value <= ?%d AND max_value >= ?%d";
+  }
+  if (!strcmp(op, "!=") || !strcmp(op, "<>")) {
+    return "(min_value != ?%d OR max_value != ?%d)";
+  }
+  return NULL;
+}
+
+// Returns the blocks in block (and so ts) order. Constraints on the summary
+// columns and the predicate are evaluated by a query on the blocks table.
+static int zonemap_vtab_filter(sqlite3_vtab_cursor *cur, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  UNUSED(argc);
+
+  zonemap_vtab_cursor *cursor = (zonemap_vtab_cursor *)cur;
+  zonemap_vtab *vtab = (zonemap_vtab *)cursor->base.pVtab;
+  sqlite3_finalize(cursor->stmt);
+  cursor->stmt = NULL;
+  cursor->eof = 1;
+
+  int n_terms = idxStr ? (int)strlen(idxStr) / 2 : 0;
+  const char *predicate = NULL;
+  if (idxNum & (ZONEMAP_IDX_OP | ZONEMAP_IDX_OPERAND)) {
+    if ((idxNum & ZONEMAP_IDX_OP) && (idxNum & ZONEMAP_IDX_OPERAND)) {
+      const char *op = (const char *)sqlite3_value_text(argv[n_terms]);
+      predicate = zonemap_predicate_sql(op);
+    }
+    if (!predicate) {
+      vtab->base.zErrMsg = sqlite3_mprintf(
+          "tslite_zonemap needs an operator (<, <=, =, !=, >=, >) and an "
+          "operand");
+      return SQLITE_ERROR;
+    }
+  }
+
+  sqlite3_str *sql = sqlite3_str_new(vtab->db);
+  sqlite3_str_appendf(sql,
+                      "SELECT block, min_ts, max_ts, min_value, max_value, "
+                      "count FROM \"%w\".\"%w_blocks\" WHERE 1",
+                      vtab->schema, vtab->name);
+  for (int i = 0; i < n_terms; i++) {
+    const char *op;
+    switch (idxStr[2 * i + 1]) {
+      case 'e':
+        op = "=";
+        break;
+      case 'g':
+        op = ">";
+        break;
+      case 'G':
+        op = ">=";
+        break;
+      case 'l':
+        op = "<";
+        break;
+      default:
+        op = "<=";
+        break;
+    }
+    sqlite3_str_appendf(sql, " AND %s %s ?%d",
+                        zonemap_columns[idxStr[2 * i] - '0'], op, i + 1);
+  }
+  if (predicate) {
+    sqlite3_str_appendall(sql, " AND ");
+    sqlite3_str_appendf(sql, predicate, n_terms + 1, n_terms + 1);
+  }
+  sqlite3_str_appendall(sql, " ORDER BY block");
+  char *z = sqlite3_str_finish(sql);
+  if (!z) {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = sqlite3_prepare_v2(vtab->db, z, -1, &cursor->stmt, NULL);
+  sqlite3_free(z);
+  if (rc != SQLITE_OK) {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return rc;
+  }
+  for (int i = 0; i < n_terms; i++) {
+    sqlite3_bind_value(cursor->stmt, i + 1, argv[i]);
+  }
+  if (predicate) {
+    sqlite3_bind_value(cursor->stmt, n_terms + 1, argv[n_terms + 1]);
+  }
+
+  cursor->eof = 0;
+  return zonemap_vtab_next(cur);
+}
+
+static int zonemap_vtab_best_index(sqlite3_vtab *vtab,
+                                   sqlite3_index_info *pIdxInfo) {
+  UNUSED(vtab);
+
+  // Two characters per constraint on a summary column: the column and the
+  // operator.
+  char terms[2 * 64 + 1];
+  int n_terms = 0;
+  int op = -1;
+  int operand = -1;
+
+  const struct sqlite3_index_constraint *constraint = pIdxInfo->aConstraint;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++, constraint++) {
+    if (constraint->iColumn == ZONEMAP_VTAB_OP ||
+        constraint->iColumn == ZONEMAP_VTAB_OPERAND) {
+      if (!constraint->usable) {
+        // Unusable constraint on an argument, reject the entire plan.
+        return SQLITE_CONSTRAINT;
+      }
+      if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+        if (constraint->iColumn == ZONEMAP_VTAB_OP) {
+          op = i;
+        } else {
+          operand = i;
+        }
+      }
+      continue;
+    }
+    if (!constraint->usable || constraint->iColumn < 0 || n_terms == 64) {
+      continue;
+    }
+    char c;
+    switch (constraint->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+        c = 'e';
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+        c = 'g';
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        c = 'G';
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LT:
+        c = 'l';
+        break;
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        c = 'L';
+        break;
+      default:
+        continue;
+    }
+    terms[2 * n_terms] = (char)('0' + constraint->iColumn);
+    terms[2 * n_terms + 1] = c;
+    n_terms++;
+    pIdxInfo->aConstraintUsage[i].argvIndex = n_terms;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+  }
+  terms[2 * n_terms] = 0;
+
+  int argvIndex = n_terms + 1;
+  pIdxInfo->idxNum = 0;
+  if (op >= 0) {
+    pIdxInfo->aConstraintUsage[op].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[op].omit = 1;
+    pIdxInfo->idxNum |= ZONEMAP_IDX_OP;
+  }
+  if (operand >= 0) {
+    pIdxInfo->aConstraintUsage[operand].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[operand].omit = 1;
+    pIdxInfo->idxNum |= ZONEMAP_IDX_OPERAND;
+  }
+  if (n_terms) {
+    pIdxInfo->idxStr = sqlite3_mprintf("%s", terms);
+    if (!pIdxInfo->idxStr) {
+      return SQLITE_NOMEM;
+    }
+    pIdxInfo->needToFreeIdxStr = 1;
+  }
+
+  pIdxInfo->estimatedCost = 10000.0 / (1 + n_terms + (op >= 0));
+  if (pIdxInfo->nOrderBy == 1 &&
+      (pIdxInfo->aOrderBy[0].iColumn == ZONEMAP_VTAB_BLOCK ||
+       pIdxInfo->aOrderBy[0].iColumn == ZONEMAP_VTAB_MIN_TS) &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+sqlite3_module zonemap_module = {
+    /* iVersion    */ 0,
+    /* xCreate     */ zonemap_vtab_create,
+    /* xConnect    */ zonemap_vtab_connect,
+    /* xBestIndex  */ zonemap_vtab_best_index,
+    /* xDisconnect */ zonemap_vtab_disconnect,
+    /* xDestroy    */ zonemap_vtab_destroy,
+    /* xOpen       */ zonemap_vtab_open,
+    /* xClose      */ zonemap_vtab_close,
+    /* xFilter     */ zonemap_vtab_filter,
+    /* xNext       */ zonemap_vtab_next,
+    /* xEof        */ zonemap_vtab_eof,
+    /* xColumn     */ zonemap_vtab_column,
+    /* xRowid      */ zonemap_vtab_rowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0,
+};
@@ -0,0 +1,22 @@
+#ifndef TSLITE_ZONEMAP_H
+#define TSLITE_ZONEMAP_H
+
+#include "tslite.h"
+#include "vtab.h"
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  char *schema;
+  char *name;
+  char *table;
+  sqlite3_int64 block_width;
+} zonemap_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_stmt *stmt;
+  int eof;
+} zonemap_vtab_cursor;
+
+#endif  // TSLITE_ZONEMAP_H